@@ -0,0 +1,320 @@
+// Times History without a terminal on synthetic histories: loading with
+// and without a cache, deduplication, filtering and line layout. Prints a
+// table and writes the same numbers as JSON, to compare between commits.
+//
+//   .build/bench/history --lines 10000,1000000 --dup 0.6 --json before.json
+//   .build/bench/history --generate ~/big_history --lines 10000000
+
+#include "history.h"
+#include "historycache.h"
+#include "historyfile.h"
+#include "layout.h"
+#include "lineset.h"
+#include "report.h"
+#include "synthetic.h"
+#include "trace.h"
+#include <cxxopts.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Results a screen would ask for first
+#define BENCH_PAGE_ITEMS 100
+
+// Timings are the median of this many runs, or fewer for slow loads
+#define BENCH_REPEATS 5
+#define BENCH_LOAD_REPEATS 3
+
+struct FilterTiming {
+	const char* pattern;
+	MatchMode mode;
+	size_t matches;
+	double firstPageMs;
+	double completeMs;
+};
+
+struct LayoutTiming {
+	size_t width;
+	size_t lines;
+	double nsPerLine;
+	double partsPerLine;
+};
+
+struct SizeResult {
+	SyntheticStats stats;
+	size_t distinct;
+	double loadColdMs;
+	double loadCachedMs;
+	double dedupNsPerLine;
+	std::vector<FilterTiming> filters;
+	std::vector<LayoutTiming> layouts;
+};
+
+template <typename Function>
+static double medianMs(Function run, int repeats = BENCH_REPEATS)
+{
+	std::vector<double> times;
+	for (int r = 0; r < repeats; ++r) {
+		auto start = std::chrono::steady_clock::now();
+		run();
+		times.push_back(elapsedMs(start));
+	}
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+// Line set inserts of every line, which is all deduplication does
+static double timeDedup(const HistoryFile& file)
+{
+	LineSet set;
+	double ms = medianMs([&] {
+		set.clear();
+		set.reserve(file, file.size());
+		for (size_t i = 0; i < file.size(); ++i) {
+			set.insert(file, static_cast<uint32_t>(i));
+		}
+	});
+	return ms * 1e6 / std::max<size_t>(file.size(), 1);
+}
+
+static FilterTiming timeFilter(History& history, const char* pattern, MatchMode mode)
+{
+	// Start from the empty pattern each time, so nothing is refined from
+	// an earlier result set
+	FilterTiming timing = {pattern, mode, 0, 0.0, 0.0};
+	std::vector<double> firstPage, complete;
+	for (int r = 0; r < BENCH_REPEATS; ++r) {
+		history.filter("");
+		auto start = std::chrono::steady_clock::now();
+		history.filter(pattern, mode);
+		bool done = history.search(BENCH_PAGE_ITEMS, SIZE_MAX);
+		firstPage.push_back(elapsedMs(start));
+		while (!done) {
+			done = history.search(SIZE_MAX, SIZE_MAX);
+		}
+		complete.push_back(elapsedMs(start));
+		timing.matches = history.items().size();
+	}
+	std::sort(firstPage.begin(), firstPage.end());
+	std::sort(complete.begin(), complete.end());
+	timing.firstPageMs = firstPage[BENCH_REPEATS / 2];
+	timing.completeMs = complete[BENCH_REPEATS / 2];
+	return timing;
+}
+
+// What drawing a screen does per line, over every result of a pattern
+static LayoutTiming timeLayout(const History& history, const char* pattern, MatchMode mode, size_t width)
+{
+	const HistoryItems& items = history.items();
+	std::vector<LineRange> matches;
+	size_t parts = 0;
+	double ms = medianMs([&] {
+		for (size_t i = 0; i < items.size(); ++i) {
+			HistoryItem item = items[i];
+			History::itemMatches(item, pattern, mode, matches);
+			LineText line = makeLineFromHistory(item, matches);
+			fitLine(line, width);
+			parts += line.parts.size();
+		}
+	});
+	size_t lines = std::max<size_t>(items.size(), 1);
+	return {width, items.size(), ms * 1e6 / lines, static_cast<double>(parts) / BENCH_REPEATS / lines};
+}
+
+static SizeResult runSize(const std::string& directory, const SyntheticOptions& options)
+{
+	SizeResult result = {};
+	std::string path = directory + "/history-" + std::to_string(options.lines);
+	if (!writeSyntheticHistory(path, options, &result.stats)) {
+		perror(path.c_str());
+		exit(1);
+	}
+
+	// A cold load scans, deduplicates, indexes and writes the cache
+	std::string cachePath = HistoryCache::pathFor(path);
+	result.loadColdMs = medianMs([&] {
+		unlink(cachePath.c_str());
+		History history(path);
+	}, BENCH_LOAD_REPEATS);
+	result.loadCachedMs = medianMs([&] {
+		History history(path);
+	});
+
+	HistoryFile file;
+	if (!file.open(path)) {
+		perror(path.c_str());
+		exit(1);
+	}
+	result.distinct = file.distinct().size();
+	result.dedupNsPerLine = timeDedup(file);
+	file.close();
+
+	const struct {
+		const char* pattern;
+		MatchMode mode;
+	} patterns[] = {
+		{"s", MATCH_EXACT},
+		{"git", MATCH_EXACT},
+		{"commit -m", MATCH_EXACT},
+		{"origin main", MATCH_EXACT},
+		{"not present anywhere", MATCH_EXACT},
+		{"gcm", MATCH_FUZZY},
+		{"kgpn", MATCH_FUZZY},
+		{"git (push|pull) .*origin", MATCH_REGEX},
+		{"^(docker|kubectl) [a-z]+ -", MATCH_REGEX},
+	};
+	History history(path);
+	for (const auto& p : patterns) {
+		result.filters.push_back(timeFilter(history, p.pattern, p.mode));
+	}
+
+	// Narrow screens collapse most parts, wide ones few
+	timeFilter(history, "git", MATCH_EXACT);
+	for (size_t width : {40, 80, 200}) {
+		result.layouts.push_back(timeLayout(history, "git", MATCH_EXACT, width));
+	}
+
+	unlink(cachePath.c_str());
+	unlink(path.c_str());
+	return result;
+}
+
+static void printResult(const SizeResult& result)
+{
+	printf("%zu lines, %zu distinct, %.1f MB, longest %zu bytes\n", result.stats.lines, result.distinct,
+		result.stats.bytes / 1e6, result.stats.longestLine);
+	printf("  load %.2f ms cold, %.2f ms cached, dedup %.1f ns/line\n", result.loadColdMs, result.loadCachedMs,
+		result.dedupNsPerLine);
+	printf("  %-24s %6s %10s %12s %12s\n", "pattern", "mode", "matches", "first (ms)", "all (ms)");
+	for (const FilterTiming& f : result.filters) {
+		printf("  %-24s %6s %10zu %12.3f %12.3f\n", f.pattern, matchModeName(f.mode), f.matches,
+			f.firstPageMs, f.completeMs);
+	}
+	for (const LayoutTiming& l : result.layouts) {
+		printf("  layout width %zu: %.1f ns/line, %.1f parts/line over %zu lines\n", l.width, l.nsPerLine, l.partsPerLine, l.lines);
+	}
+}
+
+static bool writeJson(const std::string& path, const SyntheticOptions& options, const std::vector<SizeResult>& results)
+{
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file) {
+		return false;
+	}
+	fprintf(file, "{\"bench\":\"history\",\"revision\":\"%s\",\"dupRatio\":%g,\"meanWords\":%g,\"longRatio\":%g,\"seed\":%u,\"sizes\":[",
+		gitRevision().c_str(), options.dupRatio, options.meanWords, options.longRatio, options.seed);
+	for (size_t i = 0; i < results.size(); ++i) {
+		const SizeResult& r = results[i];
+		fprintf(file, "%s\n{\"lines\":%zu,\"distinct\":%zu,\"bytes\":%zu,\"longestLine\":%zu,"
+			"\"loadColdMs\":%.3f,\"loadCachedMs\":%.3f,\"dedupNsPerLine\":%.2f,\"filters\":[",
+			i ? "," : "", r.stats.lines, r.distinct, r.stats.bytes, r.stats.longestLine,
+			r.loadColdMs, r.loadCachedMs, r.dedupNsPerLine);
+		for (size_t j = 0; j < r.filters.size(); ++j) {
+			const FilterTiming& f = r.filters[j];
+			fprintf(file, "%s{\"pattern\":%s,\"mode\":\"%s\",\"matches\":%zu,\"firstPageMs\":%.3f,\"completeMs\":%.3f}",
+				j ? "," : "", jsonString(f.pattern).c_str(), matchModeName(f.mode), f.matches, f.firstPageMs, f.completeMs);
+		}
+		fprintf(file, "],\"layout\":[");
+		for (size_t j = 0; j < r.layouts.size(); ++j) {
+			const LayoutTiming& l = r.layouts[j];
+			fprintf(file, "%s{\"width\":%zu,\"lines\":%zu,\"nsPerLine\":%.2f,\"partsPerLine\":%.2f}",
+				j ? "," : "", l.width, l.lines, l.nsPerLine, l.partsPerLine);
+		}
+		fprintf(file, "]}");
+	}
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0;
+}
+
+int main(int argc, char** argv)
+{
+	traceInit();
+
+	SyntheticOptions synthetic;
+	std::vector<size_t> sizes;
+	std::string jsonPath = std::string(argv[0]) + ".json";
+	std::string generatePath;
+
+	cxxopts::Options options("history", "Benchmark loading, deduplicating, filtering and laying out synthetic histories.");
+	try {
+		options.add_options()
+			("lines", "History sizes to run, comma separated", cxxopts::value<std::string>()->default_value("10000,100000,1000000"))
+			("dup", "Fraction of lines that repeat an earlier one", cxxopts::value<double>()->default_value("0.6"))
+			("words", "Mean words per line", cxxopts::value<double>()->default_value("5"))
+			("long", "Fraction of long, pasted lines", cxxopts::value<double>()->default_value("0.01"))
+			("seed", "Random seed", cxxopts::value<uint32_t>()->default_value("1"))
+			("json", "Write results here. Defaults to the program's path with .json appended.", cxxopts::value<std::string>())
+			("generate", "Just write a history of the first size to this file", cxxopts::value<std::string>())
+			("h,help", "Print usage")
+		;
+		auto result = options.parse(argc, argv);
+		if (result.count("help")) {
+			std::cout << options.help() << std::endl;
+			return 0;
+		}
+		std::string lines = result["lines"].as<std::string>();
+		for (const char* p = lines.c_str(); *p;) {
+			char* end;
+			sizes.push_back(strtoull(p, &end, 10));
+			if (end == p || (*end && *end != ',') || !sizes.back()) {
+				std::cerr << "Bad --lines " << lines << std::endl;
+				return 1;
+			}
+			p = *end ? end + 1 : end;
+		}
+		synthetic.dupRatio = result["dup"].as<double>();
+		synthetic.meanWords = result["words"].as<double>();
+		synthetic.longRatio = result["long"].as<double>();
+		synthetic.seed = result["seed"].as<uint32_t>();
+		if (result.count("json")) {
+			jsonPath = result["json"].as<std::string>();
+		}
+		if (result.count("generate")) {
+			generatePath = result["generate"].as<std::string>();
+		}
+	} catch (cxxopts::OptionException e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	if (!generatePath.empty()) {
+		synthetic.lines = sizes.empty() ? synthetic.lines : sizes.front();
+		if (!writeSyntheticHistory(generatePath, synthetic)) {
+			perror(generatePath.c_str());
+			return 1;
+		}
+		return 0;
+	}
+
+	// Histories and their caches go in a scratch directory, leaving the
+	// user's cache alone
+	const char* tmp = getenv("TMPDIR");
+	std::string directory = std::string(tmp && *tmp ? tmp : "/tmp") + "/shist-bench-XXXXXX";
+	if (!mkdtemp(&directory[0])) {
+		perror(directory.c_str());
+		return 1;
+	}
+	setenv("XDG_CACHE_HOME", directory.c_str(), 1);
+
+	std::vector<SizeResult> results;
+	for (size_t lines : sizes) {
+		synthetic.lines = lines;
+		results.push_back(runSize(directory, synthetic));
+		printResult(results.back());
+	}
+	rmdir((directory + "/shist").c_str());
+	rmdir(directory.c_str());
+
+	if (!writeJson(jsonPath, synthetic, results)) {
+		perror(jsonPath.c_str());
+		return 1;
+	}
+	printf("Wrote %s\n", jsonPath.c_str());
+	return 0;
+}
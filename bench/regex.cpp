@@ -0,0 +1,249 @@
+// Checks Regex against std::regex on random patterns and texts, then times
+// patterns whose matches are costly to find on long lines. Exits non-zero
+// if any case disagrees, printing the first few.
+//
+//   .build/bench/regex --cases 100000 --seed 7
+
+#include "regex.h"
+#include "report.h"
+#include <cxxopts.hpp>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+// Mismatches printed before giving up
+#define BENCH_MAX_MISMATCHES 20
+
+// Pieces of random patterns. std::regex's POSIX syntax is the reference, so
+// nothing here relies on lazy repeats, which Regex reads like Perl.
+static const char* g_atoms[] = {
+	"a", "b", "c", "x", ".", "[ab]", "[^a]", "[a-c]", "\\d", "(a|b)", "(ab|c)", "(a|bc)*",
+	"(|a)", "a?", "b+", "c{1,2}", "^", "$",
+};
+static const char* g_repeats[] = {"", "", "", "*", "+", "?", "{2}", "{0,2}"};
+
+// Newlines are left out, as std::regex lets . match them
+static const char g_alphabet[] = "abcx1-";
+
+static std::string randomPattern(std::mt19937& rng)
+{
+	std::string pattern;
+	int atoms = 1 + rng() % 4;
+	for (int i = 0; i < atoms; ++i) {
+		std::string atom = g_atoms[rng() % (sizeof(g_atoms) / sizeof(g_atoms[0]))];
+		// A repeat after a repeat would be lazy
+		if (atom != "^" && atom != "$" && !strchr("*+?}", atom.back())) {
+			atom += g_repeats[rng() % (sizeof(g_repeats) / sizeof(g_repeats[0]))];
+		}
+		pattern += atom;
+		if (i + 1 < atoms && rng() % 7 == 0) {
+			pattern += '|';
+		}
+	}
+	return pattern;
+}
+
+// POSIX leftmost-longest matches, found by trying every span
+static std::vector<RegexMatch> referenceMatches(const std::string& text, const std::regex& reference)
+{
+	std::vector<RegexMatch> matches;
+	size_t from = 0;
+	for (size_t start = 0; start < text.size(); ++start) {
+		if (start < from) {
+			continue;
+		}
+		size_t end = start;
+		for (size_t e = start + 1; e <= text.size(); ++e) {
+			auto flags = std::regex_constants::match_default;
+			if (start > 0) {
+				flags |= std::regex_constants::match_not_bol | std::regex_constants::match_prev_avail;
+			}
+			if (e < text.size()) {
+				flags |= std::regex_constants::match_not_eol;
+			}
+			if (std::regex_match(text.begin() + start, text.begin() + e, reference, flags)) {
+				end = e;
+			}
+		}
+		if (end > start) {
+			matches.push_back({static_cast<uint32_t>(start), static_cast<uint32_t>(end - start)});
+			from = end;
+		}
+	}
+	return matches;
+}
+
+static std::string formatMatches(const std::vector<RegexMatch>& matches)
+{
+	std::string text;
+	for (const RegexMatch& match : matches) {
+		text += " " + std::to_string(match.start) + "+" + std::to_string(match.size);
+	}
+	return text.empty() ? " none" : text;
+}
+
+static bool sameMatches(const std::vector<RegexMatch>& a, const std::vector<RegexMatch>& b)
+{
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.size(); ++i) {
+		if (a[i].start != b[i].start || a[i].size != b[i].size) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns the number of cases that disagree
+static size_t check(size_t cases, uint32_t seed, size_t* checked)
+{
+	std::mt19937 rng(seed);
+	size_t mismatches = 0;
+	*checked = 0;
+	auto report = [&mismatches](const char* what, const std::string& pattern, const std::string& text, const std::string& detail) {
+		if (++mismatches <= BENCH_MAX_MISMATCHES) {
+			printf("  %s: /%s/ on \"%s\":%s\n", what, pattern.c_str(), text.c_str(), detail.c_str());
+		}
+	};
+	while (*checked < cases && mismatches < BENCH_MAX_MISMATCHES) {
+		std::string pattern = randomPattern(rng);
+		std::regex reference;
+		try {
+			reference = std::regex(pattern, std::regex::extended);
+		} catch (const std::regex_error&) {
+			continue;
+		}
+		Regex regex(pattern);
+		if (!regex.valid()) {
+			report("rejected", pattern, "", " " + regex.error());
+			continue;
+		}
+
+		for (int i = 0; i < 10 && *checked < cases; ++i, ++*checked) {
+			std::string text;
+			for (size_t length = rng() % 10; text.size() < length;) {
+				text += g_alphabet[rng() % (sizeof(g_alphabet) - 1)];
+			}
+
+			bool expected = std::regex_search(text, reference);
+			if (regex.search(text) != expected) {
+				report("search", pattern, text, expected ? " should match" : " shouldn't match");
+			}
+			if (expected && text.find(regex.literal()) == std::string::npos) {
+				report("literal", pattern, text, " lacks \"" + regex.literal() + "\"");
+			}
+
+			std::vector<RegexMatch> want = referenceMatches(text, reference);
+			std::vector<RegexMatch> got;
+			regex.findAll(text, 0, text.size(), got);
+			if (!sameMatches(want, got)) {
+				report("spans", pattern, text, " want" + formatMatches(want) + ", got" + formatMatches(got));
+			}
+
+			// Resuming where an earlier call stopped, as drawing does,
+			// finds the same matches
+			std::vector<RegexMatch> split;
+			size_t next = regex.findAll(text, 0, text.size() / 2, split);
+			regex.findAll(text, next, text.size(), split);
+			if (!sameMatches(want, split)) {
+				report("resumed spans", pattern, text, " want" + formatMatches(want) + ", got" + formatMatches(split));
+			}
+		}
+	}
+	return mismatches;
+}
+
+struct Timing {
+	const char* pattern;
+	size_t size;
+	size_t matches;
+	double searchMs;
+	double findMs;
+};
+
+static Timing timeLine(const char* pattern, char fill, size_t size)
+{
+	Regex regex(pattern);
+	std::string line(size, fill);
+	Timing timing{pattern, size};
+
+	auto start = std::chrono::steady_clock::now();
+	regex.search(line);
+	timing.searchMs = elapsedMs(start);
+
+	std::vector<RegexMatch> matches;
+	start = std::chrono::steady_clock::now();
+	regex.findAll(line, 0, line.size(), matches);
+	timing.findMs = elapsedMs(start);
+	timing.matches = matches.size();
+	return timing;
+}
+
+int main(int argc, char** argv)
+{
+	size_t cases;
+	uint32_t seed;
+	std::string jsonPath = std::string(argv[0]) + ".json";
+
+	cxxopts::Options options("regex", "Check regex matching against std::regex and time long lines.");
+	try {
+		options.add_options()
+			("cases", "Random pattern and text pairs to check", cxxopts::value<size_t>()->default_value("20000"))
+			("seed", "Random seed", cxxopts::value<uint32_t>()->default_value("1"))
+			("json", "Write results here. Defaults to the program's path with .json appended.", cxxopts::value<std::string>())
+			("h,help", "Print usage")
+		;
+		auto result = options.parse(argc, argv);
+		if (result.count("help")) {
+			std::cout << options.help() << std::endl;
+			return 0;
+		}
+		cases = result["cases"].as<size_t>();
+		seed = result["seed"].as<uint32_t>();
+		if (result.count("json")) {
+			jsonPath = result["json"].as<std::string>();
+		}
+	} catch (cxxopts::OptionException e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	size_t checked;
+	size_t mismatches = check(cases, seed, &checked);
+	printf("%zu cases against std::regex, %zu mismatches\n", checked, mismatches);
+
+	// Lines where each match could run on to the end of the line
+	std::vector<Timing> timings;
+	for (size_t size : {10000, 40000, 160000}) {
+		timings.push_back(timeLine("a|a[^y]*y", 'a', size));
+		timings.push_back(timeLine("(a|b)*c", 'a', size));
+		timings.push_back(timeLine("|a[^y]*y", 'a', size));
+	}
+	printf("  %-12s %8s %10s %12s %12s\n", "pattern", "bytes", "matches", "search (ms)", "spans (ms)");
+	for (const Timing& t : timings) {
+		printf("  %-12s %8zu %10zu %12.3f %12.3f\n", t.pattern, t.size, t.matches, t.searchMs, t.findMs);
+	}
+
+	FILE* file = fopen(jsonPath.c_str(), "w");
+	if (!file) {
+		perror(jsonPath.c_str());
+		return 1;
+	}
+	fprintf(file, "{\"bench\":\"regex\",\"revision\":\"%s\",\"cases\":%zu,\"seed\":%u,\"mismatches\":%zu,\"lines\":[",
+		gitRevision().c_str(), checked, seed, mismatches);
+	for (size_t i = 0; i < timings.size(); ++i) {
+		const Timing& t = timings[i];
+		fprintf(file, "%s\n{\"pattern\":%s,\"bytes\":%zu,\"matches\":%zu,\"searchMs\":%.3f,\"spansMs\":%.3f}",
+			i ? "," : "", jsonString(t.pattern).c_str(), t.size, t.matches, t.searchMs, t.findMs);
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	printf("Wrote %s\n", jsonPath.c_str());
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,470 @@
+// Replays keystroke scripts into a Screen on a pseudo-terminal and times
+// each keystroke from being typed until the screen has settled: input read
+// through readline, the search finished enough to fill the visible rows,
+// and the frame presented. Reports percentiles per session, as a table and
+// as JSON.
+//
+//   .build/bench/replay --lines 1000000 --json before.json
+//   .build/bench/replay --history ~/.bash_history --script keys.txt
+//
+// A script is typed a character at a time. Named keys go in angle
+// brackets, e.g. "git<bs><bs><up><pgup>". Lines starting with # are
+// comments and line breaks are ignored.
+
+#include "historycache.h"
+#include "input.h"
+#include "report.h"
+#include "screen.h"
+#include "synthetic.h"
+#include "trace.h"
+#include <cxxopts.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <readline/readline.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A keystroke that hasn't settled after this long is counted as this long
+#define REPLAY_TIMEOUT_MS 10000
+
+struct Keystroke {
+	std::string bytes;
+	std::string name;
+};
+
+struct Session {
+	std::string name;
+	std::string script;
+};
+
+struct SessionResult {
+	std::string name;
+	std::vector<double> latencies;
+	std::vector<std::string> keys;
+	size_t timeouts = 0;
+};
+
+// Typing and editing patterns of growing selectivity, as someone hunting
+// for a command would
+static const Session g_cannedSessions[] = {
+	{"typing",
+		"git commit -m<c-u>"
+		"docker run --rm -it<c-u>"
+		"kubectl get pods -n default<c-u>"
+		"file-<c-u>"
+		"<c-t>gcm<c-u>kgpn<c-u><c-t>"
+		"tail -f /var/log/syslog<c-u>"},
+	{"backspacing",
+		"git checkout -b<bs><bs><bs><bs><bs><bs><bs><bs><bs><bs><bs><bs><bs><bs><bs>"
+		"origin main<c-w><c-w><c-u>"
+		"sort uniq<bs><bs><bs><bs><bs><bs><bs><bs><bs>"
+		"<c-t>dkrr<bs><bs><bs><bs><c-t>"},
+	{"paging",
+		"<pgup><pgup><pgup><pgup><pgup><pgup><pgup><pgup><pgup><pgup>"
+		"<pgdn><pgdn><pgdn><pgdn><pgdn><pgdn><pgdn><pgdn><pgdn><pgdn>"
+		"git"
+		"<up><up><up><up><up><up><up><up><up><up><up><up><up><up><up><up><up><up><up><up>"
+		"<pgup><pgup><pgup><pgup><pgup><pgdn><pgdn><pgdn><pgdn><pgdn>"
+		"<down><down><down><down><down><down><down><down><down><down>"},
+	{"wrapping",
+		"<down><down><down><down><down><up><up><up><up><up><up>"
+		"s<down><down><down><pgdn><pgdn><pgup><pgup><pgup>"
+		"<c-u>commit -m<down><down><up><up><up>"
+		"<c-u><c-t>gcm<down><down><pgdn><up><c-t>"},
+};
+
+static const struct {
+	const char* name;
+	const char* bytes;
+} g_keyNames[] = {
+	{"up", "\x1b[A"},
+	{"down", "\x1b[B"},
+	{"right", "\x1b[C"},
+	{"left", "\x1b[D"},
+	{"home", "\x1b[H"},
+	{"end", "\x1b[F"},
+	{"pgup", "\x1b[5~"},
+	{"pgdn", "\x1b[6~"},
+	{"bs", "\x7f"},
+	{"tab", "\t"},
+	{"lt", "<"},
+	{"c-a", "\x01"},
+	{"c-e", "\x05"},
+	{"c-r", "\x12"},
+	{"c-s", "\x13"},
+	{"c-t", "\x14"},
+	{"c-u", "\x15"},
+	{"c-w", "\x17"},
+};
+
+// Returns false with a message if the script names an unknown key
+static bool parseScript(const std::string& script, std::vector<Keystroke>& keys)
+{
+	std::istringstream lines(script);
+	std::string line;
+	while (std::getline(lines, line)) {
+		if (!line.empty() && line[0] == '#') {
+			continue;
+		}
+		for (size_t i = 0; i < line.size(); ++i) {
+			if (line[i] != '<') {
+				keys.push_back({std::string(1, line[i]), std::string(1, line[i])});
+				continue;
+			}
+			size_t end = line.find('>', i);
+			std::string name = line.substr(i + 1, end == std::string::npos ? end : end - i - 1);
+			auto found = std::find_if(std::begin(g_keyNames), std::end(g_keyNames), [&](const auto& key) {
+				return name == key.name;
+			});
+			if (end == std::string::npos || found == std::end(g_keyNames)) {
+				std::cerr << "Unknown key <" << name << "> in script" << std::endl;
+				return false;
+			}
+			keys.push_back({found->bytes, "<" + name + ">"});
+			i = end;
+		}
+	}
+	return true;
+}
+
+// The pseudo-terminal the Screen draws on. Its stdin and stdout are the
+// terminal side, and what it draws is read from the other side and
+// discarded, as a terminal would.
+class ReplayTerminal {
+public:
+	bool open(int rows, int cols)
+	{
+		m_master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (m_master < 0 || grantpt(m_master) != 0 || unlockpt(m_master) != 0) {
+			return false;
+		}
+		int terminal = ::open(ptsname(m_master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+		if (terminal < 0) {
+			return false;
+		}
+		struct winsize size = {};
+		size.ws_row = rows;
+		size.ws_col = cols;
+		ioctl(terminal, TIOCSWINSZ, &size);
+
+		m_stdin = dup(STDIN_FILENO);
+		m_stdout = dup(STDOUT_FILENO);
+		fflush(stdout);
+		dup2(terminal, STDIN_FILENO);
+		dup2(terminal, STDOUT_FILENO);
+		::close(terminal);
+		m_drain = std::thread([this] {
+			char buffer[65536];
+			while (read(m_master, buffer, sizeof(buffer)) > 0) {
+			}
+		});
+		return true;
+	}
+
+	// Once the last terminal side fd closes, reads of the other side fail
+	// and the drain stops
+	void close()
+	{
+		fflush(stdout);
+		dup2(m_stdin, STDIN_FILENO);
+		dup2(m_stdout, STDOUT_FILENO);
+		::close(m_stdin);
+		::close(m_stdout);
+		m_drain.join();
+		::close(m_master);
+	}
+
+	void type(const std::string& bytes)
+	{
+		if (write(m_master, bytes.data(), bytes.size()) != static_cast<ssize_t>(bytes.size())) {
+			perror("replay");
+		}
+	}
+
+private:
+	int m_master = -1;
+	int m_stdin = -1;
+	int m_stdout = -1;
+	std::thread m_drain;
+};
+
+// Bound as in main.cpp
+static Screen* g_screen;
+static int arrowUp(int, int) {g_screen->moveSelection(1, false, false); return 0;}
+static int arrowDown(int, int) {g_screen->moveSelection(-1, false, false); return 0;}
+static int pageUp(int, int) {g_screen->moveSelection(1, true, false); return 0;}
+static int pageDown(int, int) {g_screen->moveSelection(-1, true, false); return 0;}
+static int toggleMode(int, int) {g_screen->toggleMode(); return 0;}
+static void patternChanged(const char* pattern, int cursor) {g_screen->setFilter(pattern, cursor);}
+
+// Handles results and input as main() does until inputBytes of input have
+// been read and the screen has settled. Returns false on timeout.
+static bool settle(Screen& screen, size_t inputBytes, std::chrono::steady_clock::time_point start)
+{
+	enum { POLL_INPUT, POLL_RESULTS, POLL_COUNT };
+	struct pollfd fds[POLL_COUNT] = {};
+	fds[POLL_INPUT] = {STDIN_FILENO, POLLIN, 0};
+	fds[POLL_RESULTS] = {screen.resultsFd(), POLLIN, 0};
+	size_t consumed = 0;
+	while (consumed < inputBytes || !screen.settled()) {
+		int remaining = REPLAY_TIMEOUT_MS - static_cast<int>(elapsedMs(start));
+		if (remaining <= 0) {
+			return false;
+		}
+		if (poll(fds, POLL_COUNT, remaining) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		if (fds[POLL_RESULTS].revents) {
+			screen.update();
+		}
+		if (fds[POLL_INPUT].revents) {
+			int c;
+			while (screen.getChar(&c)) {
+				readline_step(c);
+				++consumed;
+			}
+		}
+	}
+	return true;
+}
+
+static SessionResult replay(ReplayTerminal& terminal, const Session& session, const std::vector<Keystroke>& keys, MatchMode mode, int pauseMs)
+{
+	SessionResult result;
+	result.name = session.name;
+
+	// Each session starts from a new screen with an empty pattern
+	Screen screen(mode, false);
+	g_screen = &screen;
+	rl_bind_keyseq("\\e[A", arrowUp);
+	rl_bind_keyseq("\\C-r", arrowUp);
+	rl_bind_keyseq("\\e[B", arrowDown);
+	rl_bind_keyseq("\\C-s", arrowUp);
+	rl_bind_keyseq("\\e[5~", pageUp);
+	rl_bind_keyseq("\\e[6~", pageDown);
+	rl_bind_keyseq("\\C-t", toggleMode);
+	readline_begin("", 0, patternChanged);
+	settle(screen, 0, std::chrono::steady_clock::now());
+
+	for (const Keystroke& key : keys) {
+		if (pauseMs) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(pauseMs));
+		}
+		TRACE_SCOPE("keystroke");
+		auto start = std::chrono::steady_clock::now();
+		terminal.type(key.bytes);
+		if (!settle(screen, key.bytes.size(), start)) {
+			++result.timeouts;
+		}
+		result.latencies.push_back(elapsedMs(start));
+		result.keys.push_back(key.name);
+	}
+
+	readline_end();
+	g_screen = nullptr;
+	return result;
+}
+
+struct Summary {
+	double p50, p95, p99, max;
+	std::string worst;
+};
+
+static Summary summarize(const std::vector<double>& latencies, const std::vector<std::string>& keys)
+{
+	std::vector<double> sorted = latencies;
+	std::sort(sorted.begin(), sorted.end());
+	Summary summary = {percentile(sorted, 0.5), percentile(sorted, 0.95), percentile(sorted, 0.99), 0.0, ""};
+	for (size_t i = 0; i < latencies.size(); ++i) {
+		if (latencies[i] >= summary.max) {
+			summary.max = latencies[i];
+			summary.worst = "#" + std::to_string(i) + " " + keys[i];
+		}
+	}
+	return summary;
+}
+
+static void printSummary(const std::string& name, size_t count, size_t timeouts, const Summary& s)
+{
+	printf("%-12s %6zu %10.3f %10.3f %10.3f %10.3f  %s%s\n", name.c_str(), count, s.p50, s.p95, s.p99, s.max,
+		s.worst.c_str(), timeouts ? " (timed out)" : "");
+}
+
+static void writeSummary(FILE* file, const std::string& name, size_t count, size_t timeouts, const Summary& s)
+{
+	fprintf(file, "{\"name\":%s,\"keys\":%zu,\"timeouts\":%zu,\"p50Ms\":%.3f,\"p95Ms\":%.3f,\"p99Ms\":%.3f,\"maxMs\":%.3f,\"worst\":%s}",
+		jsonString(name).c_str(), count, timeouts, s.p50, s.p95, s.p99, s.max, jsonString(s.worst).c_str());
+}
+
+int main(int argc, char** argv)
+{
+	traceInit();
+
+	SyntheticOptions synthetic;
+	synthetic.lines = 200000;
+	std::string historyPath;
+	std::string jsonPath = std::string(argv[0]) + ".json";
+	std::vector<Session> sessions;
+	MatchMode mode = MATCH_EXACT;
+	int rows, cols, pauseMs;
+
+	cxxopts::Options options("replay", "Time keystrokes replayed into shist's screen on a pseudo-terminal.");
+	try {
+		options.add_options()
+			("history", "History file to search. Defaults to a synthetic one.", cxxopts::value<std::string>())
+			("lines", "Lines in the synthetic history", cxxopts::value<size_t>()->default_value("200000"))
+			("dup", "Fraction of synthetic lines that repeat an earlier one", cxxopts::value<double>()->default_value("0.6"))
+			("script", "Replay this keystroke script instead of the canned sessions", cxxopts::value<std::string>())
+			("m,mode", "Matching mode to start in: exact, fuzzy or regex", cxxopts::value<std::string>()->default_value("exact"))
+			("rows", "Terminal rows", cxxopts::value<int>()->default_value("40"))
+			("cols", "Terminal columns", cxxopts::value<int>()->default_value("120"))
+			("pause", "Milliseconds between keystrokes once the last has settled", cxxopts::value<int>()->default_value("0"))
+			("json", "Write results here. Defaults to the program's path with .json appended.", cxxopts::value<std::string>())
+			("h,help", "Print usage")
+		;
+		auto result = options.parse(argc, argv);
+		if (result.count("help")) {
+			std::cout << options.help() << std::endl;
+			return 0;
+		}
+		if (result.count("history")) {
+			historyPath = result["history"].as<std::string>();
+		}
+		synthetic.lines = result["lines"].as<size_t>();
+		synthetic.dupRatio = result["dup"].as<double>();
+		if (result.count("script")) {
+			std::string scriptPath = result["script"].as<std::string>();
+			std::ifstream file(scriptPath);
+			if (!file) {
+				std::cerr << "Failed to read " << scriptPath << std::endl;
+				return 1;
+			}
+			std::stringstream script;
+			script << file.rdbuf();
+			sessions.push_back({scriptPath, script.str()});
+		} else {
+			sessions.assign(std::begin(g_cannedSessions), std::end(g_cannedSessions));
+		}
+		auto modeName = result["mode"].as<std::string>();
+		if (!parseMatchMode(modeName, &mode)) {
+			std::cerr << "Unknown mode " << modeName << std::endl;
+			return 1;
+		}
+		rows = result["rows"].as<int>();
+		cols = result["cols"].as<int>();
+		pauseMs = result["pause"].as<int>();
+		if (result.count("json")) {
+			jsonPath = result["json"].as<std::string>();
+		}
+	} catch (cxxopts::OptionException e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	std::vector<std::vector<Keystroke>> scripts;
+	for (const Session& session : sessions) {
+		scripts.emplace_back();
+		if (!parseScript(session.script, scripts.back())) {
+			return 1;
+		}
+	}
+
+	// A synthetic history and its cache go in a scratch directory
+	const char* tmp = getenv("TMPDIR");
+	std::string directory = std::string(tmp && *tmp ? tmp : "/tmp") + "/shist-replay-XXXXXX";
+	if (!mkdtemp(&directory[0])) {
+		perror(directory.c_str());
+		return 1;
+	}
+	setenv("XDG_CACHE_HOME", directory.c_str(), 1);
+	if (historyPath.empty()) {
+		historyPath = directory + "/history";
+		if (!writeSyntheticHistory(historyPath, synthetic)) {
+			perror(historyPath.c_str());
+			return 1;
+		}
+	}
+	setenv("HISTFILE", historyPath.c_str(), 1);
+	if (!getenv("TERM")) {
+		setenv("TERM", "xterm-256color", 1);
+	}
+
+	ReplayTerminal terminal;
+	if (!terminal.open(rows, cols)) {
+		perror("replay: pseudo-terminal");
+		return 1;
+	}
+	std::vector<SessionResult> results;
+	try {
+		for (size_t i = 0; i < sessions.size(); ++i) {
+			results.push_back(replay(terminal, sessions[i], scripts[i], mode, pauseMs));
+		}
+	} catch (std::runtime_error err) {
+		terminal.close();
+		std::cerr << err.what() << std::endl;
+		return 1;
+	}
+	terminal.close();
+
+	if (historyPath == directory + "/history") {
+		unlink(historyPath.c_str());
+	}
+	unlink(HistoryCache::pathFor(historyPath).c_str());
+	rmdir((directory + "/shist").c_str());
+	rmdir(directory.c_str());
+
+	printf("%s, %dx%d\n", historyPath.c_str(), cols, rows);
+	printf("%-12s %6s %10s %10s %10s %10s  %s\n", "session (ms)", "keys", "p50", "p95", "p99", "max", "worst");
+	std::vector<double> allLatencies;
+	std::vector<std::string> allKeys;
+	size_t allTimeouts = 0;
+	std::vector<Summary> summaries;
+	for (const SessionResult& r : results) {
+		summaries.push_back(summarize(r.latencies, r.keys));
+		printSummary(r.name, r.latencies.size(), r.timeouts, summaries.back());
+		allLatencies.insert(allLatencies.end(), r.latencies.begin(), r.latencies.end());
+		for (const std::string& key : r.keys) {
+			allKeys.push_back(r.name + " " + key);
+		}
+		allTimeouts += r.timeouts;
+	}
+	Summary all = summarize(allLatencies, allKeys);
+	printSummary("all", allLatencies.size(), allTimeouts, all);
+
+	FILE* file = fopen(jsonPath.c_str(), "w");
+	if (!file) {
+		perror(jsonPath.c_str());
+		return 1;
+	}
+	fprintf(file, "{\"bench\":\"replay\",\"revision\":%s,\"history\":%s,\"rows\":%d,\"cols\":%d,\"pauseMs\":%d,\"sessions\":[",
+		jsonString(gitRevision()).c_str(), jsonString(historyPath).c_str(), rows, cols, pauseMs);
+	for (size_t i = 0; i < results.size(); ++i) {
+		fprintf(file, "%s\n", i ? "," : "");
+		writeSummary(file, results[i].name, results[i].latencies.size(), results[i].timeouts, summaries[i]);
+	}
+	fprintf(file, "\n],\"all\":");
+	writeSummary(file, "all", allLatencies.size(), allTimeouts, all);
+	fprintf(file, "}\n");
+	if (fclose(file) != 0) {
+		perror(jsonPath.c_str());
+		return 1;
+	}
+	printf("Wrote %s\n", jsonPath.c_str());
+	return allTimeouts ? 1 : 0;
+}
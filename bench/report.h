@@ -0,0 +1,59 @@
+#pragma once
+// Helpers for the benchmarks' JSON reports
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <vector>
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// The value below which fraction of the sorted samples fall
+static double percentile(const std::vector<double>& sorted, double fraction)
+{
+	if (sorted.empty()) {
+		return 0.0;
+	}
+	size_t i = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(i, sorted.size() - 1)];
+}
+
+// The commit being measured, if run from a git checkout
+static std::string gitRevision()
+{
+	std::string revision;
+	FILE* git = popen("git describe --always --dirty 2>/dev/null", "r");
+	if (git) {
+		char buffer[128];
+		if (fgets(buffer, sizeof(buffer), git)) {
+			revision = buffer;
+			revision.erase(revision.find_last_not_of('\n') + 1);
+		}
+		pclose(git);
+	}
+	return revision.empty() ? "unknown" : revision;
+}
+
+// text as a quoted JSON string
+static std::string jsonString(std::string_view text)
+{
+	std::string quoted = "\"";
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			quoted += '\\';
+			quoted += c;
+		} else if (static_cast<unsigned char>(c) < 0x20) {
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			quoted += escaped;
+		} else {
+			quoted += c;
+		}
+	}
+	return quoted + "\"";
+}
@@ -0,0 +1,92 @@
+// Compares findSubstring() against the strstr() path it replaced, on
+// synthetic shell command lines.
+
+#include "substring.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+// Lines are packed into one buffer like the mapped history file, but null
+// terminated so strstr() can run on them too
+struct Lines {
+	std::string buffer;
+	std::vector<size_t> offsets;
+	std::vector<size_t> lengths;
+};
+
+static Lines makeLines(size_t count)
+{
+	static const char* words[] = {
+		"git", "status", "commit", "-m", "push", "origin", "main", "docker", "run", "--rm", "-it",
+		"kubectl", "get", "pods", "-n", "default", "ls", "-la", "cd", "..", "make", "-j8", "grep",
+		"-rn", "TODO", "ssh", "user@host", "tail", "-f", "/var/log/syslog", "python3", "script.py",
+	};
+	const size_t wordCount = sizeof(words) / sizeof(words[0]);
+
+	std::mt19937 rng(1);
+	Lines lines;
+	for (size_t l = 0; l < count; ++l) {
+		lines.offsets.push_back(lines.buffer.size());
+		size_t n = 1 + rng() % 12;
+		for (size_t i = 0; i < n; ++i) {
+			lines.buffer += i ? " " : "";
+			lines.buffer += words[rng() % wordCount];
+		}
+		lines.lengths.push_back(lines.buffer.size() - lines.offsets.back());
+		lines.buffer += '\0';
+	}
+	return lines;
+}
+
+template <typename Function>
+static double timeSearch(const Lines& lines, const std::string& pattern, size_t* matches, Function find)
+{
+	const int repeats = 5;
+	double best = 1e300;
+	for (int r = 0; r < repeats; ++r) {
+		size_t found = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < lines.offsets.size(); ++i) {
+			found += find(lines.buffer.data() + lines.offsets[i], lines.lengths[i], pattern) != nullptr;
+		}
+		auto end = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / lines.offsets.size());
+		*matches = found;
+	}
+	return best;
+}
+
+int main(int argc, char** argv)
+{
+	size_t lineCount = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+	Lines lines = makeLines(lineCount);
+	const char* patterns[] = {"gi", "push", "origin m", "kubectl get pods", "not present anywhere"};
+
+	printf("findSubstring() implementation: %s, %zu lines\n", findSubstringImplementation(), lines.offsets.size());
+	printf("%-22s %12s %12s %12s %12s\n", "pattern (ns/line)", "strstr", "memmem", "scalar", "dispatch");
+	int status = 0;
+	for (const char* pattern : patterns) {
+		size_t a, b, c, d;
+		double tStrstr = timeSearch(lines, pattern, &a, [](const char* line, size_t, const std::string& p) {
+			return strstr(line, p.c_str());
+		});
+		double tMemmem = timeSearch(lines, pattern, &b, [](const char* line, size_t size, const std::string& p) {
+			return static_cast<const char*>(memmem(line, size, p.data(), p.size()));
+		});
+		double tScalar = timeSearch(lines, pattern, &c, [](const char* line, size_t size, const std::string& p) {
+			return findSubstringScalar(line, size, p.data(), p.size());
+		});
+		double tDispatch = timeSearch(lines, pattern, &d, [](const char* line, size_t size, const std::string& p) {
+			return findSubstring(line, size, p.data(), p.size());
+		});
+		printf("%-22s %12.1f %12.1f %12.1f %12.1f\n", pattern, tStrstr, tMemmem, tScalar, tDispatch);
+		if (a != b || a != c || a != d) {
+			fprintf(stderr, "Match counts differ for \"%s\": %zu %zu %zu %zu\n", pattern, a, b, c, d);
+			status = 1;
+		}
+	}
+	return status;
+}
@@ -0,0 +1,127 @@
+#pragma once
+// Synthetic bash histories for the benchmarks, shaped like real ones: short
+// commands from a fixed vocabulary, a few long pipelines, and a controlled
+// fraction of lines that repeat earlier ones.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+struct SyntheticOptions {
+	size_t lines = 100000;
+
+	// Fraction of lines that repeat an earlier line
+	double dupRatio = 0.6;
+
+	// Mean words in an ordinary line
+	double meanWords = 5.0;
+
+	// Fraction of lines that are long, pasted pipelines of 20-200 words
+	double longRatio = 0.01;
+
+	uint32_t seed = 1;
+};
+
+struct SyntheticStats {
+	size_t lines = 0;
+	size_t bytes = 0;
+	size_t repeats = 0;
+	size_t longestLine = 0;
+};
+
+// Appends a new line made unique by a token derived from serial
+static void syntheticLine(std::string& line, std::mt19937& rng, const SyntheticOptions& options, uint64_t serial)
+{
+	static const char* commands[] = {
+		"git", "docker", "kubectl", "ls", "cd", "make", "grep", "ssh", "tail", "python3", "vim", "cat",
+		"find", "cargo", "npm", "curl", "rm", "cp", "mv", "tar", "systemctl", "journalctl", "sudo", "echo",
+	};
+	static const char* words[] = {
+		"status", "commit", "-m", "push", "origin", "main", "checkout", "-b", "rebase", "-i", "log",
+		"--oneline", "run", "--rm", "-it", "get", "pods", "-n", "default", "describe", "logs", "-f",
+		"-la", "..", "-j8", "-rn", "TODO", "user@host", "/var/log/syslog", "script.py", "src/",
+		"build", "test", "install", "--release", "-o", "out.txt", "|", "sort", "uniq", "-c", "head",
+		"xargs", "-name", "'*.cpp'", "-type", "f", "&&", "restart", "nginx", "-u", "HEAD~1", "diff",
+	};
+	const size_t commandCount = sizeof(commands) / sizeof(commands[0]);
+	const size_t wordCount = sizeof(words) / sizeof(words[0]);
+
+	size_t count;
+	if (std::uniform_real_distribution<double>(0.0, 1.0)(rng) < options.longRatio) {
+		count = std::uniform_int_distribution<size_t>(20, 200)(rng);
+	} else {
+		std::geometric_distribution<size_t> extra(1.0 / std::max(options.meanWords, 1.0));
+		count = std::min<size_t>(1 + extra(rng), 64);
+	}
+
+	line += commands[rng() % commandCount];
+	for (size_t i = 1; i < count; ++i) {
+		line += ' ';
+		line += words[rng() % wordCount];
+	}
+
+	// A scrambled serial reads like a hash or file name, and keeps the
+	// duplicate ratio exact. Multiplying by an odd constant never collides.
+	char token[32];
+	snprintf(token, sizeof(token), " %s%x", rng() % 3 ? "file-" : "", static_cast<uint32_t>(serial * 2654435761u));
+	line += token;
+}
+
+// Writes a bash history of options.lines lines to path. Repeats pick from
+// a small set of favourite commands or from recent lines, as real ones do.
+// Returns false and sets errno on failure.
+static bool writeSyntheticHistory(const std::string& path, const SyntheticOptions& options, SyntheticStats* stats = nullptr)
+{
+	FILE* file = fopen(path.c_str(), "w");
+	if (!file) {
+		return false;
+	}
+
+	const size_t favouriteCount = 64;
+	const size_t recentCount = 4096;
+	std::vector<std::string> favourites;
+	std::vector<std::string> recent(recentCount);
+	std::mt19937 rng(options.seed);
+	std::uniform_real_distribution<double> chance(0.0, 1.0);
+	std::geometric_distribution<size_t> recency(0.05);
+
+	SyntheticStats result;
+	std::string line;
+	uint64_t serial = 0;
+	for (size_t l = 0; l < options.lines; ++l) {
+		size_t fresh = l - result.repeats;
+		bool repeat = fresh > 0 && chance(rng) < options.dupRatio;
+		if (repeat) {
+			if (chance(rng) < 0.5) {
+				line = favourites[std::min(recency(rng) % favouriteCount, favourites.size() - 1)];
+			} else {
+				size_t back = std::min({recency(rng), fresh - 1, recentCount - 1});
+				line = recent[(fresh - 1 - back) % recentCount];
+			}
+			++result.repeats;
+		} else {
+			line.clear();
+			syntheticLine(line, rng, options, serial++);
+			if (favourites.size() < favouriteCount) {
+				favourites.push_back(line);
+			}
+			recent[fresh % recentCount] = line;
+		}
+
+		result.bytes += line.size() + 1;
+		result.longestLine = std::max(result.longestLine, line.size());
+		line += '\n';
+		if (fwrite(line.data(), 1, line.size(), file) != line.size()) {
+			fclose(file);
+			return false;
+		}
+	}
+	result.lines = options.lines;
+	if (stats) {
+		*stats = result;
+	}
+	return fclose(file) == 0;
+}
@@ -0,0 +1,377 @@
+#include "daemon.h"
+#include "filterworker.h"
+#include "hash.h"
+#include "trace.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool socketAddress(const std::string& path, struct sockaddr_un* address)
+{
+	*address = {};
+	address->sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address->sun_path)) {
+		return false;
+	}
+	memcpy(address->sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+static void appendBytes(std::string& body, const void* data, size_t size)
+{
+	body.append(static_cast<const char*>(data), size);
+}
+
+std::string daemonSocketPath(const std::string& historyFilename)
+{
+	const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+	if (!runtimeDir || runtimeDir[0] != '/') {
+		return std::string();
+	}
+
+	// Name the socket after the history file's canonical path, like the cache
+	char resolved[PATH_MAX];
+	std::string canonical = realpath(historyFilename.c_str(), resolved) ? resolved : historyFilename;
+	char name[32];
+	snprintf(name, sizeof(name), "/shist-%016llx.sock", static_cast<unsigned long long>(hashBytes(canonical.data(), canonical.size())));
+	struct sockaddr_un address;
+	std::string path = std::string(runtimeDir) + name;
+	return socketAddress(path, &address) ? path : std::string();
+}
+
+bool daemonSend(int fd, DaemonMessageType type, const std::string& body)
+{
+	// Header and body go in one send when they fit in the socket buffer
+	DaemonMessageHeader header = {type, static_cast<uint32_t>(body.size())};
+	struct iovec parts[2] = {
+		{&header, sizeof(header)},
+		{const_cast<char*>(body.data()), body.size()},
+	};
+	struct msghdr message = {};
+	message.msg_iov = parts;
+	message.msg_iovlen = 2;
+	while (message.msg_iovlen) {
+		ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		while (message.msg_iovlen && static_cast<size_t>(sent) >= message.msg_iov->iov_len) {
+			sent -= message.msg_iov->iov_len;
+			++message.msg_iov;
+			--message.msg_iovlen;
+		}
+		if (message.msg_iovlen) {
+			message.msg_iov->iov_base = static_cast<char*>(message.msg_iov->iov_base) + sent;
+			message.msg_iov->iov_len -= sent;
+		}
+	}
+	return true;
+}
+
+static bool receiveAll(int fd, void* data, size_t size)
+{
+	char* p = static_cast<char*>(data);
+	while (size) {
+		ssize_t received = recv(fd, p, size, 0);
+		if (received <= 0) {
+			if (received < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += received;
+		size -= received;
+	}
+	return true;
+}
+
+bool daemonReceive(int fd, DaemonMessageHeader* header, std::string* body)
+{
+	if (!receiveAll(fd, header, sizeof(*header)) || header->size > DAEMON_MAX_MESSAGE_BYTES) {
+		return false;
+	}
+	body->resize(header->size);
+	return receiveAll(fd, &(*body)[0], header->size);
+}
+
+bool daemonWaitReadable(int fd, int timeoutMs)
+{
+	struct pollfd pfd = {fd, POLLIN, 0};
+	int ready;
+	while ((ready = poll(&pfd, 1, timeoutMs)) < 0 && errno == EINTR) {
+	}
+	return ready > 0;
+}
+
+Daemon::Daemon(const std::string& historyFilename)
+	: m_historyFilename(historyFilename)
+	, m_socketPath(daemonSocketPath(historyFilename))
+{
+}
+
+Daemon::~Daemon()
+{
+	if (m_listenFd >= 0) {
+		close(m_listenFd);
+		unlink(m_socketPath.c_str());
+	}
+	for (int fd : {m_signalFd, m_watchFd}) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+int Daemon::run()
+{
+	if (m_socketPath.empty()) {
+		fprintf(stderr, "shist: the daemon needs XDG_RUNTIME_DIR for its socket\n");
+		return 1;
+	}
+
+	// SIGINT and SIGTERM arrive through a signalfd so the socket is removed
+	// on the way out. Block them before the history's threads are started.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	m_signalFd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (m_signalFd < 0) {
+		perror("shist");
+		return 2;
+	}
+
+	// Load before listening, so the first client is served straight away
+	if (!watch() || !refresh()) {
+		return 2;
+	}
+	if (!listen()) {
+		return 1;
+	}
+
+	enum { POLL_LISTEN, POLL_SIGNAL, POLL_WATCH, POLL_COUNT };
+	struct pollfd fds[POLL_COUNT] = {};
+	fds[POLL_LISTEN] = {m_listenFd, POLLIN, 0};
+	fds[POLL_SIGNAL] = {m_signalFd, POLLIN, 0};
+	fds[POLL_WATCH] = {m_watchFd, POLLIN, 0};
+	while (!m_stop) {
+		if (poll(fds, POLL_COUNT, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("shist");
+			return 2;
+		}
+		if (fds[POLL_SIGNAL].revents) {
+			break;
+		}
+		if (fds[POLL_LISTEN].revents) {
+			int client = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client >= 0) {
+				serve(client);
+				close(client);
+
+				// Catch up on changes since the client's worker last looked
+				refresh();
+			}
+		}
+
+		// Events name any file in the directory. Comparing the history
+		// file's stat is cheaper than checking each name.
+		if (fds[POLL_WATCH].revents) {
+			char events[4096];
+			while (read(m_watchFd, events, sizeof(events)) > 0) {
+			}
+			refresh();
+		}
+	}
+	return 0;
+}
+
+bool Daemon::watch()
+{
+	m_watchFd = History::watchFile(m_historyFilename);
+	if (m_watchFd < 0) {
+		fprintf(stderr, "shist: failed to watch %s: %s\n", m_historyFilename.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool Daemon::listen()
+{
+	struct sockaddr_un address;
+	socketAddress(m_socketPath, &address);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("shist");
+		return false;
+	}
+
+	// A socket nobody is listening on is left over from a daemon that died
+	if (connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) == 0) {
+		fprintf(stderr, "shist: a daemon is already running for %s\n", m_historyFilename.c_str());
+		close(fd);
+		return false;
+	}
+	unlink(m_socketPath.c_str());
+
+	if (bind(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, 8) != 0) {
+		fprintf(stderr, "shist: failed to listen on %s: %s\n", m_socketPath.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+	m_listenFd = fd;
+	return true;
+}
+
+bool Daemon::refresh()
+{
+	// Appended lines cost about as much to add as they took to write
+	if (m_history) {
+		return m_history->ingest() != History::INGEST_RELOAD || m_history->reload();
+	}
+
+	try {
+		m_history = std::make_unique<History>(m_historyFilename);
+	} catch (const History::NoHistoryException&) {
+		return false;
+	}
+	return true;
+}
+
+void Daemon::reject()
+{
+	int client = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+	if (client >= 0) {
+		daemonSend(client, DAEMON_BUSY, std::string());
+		close(client);
+	}
+}
+
+void Daemon::serve(int client)
+{
+	DaemonMessageHeader header;
+	std::string body;
+	uint32_t version = 0;
+	if (!daemonWaitReadable(client, DAEMON_CONNECT_TIMEOUT_MS) || !daemonReceive(client, &header, &body) ||
+		header.type != DAEMON_HELLO || body.size() != sizeof(version)) {
+		return;
+	}
+	memcpy(&version, body.data(), sizeof(version));
+	if (version != DAEMON_PROTOCOL_VERSION || !refresh()) {
+		daemonSend(client, DAEMON_BUSY, std::string());
+		return;
+	}
+	if (!daemonSend(client, DAEMON_READY, std::string())) {
+		return;
+	}
+
+	// The worker's generations are mapped back to the client's
+	FilterWorker worker(*m_history);
+	uint64_t clientGeneration = 0;
+	uint64_t workerGeneration = 0;
+	bool started = false;
+	std::shared_ptr<const FilterResults> sent;
+
+	enum { POLL_CLIENT, POLL_RESULTS, POLL_LISTEN, POLL_SIGNAL, POLL_COUNT };
+	struct pollfd fds[POLL_COUNT] = {};
+	fds[POLL_CLIENT] = {client, POLLIN, 0};
+	fds[POLL_RESULTS] = {worker.notifyFd(), POLLIN, 0};
+	fds[POLL_LISTEN] = {m_listenFd, POLLIN, 0};
+	fds[POLL_SIGNAL] = {m_signalFd, POLLIN, 0};
+	while (true) {
+		if (poll(fds, POLL_COUNT, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		if (fds[POLL_SIGNAL].revents) {
+			m_stop = true;
+			return;
+		}
+		if (fds[POLL_LISTEN].revents) {
+			reject();
+		}
+
+		if (fds[POLL_CLIENT].revents) {
+			TRACE_SCOPE("Daemon::query");
+			DaemonQuery query;
+			if (!daemonReceive(client, &header, &body)) {
+				return;
+			}
+			if (header.type != DAEMON_QUERY || body.size() < sizeof(query)) {
+				continue;
+			}
+			memcpy(&query, body.data(), sizeof(query));
+			if (body.size() - sizeof(query) < query.patternSize) {
+				continue;
+			}
+			if (!started || query.generation != clientGeneration) {
+				std::string pattern = body.substr(sizeof(query), query.patternSize);
+				MatchMode mode = query.mode <= MATCH_REGEX ? static_cast<MatchMode>(query.mode) : MATCH_EXACT;
+				worker.setFilter(pattern, mode, query.count);
+				clientGeneration = query.generation;
+				workerGeneration = worker.generation();
+				started = true;
+			} else {
+				worker.request(query.count);
+			}
+			worker.requestOldest(query.oldestCount);
+		}
+
+		if (fds[POLL_RESULTS].revents) {
+			uint64_t published;
+			if (read(worker.notifyFd(), &published, sizeof(published)) < 0) {
+				// Nothing new since the last read
+			}
+			std::shared_ptr<const FilterResults> results = worker.results();
+			if (results && results != sent && results->generation == workerGeneration) {
+				appendResults(*results, clientGeneration);
+				if (!daemonSend(client, DAEMON_RESULTS, m_body)) {
+					return;
+				}
+				sent = results;
+			}
+		}
+	}
+}
+
+void Daemon::appendResults(const FilterResults& results, uint64_t generation)
+{
+	TRACE_SCOPE("Daemon::appendResults");
+	DaemonResults header = {};
+	header.generation = generation;
+	header.mode = results.mode;
+	header.patternSize = static_cast<uint32_t>(results.pattern.size());
+	header.itemCount = static_cast<uint32_t>(results.items.size());
+	header.oldestCount = static_cast<uint32_t>(results.oldest.size());
+	header.complete = results.complete;
+	header.revision = results.revision;
+
+	m_body.clear();
+	appendBytes(m_body, &header, sizeof(header));
+	m_body += results.pattern;
+	for (const HistoryItems* items : {&results.items, &results.oldest}) {
+		for (size_t i = 0; i < items->size(); ++i) {
+			HistoryItem item = (*items)[i];
+			DaemonItem itemHeader = {item.index, static_cast<uint32_t>(item.line.size()), static_cast<uint32_t>(item.matchBytes)};
+			appendBytes(m_body, &itemHeader, sizeof(itemHeader));
+			m_body.append(item.line.data(), item.line.size());
+			appendBytes(m_body, item.matches, item.matchBytes);
+		}
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include "resultsource.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+// Bump whenever a message changes. A client and daemon that differ don't
+// talk, and the client searches in process instead.
+#define DAEMON_PROTOCOL_VERSION 3
+
+// How long either side waits for the other's hello before giving up
+#define DAEMON_CONNECT_TIMEOUT_MS 500
+
+// Larger messages are taken as a broken connection
+#define DAEMON_MAX_MESSAGE_BYTES (1u << 30)
+
+enum DaemonMessageType : uint32_t {
+	// Client: DAEMON_PROTOCOL_VERSION as a uint32_t
+	DAEMON_HELLO = 1,
+	// Daemon: the client is being served
+	DAEMON_READY,
+	// Daemon: another client is being served or the history can't be read
+	DAEMON_BUSY,
+	// Client: a DaemonQuery, then the pattern
+	DAEMON_QUERY,
+	// Daemon: a DaemonResults, then the pattern, then each item as a
+	// DaemonItem followed by its line and encoded matches
+	DAEMON_RESULTS,
+};
+
+struct DaemonMessageHeader {
+	uint32_t type;
+	uint32_t size;
+};
+
+// The whole state of the client's search. A new generation starts a new
+// search and the same one asks for more results.
+struct DaemonQuery {
+	uint64_t generation;
+	uint64_t count;
+	uint64_t oldestCount;
+	uint32_t mode;
+	uint32_t patternSize;
+};
+
+struct DaemonResults {
+	uint64_t generation;
+	uint32_t mode;
+	uint32_t patternSize;
+	uint32_t itemCount;
+	uint32_t oldestCount;
+	uint32_t complete;
+	uint32_t padding;
+	uint64_t revision;
+};
+
+struct DaemonItem {
+	uint32_t index;
+	uint32_t lineSize;
+	uint32_t matchBytes;
+};
+
+// Socket of the daemon for a history file, in $XDG_RUNTIME_DIR so only
+// its user can connect. Empty if that isn't set.
+std::string daemonSocketPath(const std::string& historyFilename);
+
+// Whole messages over a stream socket. Return false on error or hang-up.
+bool daemonSend(int fd, DaemonMessageType type, const std::string& body);
+bool daemonReceive(int fd, DaemonMessageHeader* header, std::string* body);
+
+// Waits up to timeoutMs for fd to become readable
+bool daemonWaitReadable(int fd, int timeoutMs);
+
+// Keeps a history file loaded, with its indexes and dedup tables, and
+// searches it for shist processes that connect to its socket. One client
+// is served at a time. Others are told it's busy and search in process.
+// The history file's directory is watched, and lines appended to it are
+// ingested as they arrive, while a client is connected too. A rewritten
+// file is loaded again, by the client's FilterWorker while it's connected.
+class Daemon {
+public:
+	Daemon(const std::string& historyFilename);
+	~Daemon();
+	Daemon(const Daemon&) = delete;
+	Daemon& operator=(const Daemon&) = delete;
+
+	// Serves clients until SIGINT or SIGTERM. Returns an exit status.
+	int run();
+
+private:
+	bool listen();
+	bool watch();
+	bool refresh();
+	void serve(int client);
+	void reject();
+	void appendResults(const FilterResults& results, uint64_t generation);
+
+	std::string m_historyFilename;
+	std::string m_socketPath;
+	std::unique_ptr<History> m_history;
+	int m_listenFd = -1;
+	int m_signalFd = -1;
+	int m_watchFd = -1;
+	bool m_stop = false;
+
+	// Scratch space for encoding messages
+	std::string m_body;
+};
@@ -0,0 +1,229 @@
+#include "daemonclient.h"
+#include "daemon.h"
+#include "trace.h"
+#include <stdexcept>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Reads a T from body at *pos, advancing it. Returns false if body is too short.
+template <typename T>
+static bool readValue(const std::string& body, size_t* pos, T* value)
+{
+	if (body.size() - *pos < sizeof(T)) {
+		return false;
+	}
+	memcpy(value, body.data() + *pos, sizeof(T));
+	*pos += sizeof(T);
+	return true;
+}
+
+static bool readItems(const std::string& body, size_t* pos, size_t count, HistoryItems& items)
+{
+	for (size_t i = 0; i < count; ++i) {
+		DaemonItem header;
+		if (!readValue(body, pos, &header) || body.size() - *pos < size_t(header.lineSize) + header.matchBytes) {
+			return false;
+		}
+		HistoryItem item;
+		item.line = std::string_view(body.data() + *pos, header.lineSize);
+		item.index = header.index;
+		item.matches = reinterpret_cast<const uint8_t*>(body.data() + *pos + header.lineSize);
+		item.matchBytes = header.matchBytes;
+		items.push_back(item);
+		*pos += header.lineSize + header.matchBytes;
+	}
+	return true;
+}
+
+std::unique_ptr<DaemonClient> DaemonClient::connect(const std::string& historyFilename)
+{
+	std::string path = daemonSocketPath(historyFilename);
+	if (path.empty()) {
+		return nullptr;
+	}
+	struct sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	uint32_t version = DAEMON_PROTOCOL_VERSION;
+	DaemonMessageHeader header;
+	std::string body;
+	if (::connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0 ||
+		!daemonSend(fd, DAEMON_HELLO, std::string(reinterpret_cast<const char*>(&version), sizeof(version))) ||
+		!daemonWaitReadable(fd, DAEMON_CONNECT_TIMEOUT_MS) ||
+		!daemonReceive(fd, &header, &body) || header.type != DAEMON_READY) {
+		close(fd);
+		return nullptr;
+	}
+	return std::unique_ptr<DaemonClient>(new DaemonClient(fd));
+}
+
+DaemonClient::DaemonClient(int fd)
+	: m_fd(fd)
+	, m_notifyFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+	if (m_notifyFd < 0) {
+		close(m_fd);
+		throw std::runtime_error("Failed to create the daemon client's eventfd");
+	}
+	m_thread = std::thread(&DaemonClient::run, this);
+}
+
+DaemonClient::~DaemonClient()
+{
+	// Wakes the receiving thread, which sees the connection close
+	shutdown(m_fd, SHUT_RDWR);
+	m_thread.join();
+	close(m_fd);
+	close(m_notifyFd);
+}
+
+void DaemonClient::setFilter(const std::string& pattern, MatchMode mode, size_t count)
+{
+	m_pattern = pattern;
+	m_mode = mode;
+	m_requested = count;
+	m_requestedOldest = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_generation;
+	}
+	sendQuery();
+}
+
+void DaemonClient::request(size_t count)
+{
+	if (count <= m_requested) {
+		return;
+	}
+	m_requested = count;
+	sendQuery();
+}
+
+void DaemonClient::requestOldest(size_t count)
+{
+	if (count <= m_requestedOldest) {
+		return;
+	}
+	m_requestedOldest = count;
+	sendQuery();
+}
+
+bool DaemonClient::sendQuery()
+{
+	if (m_disconnected) {
+		return false;
+	}
+	DaemonQuery query = {};
+	query.generation = m_generation;
+	query.count = m_requested;
+	query.oldestCount = m_requestedOldest;
+	query.mode = m_mode;
+	query.patternSize = static_cast<uint32_t>(m_pattern.size());
+	m_body.assign(reinterpret_cast<const char*>(&query), sizeof(query));
+	m_body += m_pattern;
+
+	// The receiving thread notices the connection has gone too, but only
+	// once it reads. Not waiting for it lets the caller fall back now.
+	if (!daemonSend(m_fd, DAEMON_QUERY, m_body)) {
+		disconnect();
+		return false;
+	}
+	return true;
+}
+
+std::shared_ptr<const FilterResults> DaemonClient::results() const
+{
+	return std::atomic_load(&m_published);
+}
+
+std::shared_ptr<const FilterResults> DaemonClient::wait(size_t count, size_t oldestCount)
+{
+	request(count);
+	requestOldest(oldestCount);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	std::shared_ptr<const FilterResults> results;
+	bool ready = false;
+	m_publishedCond.wait(lock, [&] {
+		results = std::atomic_load(&m_published);
+		ready = results && results->generation == m_generation &&
+			((results->items.size() >= count && results->oldest.size() >= oldestCount) || results->complete);
+		return ready || m_disconnected;
+	});
+
+	// Results from before the daemon went may be too few, and an empty set
+	// would look like the answer
+	return ready ? results : nullptr;
+}
+
+void DaemonClient::run()
+{
+	traceThreadName("daemon client");
+	DaemonMessageHeader header;
+	std::string body;
+	while (daemonReceive(m_fd, &header, &body)) {
+		if (header.type != DAEMON_RESULTS) {
+			continue;
+		}
+		TRACE_SCOPE("DaemonClient::decode");
+
+		// Lines are copied out of the message, which is reused
+		auto results = std::make_shared<FilterResults>();
+		DaemonResults resultsHeader;
+		size_t pos = 0;
+		if (!readValue(body, &pos, &resultsHeader) || body.size() - pos < resultsHeader.patternSize) {
+			break;
+		}
+		results->generation = resultsHeader.generation;
+		results->mode = resultsHeader.mode <= MATCH_REGEX ? static_cast<MatchMode>(resultsHeader.mode) : MATCH_EXACT;
+		results->pattern = body.substr(pos, resultsHeader.patternSize);
+		results->complete = resultsHeader.complete != 0;
+		results->revision = resultsHeader.revision;
+		pos += resultsHeader.patternSize;
+		if (!readItems(body, &pos, resultsHeader.itemCount, results->items) ||
+			!readItems(body, &pos, resultsHeader.oldestCount, results->oldest)) {
+			break;
+		}
+		publish(results);
+	}
+	disconnect();
+}
+
+void DaemonClient::disconnect()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_disconnected = true;
+	}
+	m_publishedCond.notify_all();
+	notify();
+}
+
+void DaemonClient::publish(std::shared_ptr<const FilterResults> results)
+{
+	std::atomic_store(&m_published, results);
+
+	// Take the lock so a waiter can't miss the notification between
+	// checking the results and sleeping
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+	}
+	m_publishedCond.notify_all();
+	notify();
+}
+
+void DaemonClient::notify()
+{
+	uint64_t one = 1;
+	if (write(m_notifyFd, &one, sizeof(one)) < 0) {
+		// Only fails if the counter would overflow, when it's readable anyway
+	}
+}
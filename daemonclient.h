@@ -0,0 +1,62 @@
+#pragma once
+#include "resultsource.h"
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Asks a shist --daemon for results, so the history never has to be loaded
+// in this process. Each change of pattern or request sends the daemon the
+// whole query, and results are received on a thread and published like a
+// FilterWorker's, with copies of their lines.
+class DaemonClient : public ResultSource {
+public:
+	// Connects to the daemon for historyFilename. Returns null if there is
+	// none, or it can't serve this client right now.
+	static std::unique_ptr<DaemonClient> connect(const std::string& historyFilename);
+
+	~DaemonClient();
+	DaemonClient(const DaemonClient&) = delete;
+	DaemonClient& operator=(const DaemonClient&) = delete;
+
+	void setFilter(const std::string& pattern, MatchMode mode, size_t count) override;
+	void request(size_t count) override;
+	void requestOldest(size_t count) override;
+	uint64_t generation() const override { return m_generation; }
+	int notifyFd() const override { return m_notifyFd; }
+	std::shared_ptr<const FilterResults> results() const override;
+	std::shared_ptr<const FilterResults> wait(size_t count, size_t oldestCount = 0) override;
+	bool disconnected() const override { return m_disconnected; }
+
+private:
+	DaemonClient(int fd);
+	void run();
+
+	// Returns false if the daemon has gone, after marking the client
+	// disconnected
+	bool sendQuery();
+	void publish(std::shared_ptr<const FilterResults> results);
+	void disconnect();
+	void notify();
+
+	int m_fd;
+	int m_notifyFd;
+
+	// The query, only touched by the caller's thread
+	std::string m_pattern;
+	MatchMode m_mode = MATCH_EXACT;
+	std::atomic<uint64_t> m_generation{0};
+	size_t m_requested = 0;
+	size_t m_requestedOldest = 0;
+	std::string m_body;
+
+	std::mutex m_mutex;
+	std::condition_variable m_publishedCond;
+	std::atomic<bool> m_disconnected{false};
+	std::shared_ptr<const FilterResults> m_published;
+
+	std::thread m_thread;
+};
@@ -0,0 +1,266 @@
+#include "filterworker.h"
+#include "trace.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <chrono>
+
+FilterWorker::FilterWorker(History& history)
+	: m_history(history)
+	, m_notifyFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+	, m_watchFd(History::watchFile(history.filename()))
+	, m_watchStopFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+	if (m_notifyFd < 0 || m_watchStopFd < 0) {
+		throw std::runtime_error("Failed to create the filter worker's eventfd");
+	}
+	m_thread = std::thread(&FilterWorker::run, this);
+
+	// Without a watch, the history is only what was loaded
+	if (m_watchFd >= 0) {
+		m_watchThread = std::thread(&FilterWorker::watch, this);
+	}
+}
+
+FilterWorker::~FilterWorker()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+		++m_generation;
+	}
+	m_wake.notify_one();
+	m_thread.join();
+
+	uint64_t one = 1;
+	if (write(m_watchStopFd, &one, sizeof(one)) < 0) {
+		// Only fails if the counter would overflow, when it's readable anyway
+	}
+	if (m_watchThread.joinable()) {
+		m_watchThread.join();
+	}
+	for (int fd : {m_notifyFd, m_watchFd, m_watchStopFd}) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+void FilterWorker::setFilter(const std::string& pattern, MatchMode mode, size_t count)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pattern = pattern;
+		m_mode = mode;
+		m_requested = count;
+		m_requestedOldest = 0;
+		++m_generation;
+	}
+	m_wake.notify_one();
+}
+
+void FilterWorker::request(size_t count)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (count <= m_requested) {
+			return;
+		}
+		m_requested = count;
+	}
+	m_wake.notify_one();
+}
+
+void FilterWorker::requestOldest(size_t count)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (count <= m_requestedOldest) {
+			return;
+		}
+		m_requestedOldest = count;
+	}
+	m_wake.notify_one();
+}
+
+std::shared_ptr<const FilterResults> FilterWorker::results() const
+{
+	return std::atomic_load(&m_published);
+}
+
+std::shared_ptr<const FilterResults> FilterWorker::wait(size_t count, size_t oldestCount)
+{
+	request(count);
+	requestOldest(oldestCount);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	std::shared_ptr<const FilterResults> results;
+	m_publishedCond.wait(lock, [&] {
+		results = std::atomic_load(&m_published);
+		return results && results->generation == m_generation &&
+			((results->items.size() >= count && results->oldest.size() >= oldestCount) || results->complete);
+	});
+	return results;
+}
+
+void FilterWorker::run()
+{
+	traceThreadName("filter worker");
+
+	// The generation that m_history is currently filtered for, and how far
+	// its search has got
+	uint64_t generation = 0;
+	std::string pattern;
+	MatchMode mode = MATCH_EXACT;
+	bool complete = true;
+	size_t found = 0;
+	size_t foundOldest = 0;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_wake.wait(lock, [&] {
+			return m_stop || m_generation != generation || m_historyChanged ||
+				(!complete && (m_requested > found || m_requestedOldest > foundOldest));
+		});
+		if (m_stop) {
+			break;
+		}
+
+		bool restart = m_generation != generation;
+		bool changed = m_historyChanged.exchange(false);
+		bool more = !complete && (m_requested > found || m_requestedOldest > foundOldest);
+		generation = m_generation;
+		if (restart) {
+			pattern = m_pattern;
+			mode = m_mode;
+		}
+		lock.unlock();
+
+		// Appended lines are searched on their own, and a new pattern's
+		// search includes them anyway. A rewritten file is loaded again and
+		// the pattern searched from scratch, as the old lines may be gone.
+		if (changed) {
+			History::IngestResult ingested = m_history.ingest();
+			if (ingested == History::INGEST_RELOAD && m_history.reload()) {
+				restart = true;
+			} else if (ingested == History::INGEST_APPENDED && !restart) {
+				found = m_history.items().size();
+				foundOldest = m_history.oldest().size();
+				publish(generation, pattern, mode, complete);
+			}
+		}
+		if (!restart && !more) {
+			lock.lock();
+			continue;
+		}
+
+		if (restart) {
+			m_history.filter(pattern.c_str(), mode);
+			complete = false;
+			found = m_history.items().size();
+			foundOldest = m_history.oldest().size();
+		}
+
+		auto lastPublish = std::chrono::steady_clock::now();
+		size_t published = 0;
+		while (m_generation == generation && !m_historyChanged) {
+			// The newest results come first, as they're what is on screen
+			// unless the selection has wrapped to the oldest
+			size_t requested = m_requested;
+			size_t requestedOldest = m_requestedOldest;
+			if (found < requested) {
+				complete = m_history.search(requested, FILTER_WORKER_BATCH_LINES);
+			} else {
+				complete = m_history.searchOldest(requestedOldest, FILTER_WORKER_BATCH_LINES);
+			}
+			found = m_history.items().size();
+			foundOldest = m_history.oldest().size();
+			bool done = complete || (found >= requested && foundOldest >= requestedOldest);
+
+			// Publish a long search's progress every so often
+			auto now = std::chrono::steady_clock::now();
+			if (done || (found + foundOldest != published && now - lastPublish > std::chrono::milliseconds(FILTER_WORKER_PUBLISH_MS))) {
+				publish(generation, pattern, mode, complete);
+				published = found + foundOldest;
+				lastPublish = now;
+			}
+			if (done) {
+				break;
+			}
+		}
+
+		lock.lock();
+	}
+}
+
+void FilterWorker::watch()
+{
+	traceThreadName("history watch");
+	enum { POLL_WATCH, POLL_STOP, POLL_COUNT };
+	struct pollfd fds[POLL_COUNT] = {};
+	fds[POLL_WATCH] = {m_watchFd, POLLIN, 0};
+	fds[POLL_STOP] = {m_watchStopFd, POLLIN, 0};
+	while (true) {
+		if (poll(fds, POLL_COUNT, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		if (fds[POLL_STOP].revents) {
+			return;
+		}
+
+		// Bursts of events are read at once and ingested together
+		char events[4096];
+		while (read(m_watchFd, events, sizeof(events)) > 0) {
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_historyChanged = true;
+		}
+		m_wake.notify_one();
+	}
+}
+
+void FilterWorker::publish(uint64_t generation, const std::string& pattern, MatchMode mode, bool complete)
+{
+	TRACE_SCOPE("FilterWorker::publish");
+	// Refill results nobody else holds. The fence orders the refill after
+	// the last reader's release of its reference.
+	std::shared_ptr<FilterResults> results;
+	for (const std::shared_ptr<FilterResults>& pooled : m_resultsPool) {
+		if (pooled.use_count() == 1) {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			results = pooled;
+			break;
+		}
+	}
+	if (!results) {
+		results = std::make_shared<FilterResults>();
+		m_resultsPool.push_back(results);
+	}
+
+	results->generation = generation;
+	results->pattern = pattern;
+	results->mode = mode;
+	results->items = m_history.items();
+	results->oldest = m_history.oldest();
+	results->complete = complete;
+	results->revision = m_history.revision();
+	results->file = m_history.file();
+	std::atomic_store(&m_published, std::shared_ptr<const FilterResults>(results));
+
+	// Take the lock so a waiter can't miss the notification between
+	// checking the results and sleeping
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+	}
+	m_publishedCond.notify_all();
+
+	uint64_t one = 1;
+	if (write(m_notifyFd, &one, sizeof(one)) < 0) {
+		// Only fails if the counter would overflow, when it's readable anyway
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "history.h"
+#include "resultsource.h"
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Lines searched between checks for a newer pattern
+#define FILTER_WORKER_BATCH_LINES 16384
+
+// Minimum time between publishing partial results of a long search
+#define FILTER_WORKER_PUBLISH_MS 50
+
+// Runs History searches on a background thread so typing never waits for a
+// scan. Each new pattern bumps a generation counter, and a search that has
+// been superseded notices between batches and is abandoned.
+//
+// A second thread watches the history file, and lines other shells append
+// to it are ingested between batches and the results published again. A
+// file that was rewritten instead is loaded again and searched afresh.
+class FilterWorker : public ResultSource {
+public:
+	FilterWorker(History& history);
+	~FilterWorker();
+	FilterWorker(const FilterWorker&) = delete;
+	FilterWorker& operator=(const FilterWorker&) = delete;
+
+	void setFilter(const std::string& pattern, MatchMode mode, size_t count) override;
+	void request(size_t count) override;
+	void requestOldest(size_t count) override;
+	uint64_t generation() const override { return m_generation; }
+	int notifyFd() const override { return m_notifyFd; }
+	std::shared_ptr<const FilterResults> results() const override;
+	std::shared_ptr<const FilterResults> wait(size_t count, size_t oldestCount = 0) override;
+	bool disconnected() const override { return false; }
+
+private:
+	void run();
+	void watch();
+	void publish(uint64_t generation, const std::string& pattern, MatchMode mode, bool complete);
+
+	History& m_history;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_publishedCond;
+	std::string m_pattern;
+	MatchMode m_mode = MATCH_EXACT;
+	std::atomic<uint64_t> m_generation{0};
+	std::atomic<size_t> m_requested{0};
+	std::atomic<size_t> m_requestedOldest{0};
+	bool m_stop = false;
+	std::atomic<bool> m_historyChanged{false};
+
+	std::shared_ptr<const FilterResults> m_published;
+	int m_notifyFd;
+
+	// Every FilterResults published so far. Those no longer referenced
+	// elsewhere are refilled rather than allocating new ones.
+	std::vector<std::shared_ptr<FilterResults>> m_resultsPool;
+
+	std::thread m_thread;
+
+	// The history file's watch, or -1 if it can't be watched, and an
+	// eventfd that stops the watching thread
+	int m_watchFd;
+	int m_watchStopFd;
+	std::thread m_watchThread;
+};
@@ -0,0 +1,169 @@
+#include "frame.h"
+#include "trace.h"
+#include <ncurses.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+
+Frame::Frame()
+	: m_statsEnabled(getenv("SHIST_STATS") != nullptr)
+{
+}
+
+Frame::~Frame()
+{
+	for (int fd : {m_pipe[0], m_pipe[1], m_terminal}) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+FILE* Frame::open(int terminalFd)
+{
+	m_terminal = terminalFd;
+	if (m_terminal < 0) {
+		return nullptr;
+	}
+
+	// ncurses also sets terminal modes and reads the window size through
+	// this, so it only points at the pipe while a frame is drawn. Without a
+	// pipe, frames go straight to the terminal.
+	if (pipe2(m_pipe, O_CLOEXEC) == 0) {
+		fcntl(m_pipe[1], F_SETPIPE_SZ, FRAME_PIPE_BYTES);
+		int capacity = fcntl(m_pipe[1], F_GETPIPE_SZ);
+		m_pipeCapacity = capacity > 0 ? capacity : 0;
+		fcntl(m_pipe[0], F_SETFL, O_NONBLOCK);
+	}
+	m_outFd = dup(m_terminal);
+	if (m_outFd < 0) {
+		return nullptr;
+	}
+	return fdopen(m_outFd, "w");
+}
+
+void Frame::reset(int rows, int cols)
+{
+	m_rows.assign(std::max(rows, 0), Row());
+	m_cols = std::max(cols, 0);
+	erase();
+
+	// Batch only while a full redraw can't fill the pipe, which would block
+	// ncurses with nothing to drain it
+	m_batching = m_pipe[1] >= 0 && m_rows.size() * m_cols * FRAME_MAX_CELL_BYTES <= m_pipeCapacity;
+}
+
+void Frame::beginRow()
+{
+	m_next.text.clear();
+	m_next.colours.clear();
+}
+
+void Frame::add(std::string_view text, int colour)
+{
+	// Multi-line entries and other control characters would break the row,
+	// so each is shown as one visible character in its place
+	size_t size = std::min(text.size(), m_cols - m_next.text.size());
+	for (size_t i = 0; i < size; ++i) {
+		unsigned char c = static_cast<unsigned char>(text[i]);
+		m_next.text += c < 0x20 || c == 0x7f ? (c == '\t' ? ' ' : '?') : static_cast<char>(c);
+	}
+	m_next.colours.insert(m_next.colours.end(), size, static_cast<uint8_t>(colour));
+}
+
+void Frame::endRow(int row)
+{
+	if (row < 0 || static_cast<size_t>(row) >= m_rows.size()) {
+		return;
+	}
+	Row& previous = m_rows[row];
+	const Row& next = m_next;
+	auto same = [&previous, &next](size_t i) {
+		bool inPrevious = i < previous.text.size();
+		bool inNext = i < next.text.size();
+		if (inPrevious != inNext) {
+			return false;
+		}
+		return !inNext || (previous.text[i] == next.text[i] && previous.colours[i] == next.colours[i]);
+	};
+
+	// Find runs of changed cells, joining those separated by small gaps
+	size_t size = std::max(previous.text.size(), next.text.size());
+	for (size_t i = 0; i < size;) {
+		if (same(i)) {
+			++i;
+			continue;
+		}
+		size_t end = i + 1;
+		for (size_t j = end; j < size && j < end + FRAME_MAX_GAP; ++j) {
+			if (!same(j)) {
+				end = j + 1;
+			}
+		}
+		drawSpan(row, i, end);
+		i = end;
+	}
+
+	previous.text.swap(m_next.text);
+	previous.colours.swap(m_next.colours);
+}
+
+void Frame::drawSpan(int row, size_t begin, size_t end)
+{
+	// Anything past the end of the new row is cleared in one go
+	const Row& next = m_next;
+	size_t drawEnd = std::min(end, next.text.size());
+	for (size_t i = begin; i < drawEnd;) {
+		size_t runEnd = i + 1;
+		while (runEnd < drawEnd && next.colours[runEnd] == next.colours[i]) {
+			++runEnd;
+		}
+		attrset(COLOR_PAIR(next.colours[i]));
+		mvaddnstr(row, static_cast<int>(i), next.text.data() + i, static_cast<int>(runEnd - i));
+		i = runEnd;
+	}
+	attrset(COLOR_PAIR(0));
+	if (end > next.text.size()) {
+		move(row, static_cast<int>(drawEnd));
+		clrtoeol();
+	}
+}
+
+void Frame::present()
+{
+	TRACE_SCOPE("Frame::present");
+	++m_stats.frames;
+	if (!m_batching) {
+		refresh();
+		return;
+	}
+	dup2(m_pipe[1], m_outFd);
+	refresh();
+	dup2(m_terminal, m_outFd);
+
+	for (;;) {
+		size_t size = m_pending.size();
+		m_pending.resize(size + 65536);
+		ssize_t bytes = read(m_pipe[0], &m_pending[size], 65536);
+		m_pending.resize(size + std::max<ssize_t>(bytes, 0));
+		if (bytes <= 0 && errno != EINTR) {
+			break;
+		}
+	}
+	if (m_pending.empty()) {
+		return;
+	}
+
+	for (size_t written = 0; written < m_pending.size();) {
+		ssize_t bytes = write(m_terminal, m_pending.data() + written, m_pending.size() - written);
+		if (bytes < 0 && errno != EINTR) {
+			break;
+		}
+		written += std::max<ssize_t>(bytes, 0);
+		++m_stats.writes;
+	}
+	m_stats.bytes += m_pending.size();
+	m_pending.clear();
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Unchanged cells between two changes that are rewritten rather than
+// skipped with a cursor movement, which costs about as many bytes
+#define FRAME_MAX_GAP 4
+
+// Capacity asked for the pipe that holds a frame's output. ncurses flushes
+// at every cursor movement, so its output is collected here and sent on in
+// one write.
+#define FRAME_PIPE_BYTES (1 << 20)
+
+// Generous bound on the output for one cell, including colour changes. If
+// a whole screen of them could overflow the pipe, ncurses writes to the
+// terminal directly instead.
+#define FRAME_MAX_CELL_BYTES 32
+
+// Terminal output, reported when the Screen closes if SHIST_STATS is set.
+// Bytes and writes are only counted while batching.
+struct FrameStats {
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	uint64_t writes = 0;
+};
+
+// The rows last drawn, as text and a colour pair per character. A new
+// frame is built a row at a time and only the spans that differ from the
+// previous frame are passed to ncurses, which then has little to compare
+// and send.
+class Frame {
+public:
+	Frame();
+	~Frame();
+	Frame(const Frame&) = delete;
+	Frame& operator=(const Frame&) = delete;
+
+	// Takes ownership of terminalFd and returns the stream ncurses should
+	// write to, or null on failure
+	FILE* open(int terminalFd);
+
+	// Forget the previous frame and blank the screen, e.g. after a resize
+	void reset(int rows, int cols);
+
+	// Build a row's contents, clipped to the screen width
+	void beginRow();
+	void add(std::string_view text, int colour);
+
+	// Draw the changes between the row built and what was on row before
+	void endRow(int row);
+
+	// Send the frame to the terminal
+	void present();
+
+	bool statsEnabled() const { return m_statsEnabled; }
+	const FrameStats& stats() const { return m_stats; }
+
+private:
+	struct Row {
+		std::string text;
+		std::vector<uint8_t> colours;
+	};
+
+	void drawSpan(int row, size_t begin, size_t end);
+
+	std::vector<Row> m_rows;
+	Row m_next;
+	size_t m_cols = 0;
+
+	// ncurses writes to m_outFd, which is the pipe only during present()
+	int m_terminal = -1;
+	int m_outFd = -1;
+	int m_pipe[2] = {-1, -1};
+	size_t m_pipeCapacity = 0;
+	bool m_batching = false;
+	std::string m_pending;
+
+	bool m_statsEnabled;
+	FrameStats m_stats;
+};
@@ -0,0 +1,193 @@
+#include "fuzzy.h"
+#include <ctype.h>
+#include <algorithm>
+
+namespace {
+
+enum CharClass {
+	CHAR_WHITE,
+	CHAR_DELIMITER,
+	CHAR_LOWER,
+	CHAR_UPPER,
+	CHAR_DIGIT,
+	CHAR_OTHER,
+};
+
+const int SCORE_MATCH = 16;
+const int SCORE_GAP_START = -3;
+const int SCORE_GAP_EXTENSION = -1;
+const int BONUS_BOUNDARY_WHITE = 10;
+const int BONUS_BOUNDARY = 8;
+const int BONUS_CAMEL = 7;
+const int BONUS_CONSECUTIVE = 4;
+const int BONUS_FIRST_CHAR_MULTIPLIER = 2;
+
+inline CharClass charClass(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z') {
+		return CHAR_LOWER;
+	}
+	if (c >= 'A' && c <= 'Z') {
+		return CHAR_UPPER;
+	}
+	if (c >= '0' && c <= '9') {
+		return CHAR_DIGIT;
+	}
+	switch (c) {
+	case ' ':
+	case '\t':
+		return CHAR_WHITE;
+	case '/':
+	case '-':
+	case '_':
+	case '.':
+	case ',':
+	case ':':
+	case ';':
+	case '|':
+	case '=':
+	case '(':
+	case ')':
+	case '\'':
+	case '"':
+	case '$':
+		return CHAR_DELIMITER;
+	}
+	return CHAR_OTHER;
+}
+
+// Bonus for matching a character of class current that follows previous
+inline int bonusFor(CharClass previous, CharClass current)
+{
+	if (current == CHAR_WHITE || current == CHAR_DELIMITER) {
+		return 0;
+	}
+	if (previous == CHAR_WHITE) {
+		return BONUS_BOUNDARY_WHITE;
+	}
+	if (previous == CHAR_DELIMITER) {
+		return BONUS_BOUNDARY;
+	}
+	if ((previous == CHAR_LOWER && current == CHAR_UPPER) ||
+		(previous != CHAR_DIGIT && current == CHAR_DIGIT)) {
+		return BONUS_CAMEL;
+	}
+	return 0;
+}
+
+inline int maskBit(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z') {
+		return c - 'a';
+	}
+	if (c >= 'A' && c <= 'Z') {
+		return c - 'A';
+	}
+	if (c >= '0' && c <= '9') {
+		return 26 + c - '0';
+	}
+	return 36 + c % 28;
+}
+
+}
+
+uint64_t fuzzyCharMask(std::string_view text)
+{
+	uint64_t mask = 0;
+	for (char c : text) {
+		mask |= uint64_t(1) << maskBit(static_cast<unsigned char>(c));
+	}
+	return mask;
+}
+
+FuzzyPattern::FuzzyPattern(std::string_view pattern)
+	: m_pattern(pattern)
+	, m_mask(fuzzyCharMask(pattern))
+	, m_caseSensitive(std::any_of(pattern.begin(), pattern.end(), [](char c) { return isupper(static_cast<unsigned char>(c)); }))
+{
+}
+
+bool FuzzyPattern::equal(char lineChar, char patternChar) const
+{
+	if (m_caseSensitive) {
+		return lineChar == patternChar;
+	}
+	return tolower(static_cast<unsigned char>(lineChar)) == patternChar;
+}
+
+bool FuzzyPattern::match(std::string_view line, int* score, std::vector<uint32_t>* positions) const
+{
+	const size_t patternSize = m_pattern.size();
+	if (patternSize == 0) {
+		*score = 0;
+		return true;
+	}
+
+	// Find the first place the whole pattern fits, scanning forwards
+	size_t p = 0;
+	size_t start = 0;
+	size_t end = 0;
+	for (size_t i = 0; i < line.size(); ++i) {
+		if (equal(line[i], m_pattern[p])) {
+			if (p == 0) {
+				start = i;
+			}
+			if (++p == patternSize) {
+				end = i + 1;
+				break;
+			}
+		}
+	}
+	if (p < patternSize) {
+		return false;
+	}
+
+	// Then scan backwards from its end for the shortest match ending there
+	p = patternSize;
+	for (size_t i = end; i-- > start;) {
+		if (equal(line[i], m_pattern[p - 1]) && --p == 0) {
+			start = i;
+			break;
+		}
+	}
+
+	if (positions) {
+		positions->clear();
+	}
+	int total = 0;
+	int consecutive = 0;
+	int firstBonus = 0;
+	bool inGap = false;
+	CharClass previous = start ? charClass(line[start - 1]) : CHAR_WHITE;
+	for (size_t i = start; i < end; ++i) {
+		CharClass current = charClass(line[i]);
+		if (p < patternSize && equal(line[i], m_pattern[p])) {
+			int bonus = bonusFor(previous, current);
+			if (consecutive == 0) {
+				firstBonus = bonus;
+			} else {
+				// A run keeps the bonus of the boundary it started at
+				if (bonus >= BONUS_BOUNDARY && bonus > firstBonus) {
+					firstBonus = bonus;
+				}
+				bonus = std::max({bonus, firstBonus, BONUS_CONSECUTIVE});
+			}
+			total += SCORE_MATCH + (p == 0 ? bonus * BONUS_FIRST_CHAR_MULTIPLIER : bonus);
+			if (positions) {
+				positions->push_back(static_cast<uint32_t>(i));
+			}
+			inGap = false;
+			++consecutive;
+			++p;
+		} else {
+			total += inGap ? SCORE_GAP_EXTENSION : SCORE_GAP_START;
+			inGap = true;
+			consecutive = 0;
+			firstBonus = 0;
+		}
+		previous = current;
+	}
+
+	*score = total;
+	return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Bitmask of the characters in text, case folded, for rejecting lines that
+// can't contain a pattern before scoring them. Letters and digits get a bit
+// each and everything else shares the rest.
+uint64_t fuzzyCharMask(std::string_view text);
+
+// A pattern whose characters must appear in order in a line, but not
+// necessarily next to each other. Scored like fzf's v1 algorithm: matches
+// at word boundaries and in consecutive runs score more, gaps cost.
+class FuzzyPattern {
+public:
+	FuzzyPattern(std::string_view pattern = std::string_view());
+
+	const std::string& pattern() const { return m_pattern; }
+	uint64_t mask() const { return m_mask; }
+
+	// Returns false if the line doesn't match. Otherwise sets score and,
+	// if given, the position in line of each pattern character.
+	bool match(std::string_view line, int* score, std::vector<uint32_t>* positions) const;
+
+private:
+	bool equal(char lineChar, char patternChar) const;
+
+	std::string m_pattern;
+	uint64_t m_mask;
+
+	// Smart case: only case sensitive if the pattern has upper case
+	bool m_caseSensitive;
+};
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Fast non-cryptographic 64 bit hash in the style of wyhash. Used for line
+// deduplication, so it must stay stable across versions of the cache file.
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b)
+{
+	__uint128_t r = static_cast<__uint128_t>(a) * b;
+	return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
+static inline uint64_t hashRead64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hashRead32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0)
+{
+	const uint64_t k0 = 0xa0761d6478bd642full;
+	const uint64_t k1 = 0xe7037ed1a0b428dbull;
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	const size_t length = size;
+	uint64_t h = seed ^ k0;
+	uint64_t a = 0, b = 0;
+
+	for (; size > 16; size -= 16, p += 16) {
+		h = hashMix(hashRead64(p) ^ k1, hashRead64(p + 8) ^ h);
+	}
+
+	if (size >= 8) {
+		a = hashRead64(p);
+		b = hashRead64(p + size - 8);
+	} else if (size >= 4) {
+		a = (hashRead32(p) << 32) | hashRead32(p + size - 4);
+	} else if (size > 0) {
+		a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[size >> 1]) << 8) | p[size - 1];
+	}
+
+	return hashMix(k1 ^ length, hashMix(a ^ k1, b ^ h));
+}
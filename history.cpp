@@ -1,99 +1,785 @@
-
 #include "history.h"
+#include "substring.h"
+#include "trace.h"
 #include <stdio.h>
-#include <readline/history.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <cstring>
 #include <limits>
 
-History::History()
+History::History(const std::string& filename)
+	: m_file(std::make_shared<HistoryFile>())
+{
+	TRACE_SCOPE("History::History");
+	if (!m_file->open(filename)) {
+		fprintf(stderr, "Failed to read %s: %s\n", filename.c_str(), strerror(errno));
+		throw NoHistoryException("Failed to read history file " + filename);
+	}
+
+	filter("");
+}
+
+std::string History::defaultFilename()
 {
-	std::string historyFilename;
 	const char* histfile = getenv("HISTFILE");
 	if (histfile) {
-		historyFilename = histfile;
+		return histfile;
+	}
+
+	const char *homedir;
+	if ((homedir = getenv("HOME")) == NULL) {
+		homedir = getpwuid(getuid())->pw_dir;
+	}
+
+	// Default to the history of the user's shell
+	const char* shell = getenv("SHELL");
+	std::string shellName = shell ? shell : "";
+	shellName = shellName.substr(shellName.rfind('/') + 1);
+	if (shellName == "zsh") {
+		return std::string(homedir) + "/.zsh_history";
+	} else if (shellName == "fish") {
+		const char* dataHome = getenv("XDG_DATA_HOME");
+		std::string dataDir = dataHome && *dataHome ? dataHome : std::string(homedir) + "/.local/share";
+		return dataDir + "/fish/fish_history";
+	}
+	return std::string(homedir) + "/.bash_history";
+}
+
+History::~History()
+{
+}
+
+const char* matchModeName(MatchMode mode)
+{
+	switch (mode) {
+	case MATCH_FUZZY:
+		return "fuzzy";
+	case MATCH_REGEX:
+		return "regex";
+	default:
+		return "exact";
+	}
+}
+
+bool parseMatchMode(const std::string& name, MatchMode* mode)
+{
+	for (MatchMode candidate : {MATCH_EXACT, MATCH_FUZZY, MATCH_REGEX}) {
+		if (name == matchModeName(candidate)) {
+			*mode = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool contains(std::string_view line, const std::string& pattern)
+{
+	return findSubstring(line.data(), line.size(), pattern.data(), pattern.size()) != nullptr;
+}
+
+// True if line matches an exact or regex pattern. Most lines lack the
+// literal every match of a regex contains, and are rejected before its DFA
+// runs.
+static bool lineMatches(std::string_view line, MatchMode mode, const std::string& pattern, const Regex& regex)
+{
+	if (mode != MATCH_REGEX) {
+		return contains(line, pattern);
+	}
+	return (regex.literal().empty() || contains(line, regex.literal())) && regex.search(line);
+}
+
+// Appends the matches of pattern that lie within line[from, to) and returns
+// where the next match could start
+static size_t findMatches(std::string_view line, const std::string& pattern, size_t from, size_t to, std::vector<LineRange>& matches)
+{
+	const char* begin = line.data();
+	const char* match = findSubstring(begin + from, to - from, pattern.data(), pattern.size());
+	while (match != nullptr) {
+		size_t start = match - begin;
+		matches.push_back({static_cast<uint32_t>(start), static_cast<uint32_t>(pattern.size())});
+		from = start + pattern.size();
+		match = findSubstring(begin + from, to - from, pattern.data(), pattern.size());
+	}
+	return from;
+}
+
+// Joins runs of consecutive fuzzy match positions into ranges
+static void positionsToRanges(const std::vector<uint32_t>& positions, std::vector<LineRange>& ranges)
+{
+	for (size_t i = 0; i < positions.size();) {
+		size_t j = i + 1;
+		while (j < positions.size() && positions[j] == positions[j - 1] + 1) {
+			++j;
+		}
+		ranges.push_back({positions[i], static_cast<uint32_t>(j - i)});
+		i = j;
+	}
+}
+
+// Distinct line positions [begin, end) split into chunks of HISTORY_SCAN_CHUNK_LINES, matched by
+// the thread pool newest chunk first. Chunks are merged into the result set
+// strictly in order, so results stay in recency order and the first chunk
+// can be shown while older ones are still being matched. Fuzzy scans of
+// small histories are chunked the same way but run on the calling thread.
+struct History::ParallelScan {
+	const HistoryFile* file;
+	MatchMode mode;
+	std::string pattern;
+	FuzzyPattern fuzzy;
+
+	// Each chunk matches with its own copy, since matching builds DFA states
+	Regex regex;
+
+	size_t begin;
+	size_t end;
+	size_t chunkCount;
+	bool parallel;
+	std::atomic<bool> cancelled{false};
+
+	// Set by a fuzzy chunk that had to drop matches
+	std::atomic<bool> truncated{false};
+
+	std::mutex mutex;
+	std::condition_variable chunkDone;
+	std::vector<std::vector<ScoredLine>> matches;
+	std::vector<char> complete;
+
+	// Chunks given to the pool, and chunks merged into the results
+	size_t submitted = 0;
+	size_t merged = 0;
+
+	size_t chunkEnd(size_t chunk) const
+	{
+		return end - std::min(end - begin, chunk * HISTORY_SCAN_CHUNK_LINES);
+	}
+};
+
+// Orders fuzzy matches best first: higher score, then more recent
+bool History::betterMatch(const ScoredLine& a, const ScoredLine& b)
+{
+	return a.score != b.score ? a.score > b.score : a.index > b.index;
+}
+
+// Adds line to a heap of at most HISTORY_FUZZY_MAX_RESULTS lines with the
+// worst on top. Returns false if a line was dropped.
+bool History::pushRanked(std::vector<ScoredLine>& heap, ScoredLine line)
+{
+	if (heap.size() < HISTORY_FUZZY_MAX_RESULTS) {
+		heap.push_back(line);
+		std::push_heap(heap.begin(), heap.end(), betterMatch);
+		return true;
+	}
+	if (betterMatch(line, heap.front())) {
+		std::pop_heap(heap.begin(), heap.end(), betterMatch);
+		heap.back() = line;
+		std::push_heap(heap.begin(), heap.end(), betterMatch);
+	}
+	return false;
+}
+
+void History::filter(const char *pattern, MatchMode mode)
+{
+	TRACE_SCOPE("History::filter");
+	std::string_view newPattern(pattern);
+
+	// Stop matching chunks for the old pattern. Whatever was merged stays.
+	if (!m_results.empty() && m_results.back().scan) {
+		m_results.back().scan->cancelled = true;
+		m_results.back().scan.reset();
+	}
+
+	// Discard results for patterns the new one doesn't contain. Subsequences
+	// nest like substrings, so this holds for fuzzy patterns too. Regexes
+	// don't, e.g. "ab" then "ab|c", so only an identical one is kept.
+	while (!m_results.empty() && (m_results.back().mode != mode ||
+		newPattern.find(m_results.back().pattern) == std::string_view::npos ||
+		(mode == MATCH_REGEX && m_results.back().pattern != newPattern))) {
+		popResultSet();
+	}
+
+	// E.g. a deleted character restoring the previous pattern
+	if (!m_results.empty() && m_results.back().pattern == newPattern) {
+		return;
+	}
+
+	pushResultSet(newPattern, mode);
+	ResultSet& results = m_results.back();
+	results.scanPos = m_file->distinct().size();
+	results.tailPos = 0;
+
+	// Lines matching the new pattern also match the old one, so the old
+	// results that still match are exactly the new results down to where
+	// the old search stopped, and up to where its forward search stopped.
+	if (m_results.size() > 1) {
+		const ResultSet& previous = m_results[m_results.size() - 2];
+		if (mode == MATCH_EXACT) {
+			results.scanPos = previous.scanPos;
+			results.tailPos = previous.tailPos;
+			for (size_t i = 0; i < previous.items.size(); ++i) {
+				uint32_t index = previous.items.index(i);
+				if (contains(m_file->line(index), results.pattern)) {
+					addItem(results.items, results, index);
+				}
+			}
+			for (size_t i = 0; i < previous.oldest.size(); ++i) {
+				uint32_t index = previous.oldest.index(i);
+				if (contains(m_file->line(index), results.pattern)) {
+					addItem(results.oldest, results, index);
+				}
+			}
+		} else if (previous.pattern.size() && previous.scanPos == 0 && !previous.truncated) {
+			// Fuzzy results are only a refinement if none were dropped
+			for (size_t i = 0; i < previous.items.size(); ++i) {
+				uint32_t index = previous.items.index(i);
+				int score;
+				if (results.fuzzy.match(m_file->line(index), &score, nullptr)) {
+					pushRanked(results.ranked, {score, index});
+				}
+			}
+			results.scanPos = 0;
+			finishRanking(results);
+		}
+	}
+
+	// A regex that doesn't compile, e.g. while typing "(a|", matches nothing
+	if (mode == MATCH_REGEX && !results.regex.valid()) {
+		results.scanPos = 0;
+	}
+
+	// Search anything older using the index, if possible
+	if (results.scanPos > 0 && mode != MATCH_FUZZY) {
+		const std::string& literal = mode == MATCH_REGEX ? results.regex.literal() : results.pattern;
+		results.useCandidates = m_file->index().candidates(literal, results.candidates);
+
+		// Candidates are all distinct lines. Find their positions.
+		const MappedArray<uint32_t>& distinct = m_file->distinct();
+		const uint32_t* position = distinct.data();
+		for (uint32_t& candidate : results.candidates) {
+			position = std::lower_bound(position, distinct.data() + distinct.size(), candidate);
+			candidate = static_cast<uint32_t>(position - distinct.data());
+		}
+		results.candidatePos = std::lower_bound(results.candidates.begin(), results.candidates.end(), results.scanPos) - results.candidates.begin();
+		results.candidateTailPos = std::lower_bound(results.candidates.begin(), results.candidates.end(), results.tailPos) - results.candidates.begin();
+	}
+	if (searchesMet(results)) {
+		joinSearches(results);
+	}
+}
+
+void History::ResultSet::clear()
+{
+	pattern.clear();
+	mode = MATCH_EXACT;
+	items.clear();
+	oldest.clear();
+	scanPos = 0;
+	tailPos = 0;
+	ranked.clear();
+	truncated = false;
+	useCandidates = false;
+	candidates.clear();
+	candidatePos = 0;
+	candidateTailPos = 0;
+	scan.reset();
+}
+
+void History::pushResultSet(std::string_view pattern, MatchMode mode)
+{
+	if (m_spareResults.empty()) {
+		m_results.push_back(ResultSet{});
+		m_results.back().items = HistoryItems(m_file.get());
+		m_results.back().oldest = HistoryItems(m_file.get());
 	} else {
-		const char *homedir;
-		if ((homedir = getenv("HOME")) == NULL) {
-			homedir = getpwuid(getuid())->pw_dir;
+		m_results.push_back(std::move(m_spareResults.back()));
+		m_spareResults.pop_back();
+	}
+
+	ResultSet& results = m_results.back();
+	results.clear();
+	results.pattern = pattern;
+	results.mode = mode;
+	if (mode == MATCH_FUZZY) {
+		results.fuzzy = FuzzyPattern(pattern);
+	} else if (mode == MATCH_REGEX) {
+		results.regex = Regex(pattern);
+	}
+}
+
+void History::popResultSet()
+{
+	m_spareResults.push_back(std::move(m_results.back()));
+	m_results.pop_back();
+}
+
+bool History::search(size_t maxItems, size_t maxLines)
+{
+	TRACE_SCOPE("History::search");
+	ResultSet& results = m_results.back();
+
+	// Split big scans across cores. The empty pattern matches everything, so
+	// only ever needs to look at a screenful of lines. Fuzzy patterns always
+	// scan everything, in chunks so the best of each can be kept.
+	bool ranked = results.mode == MATCH_FUZZY && results.pattern.size();
+	bool parallel = results.scanPos - results.tailPos >= 2 * HISTORY_SCAN_CHUNK_LINES;
+	if (!results.scan && !results.useCandidates && results.pattern.size() && !searchesMet(results) &&
+		(ranked || (results.items.size() < maxItems && parallel))) {
+		if (parallel && !m_pool) {
+			m_pool = std::make_unique<ThreadPool>();
+		}
+		results.scan = std::make_shared<ParallelScan>();
+		results.scan->file = m_file.get();
+		results.scan->mode = results.mode;
+		results.scan->pattern = results.pattern;
+		results.scan->fuzzy = results.fuzzy;
+		results.scan->regex = results.regex;
+		results.scan->begin = results.tailPos;
+		results.scan->end = results.scanPos;
+		results.scan->chunkCount = (results.scanPos - results.tailPos + HISTORY_SCAN_CHUNK_LINES - 1) / HISTORY_SCAN_CHUNK_LINES;
+		results.scan->parallel = parallel;
+		results.scan->matches.resize(results.scan->chunkCount);
+		results.scan->complete.resize(results.scan->chunkCount);
+	}
+	if (results.scan) {
+		return searchParallel(results, maxItems, maxLines);
+	}
+
+	// Walk backwards from where the last search stopped
+	const MappedArray<uint32_t>& distinct = m_file->distinct();
+	for (size_t lines = 0; results.items.size() < maxItems && !searchesMet(results) && lines < maxLines; ++lines) {
+		size_t position;
+		if (results.useCandidates) {
+			position = results.candidates[--results.candidatePos];
+			results.scanPos = position;
+		} else {
+			position = results.scanPos - 1;
+			results.scanPos = position;
+		}
+
+		uint32_t index = distinct[position];
+		if (results.pattern.size() && !lineMatches(m_file->line(index), results.mode, results.pattern, results.regex)) {
+			continue;
+		}
+		addItem(results.items, results, index);
+	}
+	if (searchesMet(results)) {
+		joinSearches(results);
+	}
+	return results.scanPos == 0;
+}
+
+bool History::searchOldest(size_t maxItems, size_t maxLines)
+{
+	TRACE_SCOPE("History::searchOldest");
+	ResultSet& results = m_results.back();
+	if (results.mode == MATCH_FUZZY && results.pattern.size()) {
+		return search(std::numeric_limits<size_t>::max(), maxLines);
+	}
+
+	// Stop any parallel scan so the two searches can't overlap. Its merged
+	// chunks are kept, and search() starts a new one above tailPos.
+	if (results.scan) {
+		results.scan->cancelled = true;
+		results.scan.reset();
+	}
+
+	// Walk forwards from where the last forward search stopped
+	const MappedArray<uint32_t>& distinct = m_file->distinct();
+	for (size_t lines = 0; results.oldest.size() < maxItems && !searchesMet(results) && lines < maxLines; ++lines) {
+		size_t position;
+		if (results.useCandidates) {
+			position = results.candidates[results.candidateTailPos++];
+		} else {
+			position = results.tailPos;
 		}
-		historyFilename = std::string(homedir) + "/.bash_history";
+		results.tailPos = position + 1;
+
+		uint32_t index = distinct[position];
+		if (results.pattern.size() && !lineMatches(m_file->line(index), results.mode, results.pattern, results.regex)) {
+			continue;
+		}
+		addItem(results.oldest, results, index);
+	}
+	if (searchesMet(results)) {
+		joinSearches(results);
 	}
+	return results.scanPos == 0;
+}
+
+// True once the backward and forward searches have covered every line
+bool History::searchesMet(const ResultSet& results)
+{
+	if (results.useCandidates) {
+		return results.candidatePos <= results.candidateTailPos;
+	}
+	return results.scanPos <= results.tailPos;
+}
+
+// Appends the forward search's matches, newest first, so items holds every
+// match
+void History::joinSearches(ResultSet& results)
+{
+	for (size_t i = results.oldest.size(); i-- > 0;) {
+		results.items.push_back(results.oldest[i]);
+	}
+	results.oldest.clear();
+	results.scanPos = 0;
+	results.tailPos = 0;
+	results.candidatePos = 0;
+	results.candidateTailPos = 0;
+}
+
+bool History::searchParallel(ResultSet& results, size_t maxItems, size_t maxLines)
+{
+	ParallelScan& scan = *results.scan;
+	bool ranked = scan.mode == MATCH_FUZZY;
+
+	// Keep a couple of chunks per thread in flight, but don't run too far
+	// ahead of what has been asked for
+	const size_t window = scan.parallel ? 2 * m_pool->size() : 0;
+
+	for (size_t lines = 0; (ranked || results.items.size() < maxItems) && scan.merged < scan.chunkCount && lines < maxLines;) {
+		while (scan.parallel && scan.submitted < scan.chunkCount && scan.submitted < scan.merged + window) {
+			submitChunk(results.scan, scan.submitted++);
+		}
 
-	using_history();
+		std::vector<ScoredLine> matches;
+		if (scan.parallel) {
+			std::unique_lock<std::mutex> lock(scan.mutex);
+			scan.chunkDone.wait(lock, [&scan] { return scan.complete[scan.merged] != 0; });
+			matches.swap(scan.matches[scan.merged]);
+		} else {
+			matches = scanChunk(scan, scan.merged);
+		}
 
-	if (read_history(historyFilename.c_str()) != 0) {
-		fprintf(stderr, "Failed to read %s\n", historyFilename.c_str());
-		throw NoHistoryException("Failed to read history file " + historyFilename);
+		for (const ScoredLine& line : matches) {
+			if (!ranked) {
+				addItem(results.items, results, line.index);
+			} else if (!pushRanked(results.ranked, line)) {
+				results.truncated = true;
+			}
+		}
+		lines += scan.chunkEnd(scan.merged) - scan.chunkEnd(scan.merged + 1);
+		results.scanPos = scan.chunkEnd(++scan.merged);
 	}
-	HISTORY_STATE *historyState=history_get_history_state();
 
-	filter(m_pattern.c_str());
+	// Possibly set by a chunk not merged yet, but that only costs refining
+	if (scan.truncated) {
+		results.truncated = true;
+	}
+	if (scan.merged == scan.chunkCount) {
+		results.scan.reset();
+		if (ranked) {
+			finishRanking(results);
+		}
+	}
+	if (searchesMet(results)) {
+		joinSearches(results);
+	}
+	return results.scanPos == 0;
 }
 
-History::~History()
+void History::submitChunk(const std::shared_ptr<ParallelScan>& scan, size_t chunk)
 {
-	clear_history();
+	m_pool->submit([scan, chunk] {
+		std::vector<ScoredLine> matches;
+		if (!scan->cancelled) {
+			matches = scanChunk(*scan, chunk);
+		}
+
+		std::lock_guard<std::mutex> lock(scan->mutex);
+		scan->matches[chunk] = std::move(matches);
+		scan->complete[chunk] = 1;
+		scan->chunkDone.notify_all();
+	});
 }
 
-void History::filter(const char *pattern)
+std::vector<History::ScoredLine> History::scanChunk(ParallelScan& scan, size_t chunk)
 {
-	history_set_pos(history_length); // no -1? doesn't smell right
-	m_pattern = pattern;
-	m_items.resize(0);
-	m_itemSet.clear();
+	TRACE_SCOPE("History::scanChunk");
+	const HistoryFile& file = *scan.file;
+	const MappedArray<uint32_t>& distinct = file.distinct();
+	std::vector<ScoredLine> matches;
+	if (scan.mode != MATCH_FUZZY) {
+		Regex regex = scan.regex;
+		for (size_t position = scan.chunkEnd(chunk); position-- > scan.chunkEnd(chunk + 1);) {
+			if (lineMatches(file.line(distinct[position]), scan.mode, scan.pattern, regex)) {
+				matches.push_back({0, distinct[position]});
+			}
+		}
+		return matches;
+	}
+
+	// Keep only the chunk's best lines
+	const uint64_t mask = scan.fuzzy.mask();
+	for (size_t position = scan.chunkEnd(chunk); position-- > scan.chunkEnd(chunk + 1);) {
+		uint32_t index = distinct[position];
+		int score;
+		if ((file.charMask(index) & mask) != mask || !scan.fuzzy.match(file.line(index), &score, nullptr)) {
+			continue;
+		}
+		if (!pushRanked(matches, {score, index})) {
+			scan.truncated = true;
+		}
+	}
+	return matches;
 }
 
-HistoryItem History::makeHistoryItem(const char* line)
+void History::addItem(HistoryItems& items, const ResultSet& results, uint32_t index)
 {
-	HistoryItem item = {};
-	item.line = line;
+	items.push_back(index);
+
+	const std::string& pattern = results.pattern;
+	if (pattern.empty()) {
+		return;
+	}
+
+	// Fuzzy positions all come from scoring the whole line anyway
+	std::string_view line = m_file->line(index);
+	m_ranges.clear();
+	if (results.mode == MATCH_FUZZY) {
+		int score;
+		results.fuzzy.match(line, &score, &m_positions);
+		positionsToRanges(m_positions, m_ranges);
+		for (const LineRange& range : m_ranges) {
+			items.addMatch(range);
+		}
+		return;
+	}
+
+	size_t eagerEnd = std::min<size_t>(line.size(), HISTORY_EAGER_MATCH_BYTES);
+	if (results.mode == MATCH_REGEX) {
+		m_regexMatches.clear();
+		size_t next = results.regex.findAll(line, 0, eagerEnd, m_regexMatches);
+		for (const RegexMatch& match : m_regexMatches) {
+			items.addMatch({match.start, match.size});
+		}
 
-	if (m_pattern.size()) {
-		size_t matches = 0;
-		const char* match = std::strstr(line, m_pattern.c_str());
-		while (matches < HISTORY_MAX_MATCHES && match != nullptr) {
-			// Don't store matches beyond 255 bytes
-			if (match + m_pattern.size() - line > std::numeric_limits<uint8_t>::max()) {
-				break;
+		// The last match may have reached past eagerEnd already
+		if (next < line.size()) {
+			items.addResume(static_cast<uint32_t>(next));
+		}
+		return;
+	}
+
+	size_t next = findMatches(line, pattern, 0, eagerEnd, m_ranges);
+	for (const LineRange& range : m_ranges) {
+		items.addMatch(range);
+	}
+
+	// A match could still start anywhere that reaches past eagerEnd
+	if (eagerEnd < line.size()) {
+		size_t resume = eagerEnd >= pattern.size() ? eagerEnd - pattern.size() + 1 : 0;
+		items.addResume(static_cast<uint32_t>(std::max(next, resume)));
+	}
+}
+
+void History::itemMatches(const HistoryItem& item, const std::string& pattern, MatchMode mode, std::vector<LineRange>& matches)
+{
+	matches.clear();
+	MatchReader reader(item);
+	LineRange range;
+	while (reader.next(&range)) {
+		if (range.size) {
+			matches.push_back(range);
+		} else if (mode == MATCH_EXACT) {
+			findMatches(item.line, pattern, range.start, item.line.size(), matches);
+		} else if (mode == MATCH_REGEX) {
+			// Every item drawn shares the pattern, so it is compiled once
+			static thread_local std::string compiled;
+			static thread_local Regex regex;
+			static thread_local std::vector<RegexMatch> regexMatches;
+			if (compiled != pattern) {
+				regex = Regex(pattern);
+				compiled = pattern;
+			}
+			regexMatches.clear();
+			regex.findAll(item.line, range.start, item.line.size(), regexMatches);
+			for (const RegexMatch& match : regexMatches) {
+				matches.push_back({match.start, match.size});
 			}
-			item.matches.push_back({static_cast<uint8_t>(match - line), static_cast<uint8_t>(m_pattern.size())});
-			match = std::strstr(match + m_pattern.size(), m_pattern.c_str());
 		}
 	}
+}
+
+void History::finishRanking(ResultSet& results)
+{
+	TRACE_SCOPE("History::finishRanking");
+	std::sort_heap(results.ranked.begin(), results.ranked.end(), betterMatch);
+	for (const ScoredLine& line : results.ranked) {
+		addItem(results.items, results, line.index);
+	}
+	results.ranked.clear();
+}
 
-	return item;
+int History::watchFile(const std::string& filename)
+{
+	size_t slash = filename.rfind('/');
+	std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : filename.substr(0, slash);
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd >= 0 && inotify_add_watch(fd, directory.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
 }
 
-void History::getItems(int max, int *count, const HistoryItem **items)
+History::IngestResult History::ingest()
 {
-	while ((int)m_items.size() < max) {
-		HIST_ENTRY *entry;
-		if (m_pattern.size()) {
-			if (history_search(m_pattern.c_str(), -1) < 0) {
-				break;
-			} else {
-				entry = current_history();
-				previous_history();
+	TRACE_SCOPE("History::ingest");
+	// Most events are for other files in the directory
+	if (!m_file->changed()) {
+		return INGEST_NONE;
+	}
+
+	// The line table and distinct list are about to grow, so nothing may be
+	// reading them. Scans resume from where their merged chunks reached.
+	cancelScans();
+
+	// Only the current results are kept up to date
+	while (m_results.size() > 1) {
+		std::swap(m_results[m_results.size() - 2], m_results.back());
+		popResultSet();
+	}
+	ResultSet& results = m_results.back();
+
+	// Appended lines go after the others in the distinct list, but lines
+	// they duplicate are removed from it, moving those after them down.
+	// Their old positions follow from where they would go in the new list.
+	const MappedArray<uint32_t>& distinct = m_file->distinct();
+	const uint32_t oldLines = static_cast<uint32_t>(m_file->size());
+	m_removed.clear();
+	HistoryAppendResult appended = m_file->append(&m_removed);
+	if (appended != HISTORY_APPEND_LINES) {
+		return appended == HISTORY_APPEND_NONE ? INGEST_NONE : INGEST_RELOAD;
+	}
+	m_removedPositions.clear();
+	for (size_t i = 0; i < m_removed.size(); ++i) {
+		size_t position = std::lower_bound(distinct.data(), distinct.data() + distinct.size(), m_removed[i]) - distinct.data();
+		m_removedPositions.push_back(static_cast<uint32_t>(position + i));
+	}
+	auto shift = [this](size_t position) {
+		return position - (std::lower_bound(m_removedPositions.begin(), m_removedPositions.end(), position) - m_removedPositions.begin());
+	};
+	results.scanPos = shift(results.scanPos);
+	results.tailPos = shift(results.tailPos);
+	if (m_removed.size()) {
+		size_t kept = 0;
+		size_t candidatePos = results.candidatePos;
+		size_t candidateTailPos = results.candidateTailPos;
+		for (size_t i = 0; i < results.candidates.size(); ++i) {
+			uint32_t position = results.candidates[i];
+			if (std::binary_search(m_removedPositions.begin(), m_removedPositions.end(), position)) {
+				candidatePos -= i < results.candidatePos;
+				candidateTailPos -= i < results.candidateTailPos;
+				continue;
 			}
-		} else {
-			entry = previous_history();
-			if (!entry) {
-				break;
+			results.candidates[kept++] = static_cast<uint32_t>(shift(position));
+		}
+		results.candidates.resize(kept);
+		results.candidatePos = candidatePos;
+		results.candidateTailPos = candidateTailPos;
+	}
+
+	removeItems(results.items, m_removed);
+	removeItems(results.oldest, m_removed);
+	size_t newLines = std::lower_bound(distinct.data(), distinct.data() + distinct.size(), oldLines) - distinct.data();
+	if (results.mode != MATCH_FUZZY || results.pattern.empty()) {
+		// The new lines are the most recent, so their matches go first
+		HistoryItems items(m_file.get());
+		for (size_t position = distinct.size(); position-- > newLines;) {
+			uint32_t index = distinct[position];
+			if (results.pattern.empty() || lineMatches(m_file->line(index), results.mode, results.pattern, results.regex)) {
+				addItem(items, results, index);
 			}
 		}
-		assert(entry);
-		if (m_itemSet.find(entry->line) == m_itemSet.end()) {
-			m_itemSet.insert(entry->line);
-			m_items.push_back(makeHistoryItem(entry->line));
+		for (size_t i = 0; i < results.items.size(); ++i) {
+			items.push_back(results.items[i]);
+		}
+		results.items = std::move(items);
+	} else {
+		// Finished fuzzy results are ranked again with the new lines.
+		// Otherwise the new lines join those ranked so far.
+		auto removed = [this](const ScoredLine& line) {
+			return std::binary_search(m_removed.begin(), m_removed.end(), line.index);
+		};
+		results.ranked.erase(std::remove_if(results.ranked.begin(), results.ranked.end(), removed), results.ranked.end());
+		std::make_heap(results.ranked.begin(), results.ranked.end(), betterMatch);
+		bool finished = searchesMet(results);
+		int score;
+		if (finished) {
+			for (size_t i = 0; i < results.items.size(); ++i) {
+				uint32_t index = results.items.index(i);
+				results.fuzzy.match(m_file->line(index), &score, nullptr);
+				pushRanked(results.ranked, {score, index});
+			}
+			results.items.clear();
+		}
+		for (size_t position = newLines; position < distinct.size(); ++position) {
+			uint32_t index = distinct[position];
+			if (results.fuzzy.match(m_file->line(index), &score, nullptr) && !pushRanked(results.ranked, {score, index})) {
+				results.truncated = true;
+			}
 		}
+		if (finished) {
+			finishRanking(results);
+		}
+	}
+	++m_revision;
+	return INGEST_APPENDED;
+}
+
+bool History::reload()
+{
+	TRACE_SCOPE("History::reload");
+	auto file = std::make_shared<HistoryFile>();
+	if (!file->open(m_file->filename())) {
+		return false;
 	}
-	*count = (int)m_items.size();
-	*items = &m_items[0];
+
+	// Every result set's items were made for the old file
+	cancelScans();
+	m_results.clear();
+	m_spareResults.clear();
+	m_file = std::move(file);
+	++m_revision;
+	filter("");
+	return true;
 }
 
+void History::cancelScans()
+{
+	for (std::vector<ResultSet>* sets : {&m_results, &m_spareResults}) {
+		for (ResultSet& results : *sets) {
+			if (results.scan) {
+				results.scan->cancelled = true;
+				results.scan.reset();
+			}
+		}
+	}
+	if (m_pool) {
+		m_pool->wait();
+	}
+}
+
+void History::removeItems(HistoryItems& items, const std::vector<uint32_t>& removed)
+{
+	HistoryItems kept(m_file.get());
+	for (size_t i = 0; i < items.size(); ++i) {
+		if (!std::binary_search(removed.begin(), removed.end(), items.index(i))) {
+			kept.push_back(items[i]);
+		}
+	}
+	if (kept.size() != items.size()) {
+		items = std::move(kept);
+	}
+}
@@ -1,37 +1,198 @@
-
 #pragma once
+#include "fuzzy.h"
+#include "historyfile.h"
+#include "historyitems.h"
+#include "regex.h"
+#include "threadpool.h"
 #include <stdint.h>
+#include <memory>
 #include <vector>
 #include <stdexcept>
-#include <unordered_set>
+#include <string>
+#include <string_view>
 
-#define HISTORY_MAX_MATCHES 4
+// Matches are found while searching only in about a screen width at the
+// start of each line. The rest are found when the line is drawn.
+#define HISTORY_EAGER_MATCH_BYTES 256
 
-struct LineRange {
-	uint8_t start, size;
-};
+// Lines per chunk of a parallel scan. Full scans of histories smaller than
+// two chunks stay on the calling thread.
+#define HISTORY_SCAN_CHUNK_LINES 16384
+
+// Most results kept for a fuzzy pattern. Only the best scoring lines are
+// kept, so ranking never sorts every match.
+#define HISTORY_FUZZY_MAX_RESULTS 1024
+
+enum MatchMode {
+	// Lines containing the pattern, most recent first
+	MATCH_EXACT,
+
+	// Lines containing the pattern's characters in order, best score first
+	MATCH_FUZZY,
 
-struct HistoryItem {
-	const char* line;
-	std::vector<LineRange> matches;
+	// Lines matching the pattern as a regular expression, most recent first
+	MATCH_REGEX,
 };
 
+// "exact", "fuzzy" or "regex"
+const char* matchModeName(MatchMode mode);
+
+// Sets mode from its name. Returns false if there is no such mode.
+bool parseMatchMode(const std::string& name, MatchMode* mode);
+
 class History {
 public:
-	History();
+	// Loads filename. Throws NoHistoryException if it can't be read.
+	History(const std::string& filename);
 	~History();
 
+	// $HISTFILE, or the history file of the user's shell
+	static std::string defaultFilename();
+
 	class NoHistoryException : public std::runtime_error {
 		using std::runtime_error::runtime_error;
 	};
 
-	void filter(const char *pattern);
-	void getItems(int max, int *count, const HistoryItem **items);
+	enum IngestResult {
+		// The history file hasn't changed
+		INGEST_NONE,
+		// Lines were appended and the current results updated
+		INGEST_APPENDED,
+		// The file was rewritten. Only loading it again shows the changes.
+		INGEST_RELOAD,
+	};
+
+	// Watches the directory of filename, where shells may replace it with a
+	// new file, with inotify. Events name any file in the directory, so
+	// check for changes with ingest(). Returns the fd, or -1 on failure.
+	static int watchFile(const std::string& filename);
+
+	const std::string& filename() const { return m_file->filename(); }
+
+	// Adds lines appended to the history file by other shells, parsing only
+	// the new bytes. The current results are brought up to date by
+	// searching just the new lines. New exact matches go before the others,
+	// and lines they duplicate are removed. Results for shorter patterns
+	// are dropped rather than updated.
+	IngestResult ingest();
+
+	// Opens the history file again after ingest() returns INGEST_RELOAD,
+	// and filters it for "" as when constructed. Items that are already
+	// copied out keep viewing the old file while they hold file(). Returns
+	// false and keeps the old lines if it can't be read.
+	bool reload();
+
+	// The file items view, for keeping its lines mapped after a reload
+	std::shared_ptr<const HistoryFile> file() const { return m_file; }
+
+	// Incremented whenever ingest() changes the current results
+	uint64_t revision() const { return m_revision; }
+
+	void filter(const char *pattern, MatchMode mode = MATCH_EXACT);
+
+	// Search until there are maxItems results or maxLines lines have been
+	// checked, so a caller can stop early. Returns true once every line has
+	// been searched. Fuzzy results only appear once every line has been
+	// searched, since any line might rank first.
+	bool search(size_t maxItems, size_t maxLines);
+	const HistoryItems& items() const { return m_results.back().items; }
+
+	// Like search(), but collects the oldest matches by searching forwards
+	// from the oldest line, so the end of the results can be shown without
+	// finding everything in between. Once the two searches meet, the oldest
+	// matches are appended to items() and true is returned. Fuzzy results
+	// have no order until every line is searched, so this just searches.
+	bool searchOldest(size_t maxItems, size_t maxLines);
+
+	// Oldest matches found by searchOldest(), oldest first. Empty once the
+	// searches meet.
+	const HistoryItems& oldest() const { return m_results.back().oldest; }
+
+	// Every match of pattern in an item, finishing any matching that was
+	// left for draw time
+	static void itemMatches(const HistoryItem& item, const std::string& pattern, MatchMode mode, std::vector<LineRange>& matches);
 
 private:
-	HistoryItem makeHistoryItem(const char* line);
+	struct ParallelScan;
+
+	struct ScoredLine {
+		int score;
+		uint32_t index;
+	};
+
+	// Matches for one pattern, found by walking the distinct lines backwards
+	// from the most recent, and forwards from the oldest if asked for.
+	// Positions are indices into HistoryFile::distinct(). Every position at
+	// or above scanPos, and below tailPos, has been searched.
+	struct ResultSet {
+		std::string pattern;
+		MatchMode mode;
+		FuzzyPattern fuzzy;
+		Regex regex;
+		HistoryItems items;
+		HistoryItems oldest;
+		size_t scanPos;
+		size_t tailPos;
+
+		// Best fuzzy matches so far, as a heap with the worst on top. Moved
+		// into items in score order when the search finishes.
+		std::vector<ScoredLine> ranked;
+
+		// True if some fuzzy matches didn't make HISTORY_FUZZY_MAX_RESULTS
+		bool truncated;
+
+		// Positions of trigram index candidates, if the pattern, or the
+		// literal every match of a regex contains, is long enough. Only
+		// those in [candidateTailPos, candidatePos) are left to search.
+		bool useCandidates;
+		std::vector<uint32_t> candidates;
+		size_t candidatePos;
+		size_t candidateTailPos;
+
+		// Full scans of large histories are split across m_pool
+		std::shared_ptr<ParallelScan> scan;
+
+		// Reset for a new pattern, keeping capacity
+		void clear();
+	};
+
+	static bool betterMatch(const ScoredLine& a, const ScoredLine& b);
+	static bool pushRanked(std::vector<ScoredLine>& heap, ScoredLine line);
+	void pushResultSet(std::string_view pattern, MatchMode mode);
+	void popResultSet();
+	bool searchParallel(ResultSet& results, size_t maxItems, size_t maxLines);
+	void submitChunk(const std::shared_ptr<ParallelScan>& scan, size_t chunk);
+	static std::vector<ScoredLine> scanChunk(ParallelScan& scan, size_t chunk);
+	static bool searchesMet(const ResultSet& results);
+	void joinSearches(ResultSet& results);
+	void addItem(HistoryItems& items, const ResultSet& results, uint32_t index);
+	void removeItems(HistoryItems& items, const std::vector<uint32_t>& removed);
+	void finishRanking(ResultSet& results);
+	void cancelScans();
+
+	std::shared_ptr<HistoryFile> m_file;
+
+	// Result sets for successively longer patterns, each containing the
+	// pattern below it. Extending the pattern refines the top set instead
+	// of searching everything again, and deleting characters pops back to
+	// an earlier set that is still valid.
+	std::vector<ResultSet> m_results;
+
+	// Popped result sets, reused so that steady typing doesn't allocate
+	std::vector<ResultSet> m_spareResults;
+
+	// Scratch space for match positions
+	std::vector<uint32_t> m_positions;
+	std::vector<LineRange> m_ranges;
+	std::vector<RegexMatch> m_regexMatches;
+
+	// Scratch space for lines removed by ingest(), and where they were in
+	// the distinct list
+	std::vector<uint32_t> m_removed;
+	std::vector<uint32_t> m_removedPositions;
+
+	uint64_t m_revision = 0;
 
-	std::vector<HistoryItem> m_items;
-	std::string m_pattern;
-	std::unordered_set<std::string> m_itemSet;                 
+	// Created on first use
+	std::unique_ptr<ThreadPool> m_pool;
 };
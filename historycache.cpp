@@ -0,0 +1,189 @@
+#include "historycache.h"
+#include "hash.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+
+static const char g_cacheMagic[8] = {'S', 'H', 'I', 'S', 'T', 'I', 'D', 'X'};
+
+// Sections start on cache line boundaries so they can be used in place
+static const size_t g_sectionAlignment = 64;
+
+static size_t alignSection(size_t offset)
+{
+	return (offset + g_sectionAlignment - 1) & ~(g_sectionAlignment - 1);
+}
+
+static bool makeDirectory(const std::string& path)
+{
+	return mkdir(path.c_str(), 0700) == 0 || errno == EEXIST;
+}
+
+static bool writeAll(int fd, const void* data, size_t size)
+{
+	const char* p = static_cast<const char*>(data);
+	while (size) {
+		ssize_t written = ::write(fd, p, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += written;
+		size -= written;
+	}
+	return true;
+}
+
+HistoryCache::~HistoryCache()
+{
+	close();
+}
+
+std::string HistoryCache::pathFor(const std::string& historyFilename)
+{
+	std::string directory;
+	const char* cacheHome = getenv("XDG_CACHE_HOME");
+	if (cacheHome && cacheHome[0] == '/') {
+		directory = cacheHome;
+	} else {
+		const char *homedir;
+		if ((homedir = getenv("HOME")) == NULL) {
+			struct passwd* pw = getpwuid(getuid());
+			if (!pw) {
+				return std::string();
+			}
+			homedir = pw->pw_dir;
+		}
+		directory = std::string(homedir) + "/.cache";
+	}
+	if (!makeDirectory(directory) || !makeDirectory(directory + "/shist")) {
+		return std::string();
+	}
+	directory += "/shist";
+
+	// Name the cache after the history file's canonical path so different
+	// HISTFILEs don't share a cache
+	char resolved[PATH_MAX];
+	std::string canonical = realpath(historyFilename.c_str(), resolved) ? resolved : historyFilename;
+	std::string basename = canonical.substr(canonical.find_last_of('/') + 1);
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "-%016llx.idx", static_cast<unsigned long long>(hashBytes(canonical.data(), canonical.size())));
+	return directory + "/" + basename + suffix;
+}
+
+bool HistoryCache::open(const std::string& path)
+{
+	close();
+
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(HistoryCacheHeader)) {
+		::close(fd);
+		return false;
+	}
+
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	m_data = static_cast<const char*>(data);
+	m_size = static_cast<size_t>(st.st_size);
+	m_header = reinterpret_cast<const HistoryCacheHeader*>(m_data);
+
+	if (memcmp(m_header->magic, g_cacheMagic, sizeof(g_cacheMagic)) != 0 ||
+		m_header->version != HISTORY_CACHE_VERSION ||
+		m_header->sectionCount > (m_size - sizeof(HistoryCacheHeader)) / sizeof(HistoryCacheSectionEntry)) {
+		close();
+		return false;
+	}
+
+	m_sections = reinterpret_cast<const HistoryCacheSectionEntry*>(m_data + sizeof(HistoryCacheHeader));
+	for (uint32_t i = 0; i < m_header->sectionCount; ++i) {
+		const HistoryCacheSectionEntry& entry = m_sections[i];
+		if (entry.elementSize == 0 || entry.offset % g_sectionAlignment != 0 || entry.offset > m_size ||
+			entry.count > (m_size - entry.offset) / entry.elementSize) {
+			close();
+			return false;
+		}
+	}
+	return true;
+}
+
+void HistoryCache::close()
+{
+	if (m_data) {
+		munmap(const_cast<char*>(m_data), m_size);
+	}
+	m_data = nullptr;
+	m_size = 0;
+	m_header = nullptr;
+	m_sections = nullptr;
+}
+
+const void* HistoryCache::findSection(uint32_t id, uint32_t elementSize, size_t* count) const
+{
+	if (!m_header) {
+		return nullptr;
+	}
+	for (uint32_t i = 0; i < m_header->sectionCount; ++i) {
+		const HistoryCacheSectionEntry& entry = m_sections[i];
+		if (entry.id == id && entry.elementSize == elementSize) {
+			*count = static_cast<size_t>(entry.count);
+			return m_data + entry.offset;
+		}
+	}
+	return nullptr;
+}
+
+bool HistoryCache::write(const std::string& path, const HistoryCacheHeader& header, const std::vector<Section>& sections)
+{
+	HistoryCacheHeader fileHeader = header;
+	memcpy(fileHeader.magic, g_cacheMagic, sizeof(g_cacheMagic));
+	fileHeader.version = HISTORY_CACHE_VERSION;
+	fileHeader.sectionCount = static_cast<uint32_t>(sections.size());
+
+	std::vector<HistoryCacheSectionEntry> entries;
+	size_t offset = alignSection(sizeof(HistoryCacheHeader) + sizeof(HistoryCacheSectionEntry) * sections.size());
+	for (const Section& section : sections) {
+		entries.push_back({section.id, section.elementSize, offset, section.count});
+		offset = alignSection(offset + section.elementSize * section.count);
+	}
+
+	// Write to a temporary file and rename it over the old cache, so a
+	// concurrent reader never sees a partially written file
+	std::string tmpPath = path + ".tmp." + std::to_string(getpid());
+	int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return false;
+	}
+
+	static const char padding[g_sectionAlignment] = {};
+	size_t written = sizeof(fileHeader) + sizeof(HistoryCacheSectionEntry) * entries.size();
+	bool ok = writeAll(fd, &fileHeader, sizeof(fileHeader)) &&
+		writeAll(fd, entries.data(), sizeof(HistoryCacheSectionEntry) * entries.size());
+	for (size_t i = 0; ok && i < sections.size(); ++i) {
+		ok = writeAll(fd, padding, entries[i].offset - written) &&
+			writeAll(fd, sections[i].data, sections[i].elementSize * sections[i].count);
+		written = entries[i].offset + sections[i].elementSize * sections[i].count;
+	}
+
+	if (::close(fd) != 0 || !ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+		unlink(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Bump whenever the layout or meaning of any section changes
+#define HISTORY_CACHE_VERSION 6
+
+// Number of bytes before the end of the cached range that are hashed to
+// detect a history file that was rewritten rather than appended to
+#define HISTORY_CACHE_TAIL_BYTES 4096
+
+// Lines added since the full cache was written are kept in a delta segment
+// beside it, until there are more than 1/HISTORY_CACHE_DELTA_FRACTION as
+// many as it holds and it is rewritten with them
+#define HISTORY_CACHE_DELTA_FRACTION 8
+
+enum HistoryCacheSectionId : uint32_t {
+	CACHE_SECTION_OFFSETS = 1,
+	CACHE_SECTION_LENGTHS,
+	CACHE_SECTION_HASHES,
+	CACHE_SECTION_TRIGRAM_KEYS,
+	CACHE_SECTION_TRIGRAM_STARTS,
+	CACHE_SECTION_TRIGRAM_LINES,
+	CACHE_SECTION_CHAR_MASKS,
+	CACHE_SECTION_DISTINCT_LINES,
+	CACHE_SECTION_LINE_SET,
+	CACHE_SECTION_TIMES,
+	CACHE_SECTION_ARENA,
+	CACHE_SECTION_REMOVED_LINES,
+};
+
+struct HistoryCacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t sectionCount;
+
+	// Identity of the history file when the cache was written
+	uint64_t device;
+	uint64_t inode;
+	uint64_t fileSize;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+
+	// Bytes of the history file described by the cache. Always ends at the
+	// start of an entry so appended data can be scanned from here.
+	uint64_t coveredSize;
+	uint64_t tailHash;
+	uint64_t lineCount;
+
+	// Zero in a full cache. A delta segment only applies to the full cache
+	// with these coveredSize, tailHash and lineCount.
+	uint64_t baseCoveredSize;
+	uint64_t baseTailHash;
+	uint64_t baseLineCount;
+};
+
+struct HistoryCacheSectionEntry {
+	uint32_t id;
+	uint32_t elementSize;
+	uint64_t offset;
+	uint64_t count;
+};
+
+// Versioned binary index of a history file, stored under
+// $XDG_CACHE_HOME/shist/. The file is mapped and its sections are used in
+// place, so a valid cache costs a few page faults rather than a full parse.
+// A delta segment has the same layout, but holds only what lines appended
+// since a full cache add to it, so appending never rewrites the whole cache.
+class HistoryCache {
+public:
+	struct Section {
+		uint32_t id;
+		uint32_t elementSize;
+		const void* data;
+		size_t count;
+	};
+
+	HistoryCache() = default;
+	~HistoryCache();
+	HistoryCache(const HistoryCache&) = delete;
+	HistoryCache& operator=(const HistoryCache&) = delete;
+
+	// Cache filename for the given history file. Creates the cache directory.
+	// Returns an empty string if there is nowhere to put it.
+	static std::string pathFor(const std::string& historyFilename);
+
+	// Maps an existing cache and checks its magic, version and section table
+	bool open(const std::string& path);
+	void close();
+
+	const HistoryCacheHeader* header() const { return m_header; }
+
+	template <typename T>
+	bool section(uint32_t id, const T** data, size_t* count) const
+	{
+		const void* found = findSection(id, sizeof(T), count);
+		*data = static_cast<const T*>(found);
+		return found != nullptr;
+	}
+
+	// Atomically replaces the cache at path with the header and sections given
+	static bool write(const std::string& path, const HistoryCacheHeader& header, const std::vector<Section>& sections);
+
+private:
+	const void* findSection(uint32_t id, uint32_t elementSize, size_t* count) const;
+
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+	const HistoryCacheHeader* m_header = nullptr;
+	const HistoryCacheSectionEntry* m_sections = nullptr;
+};
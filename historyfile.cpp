@@ -0,0 +1,999 @@
+#include "historyfile.h"
+#include "fuzzy.h"
+#include "hash.h"
+#include "trace.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const size_t NO_POSITION = std::numeric_limits<size_t>::max();
+
+// zsh stores bytes that clash with its tokens as this, then the byte ^ 32
+const unsigned char ZSH_META = 0x83;
+
+bool startsWith(std::string_view text, std::string_view prefix)
+{
+	return text.substr(0, prefix.size()) == prefix;
+}
+
+// True if every line lies within the first size bytes of the file, or the
+// first arenaSize bytes of the arena if it was decoded
+bool linesInBounds(const uint64_t* offsets, const uint32_t* lengths, size_t count, uint64_t size, uint64_t arenaSize)
+{
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t offset = offsets[i] & ~HISTORY_ARENA_OFFSET;
+		uint64_t limit = offsets[i] & HISTORY_ARENA_OFFSET ? arenaSize : size;
+		if (offset > limit || lengths[i] > limit - offset) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// True if values ascend and each is in [begin, end)
+bool ascendingIn(const uint32_t* values, size_t count, uint64_t begin, uint64_t end)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (values[i] < begin || values[i] >= end || (i && values[i] <= values[i - 1])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// True if keys ascend and each has a run of the lines. The lines themselves
+// aren't read, as that would fault in the whole index.
+bool postingsInBounds(const uint32_t* keys, size_t keyCount, const uint64_t* starts, size_t startCount, size_t lineCount)
+{
+	if (keyCount == 0) {
+		return true;
+	}
+	if (startCount != keyCount + 1 || starts[0] != 0 || starts[keyCount] != lineCount) {
+		return false;
+	}
+	for (size_t i = 0; i < keyCount; ++i) {
+		if (starts[i + 1] < starts[i] || (i && keys[i] <= keys[i - 1])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Parses decimal digits at p, returning just after them or null if there
+// are none
+const char* parseNumber(const char* p, const char* end, uint64_t* value)
+{
+	const char* begin = p;
+	uint64_t result = 0;
+	while (p < end && isdigit(static_cast<unsigned char>(*p))) {
+		result = result * 10 + (*p++ - '0');
+	}
+	*value = result;
+	return p != begin ? p : nullptr;
+}
+
+// Parses zsh's extended history prefix, ": <start>:<elapsed>;", returning
+// the start of the command after it, or p if there isn't one
+const char* parseZshHeader(const char* p, const char* end, uint64_t* time)
+{
+	uint64_t start, elapsed;
+	if (end - p < 2 || p[0] != ':' || p[1] != ' ') {
+		return p;
+	}
+	const char* c = parseNumber(p + 2, end, &start);
+	if (!c || c == end || *c != ':') {
+		return p;
+	}
+	c = parseNumber(c + 1, end, &elapsed);
+	if (!c || c == end || *c != ';') {
+		return p;
+	}
+	*time = start;
+	return c + 1;
+}
+
+}
+
+HistoryFile::~HistoryFile()
+{
+	close();
+}
+
+bool HistoryFile::open(const std::string& filename)
+{
+	TRACE_SCOPE("HistoryFile::open");
+	close();
+
+	m_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (m_fd < 0) {
+		return false;
+	}
+
+	if (fstat(m_fd, &m_stat) != 0) {
+		int err = errno;
+		close();
+		errno = err;
+		return false;
+	}
+
+	// Pages past the end of the file can't be read until it grows into
+	// them. Shared, so pages faulted in before then show what is appended.
+	m_filename = filename;
+	m_dataSize = static_cast<size_t>(m_stat.st_size);
+	m_mapSize = m_dataSize + std::max(m_dataSize, HISTORY_MAP_RESERVE_BYTES);
+	void* data = mmap(nullptr, m_mapSize, PROT_READ, MAP_SHARED, m_fd, 0);
+	if (data == MAP_FAILED) {
+		int err = errno;
+		close();
+		errno = err;
+		return false;
+	}
+	m_data = static_cast<const char*>(data);
+	m_format = detectFormat(filename);
+
+	m_cachePath = HistoryCache::pathFor(filename);
+	if (!m_cachePath.empty()) {
+		m_deltaPath = m_cachePath + ".delta";
+	}
+	bool cacheValid = loadCache();
+	if (cacheValid) {
+		// A missing or outdated delta segment only means scanning more
+		loadDelta();
+	}
+	size_t cachedEnd = m_scanEnd;
+	size_t cachedLines = m_scanEndLines;
+
+	if (!cacheValid) {
+		// Rough guess to avoid most reallocations while scanning
+		m_offsets.reserve(m_dataSize / 32);
+		m_lengths.reserve(m_dataSize / 32);
+		m_hashes.reserve(m_dataSize / 32);
+		m_charMasks.reserve(m_dataSize / 32);
+		m_times.reserve(m_dataSize / 32);
+		madvise(const_cast<char*>(m_data), m_dataSize, MADV_SEQUENTIAL);
+	}
+
+	// Scan whatever the cache doesn't cover. Usually nothing, or just the
+	// lines appended since it was written.
+	scanLines(m_scanEnd, m_dataSize);
+
+	// Decoded entries are rare, so a little room lets append() add them
+	// without moving those that views may point to
+	if (m_format != HISTORY_FORMAT_BASH) {
+		m_arena.reserve(m_arena.size() + HISTORY_ARENA_RESERVE_BYTES);
+	}
+
+	dedupLines(cachedLines, m_scanEndLines);
+	if (!cacheValid) {
+		m_index.merge();
+		saveCache(m_distinct.data(), m_distinct.size(), m_lineSet, m_index.base());
+	} else if (m_scanEnd != cachedEnd) {
+		// Rewriting the whole cache costs as much as loading it cold, so
+		// appended lines are saved on their own until there are plenty
+		if ((m_scanEndLines - m_baseLines) * HISTORY_CACHE_DELTA_FRACTION > m_baseLines) {
+			startCompaction();
+		} else {
+			saveDelta();
+		}
+	}
+
+	// The unterminated last line is indexed but never cached
+	dedupLines(m_scanEndLines, size());
+	m_scanEndHash = scanEndHash();
+	return true;
+}
+
+HistoryAppendResult HistoryFile::append(std::vector<uint32_t>* removed)
+{
+	TRACE_SCOPE("HistoryFile::append");
+	finishCompaction();
+
+	// Shells rewrite the file to truncate it, sometimes as a new file
+	struct stat current;
+	if (m_fd < 0 || stat(m_filename.c_str(), &current) != 0 ||
+		current.st_dev != m_stat.st_dev || current.st_ino != m_stat.st_ino) {
+		return HISTORY_APPEND_REOPEN;
+	}
+	size_t newSize = static_cast<size_t>(current.st_size);
+	if (newSize < m_dataSize) {
+		detach();
+		return HISTORY_APPEND_REOPEN;
+	}
+	if (newSize > m_mapSize || scanEndHash() != m_scanEndHash) {
+		return HISTORY_APPEND_REOPEN;
+	}
+	if (newSize == m_dataSize) {
+		m_stat = current;
+		return HISTORY_APPEND_NONE;
+	}
+
+	// Wait for the rest of a line that is still being written, which would
+	// otherwise be added unfinished and then fail to match itself
+	if (m_data[newSize - 1] != '\n') {
+		return HISTORY_APPEND_NONE;
+	}
+
+	// Decoding never lengthens an entry, so this bounds the arena's growth
+	if (m_format != HISTORY_FORMAT_BASH && m_arena.capacity() - m_arena.size() < newSize - m_scanEnd) {
+		return HISTORY_APPEND_REOPEN;
+	}
+
+	// Lines after the scan end are scanned again with the new bytes. They
+	// must come out the same, as they are already deduplicated and
+	// indexed. An unterminated line that has since grown does not.
+	struct Entry {
+		uint64_t offset;
+		uint32_t length;
+		uint64_t hash;
+		uint64_t charMask;
+		uint64_t time;
+	};
+	size_t oldLines = size();
+	size_t oldScanEnd = m_scanEnd;
+	size_t oldScanEndLines = m_scanEndLines;
+	size_t oldScanEndArena = m_scanEndArena;
+	size_t oldDataSize = m_dataSize;
+	std::vector<Entry> tail;
+	for (size_t i = m_scanEndLines; i < oldLines; ++i) {
+		tail.push_back({m_offsets[i], m_lengths[i], m_hashes[i], m_charMasks[i], m_times[i]});
+	}
+	std::string tailArena(m_arena.data() + m_scanEndArena, m_arena.size() - m_scanEndArena);
+	auto truncate = [this](size_t lines, size_t arenaSize) {
+		m_offsets.resize(lines);
+		m_lengths.resize(lines);
+		m_hashes.resize(lines);
+		m_charMasks.resize(lines);
+		m_times.resize(lines);
+		m_arena.resize(arenaSize);
+	};
+	truncate(m_scanEndLines, m_scanEndArena);
+	m_dataSize = newSize;
+	scanLines(m_scanEnd, m_dataSize);
+
+	bool same = size() >= oldLines;
+	for (size_t i = 0; same && i < tail.size(); ++i) {
+		size_t index = oldScanEndLines + i;
+		same = m_offsets[index] == tail[i].offset && m_lengths[index] == tail[i].length && m_times[index] == tail[i].time;
+	}
+	if (!same) {
+		truncate(oldScanEndLines, oldScanEndArena);
+		for (const Entry& entry : tail) {
+			m_offsets.push_back(entry.offset);
+			m_lengths.push_back(entry.length);
+			m_hashes.push_back(entry.hash);
+			m_charMasks.push_back(entry.charMask);
+			m_times.push_back(entry.time);
+		}
+		m_arena.resize(oldScanEndArena + tailArena.size());
+		memcpy(m_arena.mutableData() + oldScanEndArena, tailArena.data(), tailArena.size());
+		m_scanEnd = oldScanEnd;
+		m_scanEndLines = oldScanEndLines;
+		m_scanEndArena = oldScanEndArena;
+		m_dataSize = oldDataSize;
+		return HISTORY_APPEND_REOPEN;
+	}
+
+	m_stat = current;
+	m_scanEndHash = scanEndHash();
+	dedupLines(oldLines, size(), removed);
+	return size() > oldLines ? HISTORY_APPEND_LINES : HISTORY_APPEND_NONE;
+}
+
+bool HistoryFile::changed() const
+{
+	struct stat current;
+	return m_fd < 0 || stat(m_filename.c_str(), &current) != 0 ||
+		current.st_dev != m_stat.st_dev || current.st_ino != m_stat.st_ino || current.st_size != m_stat.st_size ||
+		current.st_mtim.tv_sec != m_stat.st_mtim.tv_sec || current.st_mtim.tv_nsec != m_stat.st_mtim.tv_nsec;
+}
+
+uint64_t HistoryFile::scanEndHash() const
+{
+	size_t tailSize = std::min<size_t>(m_scanEnd, HISTORY_CACHE_TAIL_BYTES);
+	return hashBytes(m_data + m_scanEnd - tailSize, tailSize);
+}
+
+void HistoryFile::detach()
+{
+	// Reading a page past the end of a file raises SIGBUS, so results
+	// still viewing lines there would crash whoever draws them. Zeros take
+	// the mapping's place at the same address instead. Failing leaves it
+	// as it was.
+	if (m_data) {
+		mmap(const_cast<char*>(m_data), m_mapSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	}
+}
+
+void HistoryFile::close()
+{
+	finishCompaction();
+	m_cache.close();
+	m_deltaCache.close();
+	if (m_data) {
+		munmap(const_cast<char*>(m_data), m_mapSize);
+	}
+	if (m_fd >= 0) {
+		::close(m_fd);
+	}
+	m_fd = -1;
+	m_filename.clear();
+	m_data = nullptr;
+	m_dataSize = 0;
+	m_mapSize = 0;
+	m_scanEndHash = 0;
+	m_format = HISTORY_FORMAT_BASH;
+	m_scanEnd = 0;
+	m_scanEndLines = 0;
+	m_scanEndArena = 0;
+	m_offsets.clear();
+	m_lengths.clear();
+	m_hashes.clear();
+	m_charMasks.clear();
+	m_times.clear();
+	m_arena.clear();
+	m_lineSet.clear();
+	m_distinct.clear();
+	m_index.clear();
+	m_cachePath.clear();
+	m_deltaPath.clear();
+	m_baseSize = 0;
+	m_baseTailHash = 0;
+	m_baseLines = 0;
+	m_baseArena = 0;
+	m_deltaLinesPending = false;
+}
+
+bool HistoryFile::loadCache()
+{
+	TRACE_SCOPE("HistoryFile::loadCache");
+	if (m_cachePath.empty() || !m_cache.open(m_cachePath)) {
+		return false;
+	}
+
+	const HistoryCacheHeader* header = m_cache.header();
+	const uint64_t* offsets;
+	const uint32_t* lengths;
+	const uint64_t* hashes;
+	const uint64_t* charMasks;
+	const uint64_t* times;
+	const char* arena;
+	const uint32_t* distinct;
+	const uint32_t* lineSetSlots;
+	const uint32_t* trigramKeys;
+	const uint64_t* trigramStarts;
+	const uint32_t* trigramLines;
+	size_t offsetCount, lengthCount, hashCount, charMaskCount, timeCount, arenaSize, distinctCount, lineSetSlotCount, trigramKeyCount, trigramStartCount, trigramLineCount;
+	bool valid = header->device == static_cast<uint64_t>(m_stat.st_dev) &&
+		header->inode == static_cast<uint64_t>(m_stat.st_ino) &&
+		header->coveredSize <= m_dataSize &&
+		m_cache.section(CACHE_SECTION_OFFSETS, &offsets, &offsetCount) &&
+		m_cache.section(CACHE_SECTION_LENGTHS, &lengths, &lengthCount) &&
+		m_cache.section(CACHE_SECTION_HASHES, &hashes, &hashCount) &&
+		m_cache.section(CACHE_SECTION_CHAR_MASKS, &charMasks, &charMaskCount) &&
+		m_cache.section(CACHE_SECTION_TIMES, &times, &timeCount) &&
+		m_cache.section(CACHE_SECTION_ARENA, &arena, &arenaSize) &&
+		offsetCount == header->lineCount &&
+		lengthCount == header->lineCount &&
+		hashCount == header->lineCount &&
+		charMaskCount == header->lineCount &&
+		timeCount == header->lineCount &&
+		m_cache.section(CACHE_SECTION_DISTINCT_LINES, &distinct, &distinctCount) &&
+		m_cache.section(CACHE_SECTION_LINE_SET, &lineSetSlots, &lineSetSlotCount) &&
+		distinctCount <= header->lineCount &&
+		(lineSetSlotCount & (lineSetSlotCount - 1)) == 0 &&
+		lineSetSlotCount > distinctCount &&
+		m_cache.section(CACHE_SECTION_TRIGRAM_KEYS, &trigramKeys, &trigramKeyCount) &&
+		m_cache.section(CACHE_SECTION_TRIGRAM_STARTS, &trigramStarts, &trigramStartCount) &&
+		m_cache.section(CACHE_SECTION_TRIGRAM_LINES, &trigramLines, &trigramLineCount);
+
+	// Unless the file is exactly as it was, make sure it has only been
+	// appended to by checking the bytes just before the cached range ends
+	bool unchanged = header->fileSize == static_cast<uint64_t>(m_stat.st_size) &&
+		header->mtimeSec == m_stat.st_mtim.tv_sec &&
+		header->mtimeNsec == m_stat.st_mtim.tv_nsec;
+	if (valid && !unchanged) {
+		size_t tailSize = std::min<size_t>(header->coveredSize, HISTORY_CACHE_TAIL_BYTES);
+		const char* tail = m_data + header->coveredSize - tailSize;
+		valid = hashBytes(tail, tailSize) == header->tailHash;
+	}
+
+	// Lines are read through the cached offsets without further checks, so
+	// a corrupt cache must be caught here
+	valid = valid && linesInBounds(offsets, lengths, header->lineCount, header->coveredSize, arenaSize) &&
+		ascendingIn(distinct, distinctCount, 0, header->lineCount) &&
+		postingsInBounds(trigramKeys, trigramKeyCount, trigramStarts, trigramStartCount, trigramLineCount);
+
+	if (!valid) {
+		m_cache.close();
+		return false;
+	}
+
+	m_offsets.borrow(offsets, offsetCount);
+	m_lengths.borrow(lengths, lengthCount);
+	m_hashes.borrow(hashes, hashCount);
+	m_charMasks.borrow(charMasks, charMaskCount);
+	m_times.borrow(times, timeCount);
+	m_arena.borrow(arena, arenaSize);
+	m_distinct.borrow(distinct, distinctCount);
+	m_lineSet.borrow(lineSetSlots, lineSetSlotCount, distinctCount);
+	m_index.base().keys.borrow(trigramKeys, trigramKeyCount);
+	m_index.base().starts.borrow(trigramStarts, trigramStartCount);
+	m_index.base().lines.borrow(trigramLines, trigramLineCount);
+	m_scanEnd = header->coveredSize;
+	m_scanEndLines = header->lineCount;
+	m_scanEndArena = arenaSize;
+	m_baseSize = header->coveredSize;
+	m_baseTailHash = header->tailHash;
+	m_baseLines = header->lineCount;
+	m_baseArena = arenaSize;
+	return true;
+}
+
+bool HistoryFile::loadDelta()
+{
+	TRACE_SCOPE("HistoryFile::loadDelta");
+	if (m_deltaPath.empty() || !m_deltaCache.open(m_deltaPath)) {
+		return false;
+	}
+
+	// Sections hold only what the delta adds to the full cache
+	const HistoryCacheHeader* header = m_deltaCache.header();
+	const uint64_t* offsets;
+	const uint32_t* lengths;
+	const uint64_t* hashes;
+	const uint64_t* charMasks;
+	const uint64_t* times;
+	const char* arena;
+	const uint32_t* distinct;
+	const uint32_t* removed;
+	const uint32_t* trigramKeys;
+	const uint64_t* trigramStarts;
+	const uint32_t* trigramLines;
+	size_t offsetCount, lengthCount, hashCount, charMaskCount, timeCount, arenaSize, distinctCount, removedCount, trigramKeyCount, trigramStartCount, trigramLineCount;
+	bool valid = header->device == static_cast<uint64_t>(m_stat.st_dev) &&
+		header->inode == static_cast<uint64_t>(m_stat.st_ino) &&
+		header->baseCoveredSize == m_baseSize &&
+		header->baseTailHash == m_baseTailHash &&
+		header->baseLineCount == m_baseLines &&
+		header->coveredSize >= m_baseSize &&
+		header->coveredSize <= m_dataSize &&
+		header->lineCount >= m_baseLines &&
+		m_deltaCache.section(CACHE_SECTION_OFFSETS, &offsets, &offsetCount) &&
+		m_deltaCache.section(CACHE_SECTION_LENGTHS, &lengths, &lengthCount) &&
+		m_deltaCache.section(CACHE_SECTION_HASHES, &hashes, &hashCount) &&
+		m_deltaCache.section(CACHE_SECTION_CHAR_MASKS, &charMasks, &charMaskCount) &&
+		m_deltaCache.section(CACHE_SECTION_TIMES, &times, &timeCount) &&
+		m_deltaCache.section(CACHE_SECTION_ARENA, &arena, &arenaSize) &&
+		offsetCount == header->lineCount - m_baseLines &&
+		lengthCount == offsetCount &&
+		hashCount == offsetCount &&
+		charMaskCount == offsetCount &&
+		timeCount == offsetCount &&
+		m_deltaCache.section(CACHE_SECTION_DISTINCT_LINES, &distinct, &distinctCount) &&
+		m_deltaCache.section(CACHE_SECTION_REMOVED_LINES, &removed, &removedCount) &&
+		m_deltaCache.section(CACHE_SECTION_TRIGRAM_KEYS, &trigramKeys, &trigramKeyCount) &&
+		m_deltaCache.section(CACHE_SECTION_TRIGRAM_STARTS, &trigramStarts, &trigramStartCount) &&
+		m_deltaCache.section(CACHE_SECTION_TRIGRAM_LINES, &trigramLines, &trigramLineCount);
+
+	bool unchanged = header->fileSize == static_cast<uint64_t>(m_stat.st_size) &&
+		header->mtimeSec == m_stat.st_mtim.tv_sec &&
+		header->mtimeNsec == m_stat.st_mtim.tv_nsec;
+	if (valid && !unchanged) {
+		size_t tailSize = std::min<size_t>(header->coveredSize, HISTORY_CACHE_TAIL_BYTES);
+		const char* tail = m_data + header->coveredSize - tailSize;
+		valid = hashBytes(tail, tailSize) == header->tailHash;
+	}
+
+	valid = valid && linesInBounds(offsets, lengths, offsetCount, header->coveredSize, m_baseArena + arenaSize) &&
+		ascendingIn(distinct, distinctCount, m_baseLines, header->lineCount) &&
+		ascendingIn(removed, removedCount, 0, header->lineCount) &&
+		postingsInBounds(trigramKeys, trigramKeyCount, trigramStarts, trigramStartCount, trigramLineCount);
+
+	if (!valid) {
+		m_deltaCache.close();
+		return false;
+	}
+
+	size_t lineCount = header->lineCount;
+	m_offsets.append(offsets, offsetCount);
+	m_lengths.append(lengths, lengthCount);
+	m_hashes.append(hashes, hashCount);
+	m_charMasks.append(charMasks, charMaskCount);
+	m_times.append(times, timeCount);
+	m_arena.append(arena, arenaSize);
+
+	// Lines the delta replaced are dropped from the cached distinct list
+	// and its lines follow
+	m_distinct.reserve(m_distinct.size() + distinctCount);
+	uint32_t* lines = m_distinct.mutableData();
+	size_t kept = 0;
+	const uint32_t* next = removed;
+	const uint32_t* removedEnd = removed + removedCount;
+	for (size_t i = 0; i < m_distinct.size(); ++i) {
+		next = std::lower_bound(next, removedEnd, lines[i]);
+		if (next == removedEnd || *next != lines[i]) {
+			lines[kept++] = lines[i];
+		}
+	}
+	m_distinct.resize(kept);
+	m_distinct.append(distinct, distinctCount);
+	m_index.removed().assign(removed, removedEnd);
+	m_deltaLinesPending = true;
+
+	m_index.delta().keys.borrow(trigramKeys, trigramKeyCount);
+	m_index.delta().starts.borrow(trigramStarts, trigramStartCount);
+	m_index.delta().lines.borrow(trigramLines, trigramLineCount);
+	m_scanEnd = header->coveredSize;
+	m_scanEndLines = lineCount;
+	m_scanEndArena = m_baseArena + arenaSize;
+	return true;
+}
+
+HistoryCacheHeader HistoryFile::cacheHeader() const
+{
+	HistoryCacheHeader header = {};
+	header.device = m_stat.st_dev;
+	header.inode = m_stat.st_ino;
+	header.fileSize = m_stat.st_size;
+	header.mtimeSec = m_stat.st_mtim.tv_sec;
+	header.mtimeNsec = m_stat.st_mtim.tv_nsec;
+	header.coveredSize = m_scanEnd;
+	size_t tailSize = std::min<size_t>(m_scanEnd, HISTORY_CACHE_TAIL_BYTES);
+	header.tailHash = hashBytes(m_data + m_scanEnd - tailSize, tailSize);
+	header.lineCount = m_scanEndLines;
+	return header;
+}
+
+void HistoryFile::saveCache(const uint32_t* distinct, size_t distinctCount, const LineSet& lineSet, const TrigramPostings& trigrams)
+{
+	TRACE_SCOPE("HistoryFile::saveCache");
+	if (m_cachePath.empty()) {
+		return;
+	}
+
+	// Only complete entries are cached. One that may still be growing is
+	// rescanned next time. Lines borrowed from an older cache are copied
+	// to join the rest.
+	auto joined = [this](const auto& array, auto& copy) {
+		if (array.borrowedSize()) {
+			copy.assign(array.borrowedData(), array.borrowedData() + array.borrowedSize());
+			copy.insert(copy.end(), array.ownedData(), array.ownedData() + (m_scanEndLines - array.borrowedSize()));
+			return static_cast<const void*>(copy.data());
+		}
+		return static_cast<const void*>(array.ownedData());
+	};
+	std::vector<uint64_t> offsets, hashes, charMasks, times;
+	std::vector<uint32_t> lengths;
+	std::vector<HistoryCache::Section> sections = {
+		{CACHE_SECTION_OFFSETS, sizeof(uint64_t), joined(m_offsets, offsets), m_scanEndLines},
+		{CACHE_SECTION_LENGTHS, sizeof(uint32_t), joined(m_lengths, lengths), m_scanEndLines},
+		{CACHE_SECTION_HASHES, sizeof(uint64_t), joined(m_hashes, hashes), m_scanEndLines},
+		{CACHE_SECTION_CHAR_MASKS, sizeof(uint64_t), joined(m_charMasks, charMasks), m_scanEndLines},
+		{CACHE_SECTION_TIMES, sizeof(uint64_t), joined(m_times, times), m_scanEndLines},
+		{CACHE_SECTION_ARENA, sizeof(char), m_arena.data(), m_scanEndArena},
+		{CACHE_SECTION_DISTINCT_LINES, sizeof(uint32_t), distinct, distinctCount},
+		{CACHE_SECTION_LINE_SET, sizeof(uint32_t), lineSet.slots().data(), lineSet.slots().size()},
+		{CACHE_SECTION_TRIGRAM_KEYS, sizeof(uint32_t), trigrams.keys.data(), trigrams.keys.size()},
+		{CACHE_SECTION_TRIGRAM_STARTS, sizeof(uint64_t), trigrams.starts.data(), trigrams.starts.size()},
+		{CACHE_SECTION_TRIGRAM_LINES, sizeof(uint32_t), trigrams.lines.data(), trigrams.lines.size()},
+	};
+
+	// Failing to write the cache only costs speed next time. Once it's
+	// written, any delta segment applies to the one it replaced.
+	if (HistoryCache::write(m_cachePath, cacheHeader(), sections)) {
+		unlink(m_deltaPath.c_str());
+	}
+}
+
+void HistoryFile::saveDelta()
+{
+	TRACE_SCOPE("HistoryFile::saveDelta");
+	if (m_deltaPath.empty()) {
+		return;
+	}
+
+	HistoryCacheHeader header = cacheHeader();
+	header.baseCoveredSize = m_baseSize;
+	header.baseTailHash = m_baseTailHash;
+	header.baseLineCount = m_baseLines;
+
+	// Distinct lines from the full cache are all before any in the delta
+	const uint32_t* distinctEnd = m_distinct.data() + m_distinct.size();
+	const uint32_t* distinct = std::lower_bound(m_distinct.data(), distinctEnd, static_cast<uint32_t>(m_baseLines));
+	const TrigramPostings& trigrams = m_index.delta();
+	const std::vector<uint32_t>& removed = m_index.removed();
+	// The full cache's lines are the borrowed part of the line table
+	size_t lines = m_scanEndLines - m_baseLines;
+	std::vector<HistoryCache::Section> sections = {
+		{CACHE_SECTION_OFFSETS, sizeof(uint64_t), m_offsets.ownedData(), lines},
+		{CACHE_SECTION_LENGTHS, sizeof(uint32_t), m_lengths.ownedData(), lines},
+		{CACHE_SECTION_HASHES, sizeof(uint64_t), m_hashes.ownedData(), lines},
+		{CACHE_SECTION_CHAR_MASKS, sizeof(uint64_t), m_charMasks.ownedData(), lines},
+		{CACHE_SECTION_TIMES, sizeof(uint64_t), m_times.ownedData(), lines},
+		{CACHE_SECTION_ARENA, sizeof(char), m_arena.data() + m_baseArena, m_scanEndArena - m_baseArena},
+		{CACHE_SECTION_DISTINCT_LINES, sizeof(uint32_t), distinct, static_cast<size_t>(distinctEnd - distinct)},
+		{CACHE_SECTION_REMOVED_LINES, sizeof(uint32_t), removed.data(), removed.size()},
+		{CACHE_SECTION_TRIGRAM_KEYS, sizeof(uint32_t), trigrams.keys.data(), trigrams.keys.size()},
+		{CACHE_SECTION_TRIGRAM_STARTS, sizeof(uint64_t), trigrams.starts.data(), trigrams.starts.size()},
+		{CACHE_SECTION_TRIGRAM_LINES, sizeof(uint32_t), trigrams.lines.data(), trigrams.lines.size()},
+	};
+	HistoryCache::write(m_deltaPath, header, sections);
+}
+
+void HistoryFile::startCompaction()
+{
+	// What the cache holds may change once open() dedups the unterminated
+	// last line, so it is copied now. The base postings never change.
+	std::vector<uint32_t> distinct(m_distinct.data(), m_distinct.data() + m_distinct.size());
+	TrigramIndex index;
+	const TrigramPostings& base = m_index.base();
+	const TrigramPostings& delta = m_index.delta();
+	index.base().keys.borrow(base.keys.data(), base.keys.size());
+	index.base().starts.borrow(base.starts.data(), base.starts.size());
+	index.base().lines.borrow(base.lines.data(), base.lines.size());
+	index.delta().keys.append(delta.keys.data(), delta.keys.size());
+	index.delta().starts.append(delta.starts.data(), delta.starts.size());
+	index.delta().lines.append(delta.lines.data(), delta.lines.size());
+	index.removed() = m_index.removed();
+
+	m_compaction = std::thread([this, distinct = std::move(distinct), index = std::move(index)]() mutable {
+		traceThreadName("cache compaction");
+		index.merge();
+
+		// The lines are already distinct, so none replaces another
+		LineSet lineSet;
+		lineSet.reserve(*this, distinct.size());
+		for (uint32_t line : distinct) {
+			lineSet.insert(*this, line);
+		}
+		saveCache(distinct.data(), distinct.size(), lineSet, index.base());
+	});
+}
+
+void HistoryFile::finishCompaction()
+{
+	if (m_compaction.joinable()) {
+		m_compaction.join();
+	}
+}
+
+HistoryFormat HistoryFile::detectFormat(const std::string& filename) const
+{
+	// Blank lines don't tell the formats apart
+	size_t pos = 0;
+	while (pos < m_dataSize && m_data[pos] == '\n') {
+		++pos;
+	}
+	const char* first = m_data + pos;
+	const char* end = m_data + m_dataSize;
+	uint64_t time;
+	if (startsWith(std::string_view(first, end - first), "- cmd:")) {
+		return HISTORY_FORMAT_FISH;
+	}
+	if (parseZshHeader(first, end, &time) != first) {
+		return HISTORY_FORMAT_ZSH;
+	}
+
+	// Without extended history, zsh writes plain lines like bash but may
+	// still escape newlines and metafy bytes
+	size_t slash = filename.rfind('/');
+	std::string name = filename.substr(slash == std::string::npos ? 0 : slash + 1);
+	if (name.find("zsh") != std::string::npos || name.find("zhistory") != std::string::npos) {
+		return HISTORY_FORMAT_ZSH;
+	}
+	if (name.find("fish") != std::string::npos) {
+		return HISTORY_FORMAT_FISH;
+	}
+	return HISTORY_FORMAT_BASH;
+}
+
+void HistoryFile::setScanEnd(size_t pos)
+{
+	m_scanEnd = pos;
+	m_scanEndLines = size();
+	m_scanEndArena = m_arena.size();
+}
+
+void HistoryFile::scanLines(size_t begin, size_t end)
+{
+	TRACE_SCOPE("HistoryFile::scanLines");
+	switch (m_format) {
+	case HISTORY_FORMAT_ZSH:
+		scanZsh(begin, end);
+		return;
+	case HISTORY_FORMAT_FISH:
+		scanFish(begin, end);
+		return;
+	case HISTORY_FORMAT_BASH:
+		break;
+	}
+
+	size_t lineStart = begin;
+	size_t pos = begin;
+	m_pendingTime = 0;
+	m_pendingTimeStart = NO_POSITION;
+
+#if defined(__SSE2__)
+	// Compare 16 bytes at a time and walk the bits of the resulting mask, so
+	// the cost is per block rather than per byte or per memchr() call.
+	const __m128i newline = _mm_set1_epi8('\n');
+	for (; pos + 16 <= end; pos += 16) {
+		__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(m_data + pos));
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+		while (mask) {
+			size_t lineEnd = pos + __builtin_ctz(mask);
+			addBashLine(lineStart, lineEnd);
+			lineStart = lineEnd + 1;
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; pos < end; ++pos) {
+		if (m_data[pos] == '\n') {
+			addBashLine(lineStart, pos);
+			lineStart = pos + 1;
+		}
+	}
+
+	// A timestamp belongs to the command after it, so a trailing one is
+	// rescanned along with that command once it is written
+	setScanEnd(m_pendingTimeStart != NO_POSITION ? m_pendingTimeStart : lineStart);
+
+	// The last line may not be terminated
+	if (lineStart < end) {
+		addBashLine(lineStart, end);
+	}
+}
+
+void HistoryFile::scanZsh(size_t begin, size_t end)
+{
+	size_t pos = begin;
+	while (pos < end) {
+		// An entry ends at the first newline not escaped with a backslash
+		size_t entryEnd = pos;
+		bool continued = false;
+		const char* newline;
+		while ((newline = static_cast<const char*>(memchr(m_data + entryEnd, '\n', end - entryEnd)))) {
+			entryEnd = newline - m_data;
+			if (entryEnd == pos || m_data[entryEnd - 1] != '\\') {
+				break;
+			}
+			continued = true;
+			++entryEnd;
+		}
+
+		// The last entry may not be terminated
+		if (!newline) {
+			setScanEnd(pos);
+			addZshEntry(pos, end, continued);
+			return;
+		}
+		addZshEntry(pos, entryEnd, continued);
+		pos = entryEnd + 1;
+	}
+	setScanEnd(pos);
+}
+
+void HistoryFile::scanFish(size_t begin, size_t end)
+{
+	// A record runs from its "- cmd:" line to the next one. Until then its
+	// fields may still be being written, so the last record is always
+	// rescanned, as is any unterminated line before the first.
+	size_t record = NO_POSITION;
+	size_t command = 0;
+	size_t commandEnd = 0;
+	uint64_t time = 0;
+	size_t scanEnd = end;
+	for (size_t pos = begin; pos < end;) {
+		const char* newline = static_cast<const char*>(memchr(m_data + pos, '\n', end - pos));
+		size_t lineEnd = newline ? newline - m_data : end;
+		if (!newline) {
+			scanEnd = pos;
+		}
+
+		std::string_view text(m_data + pos, lineEnd - pos);
+		if (startsWith(text, "- cmd:")) {
+			if (record != NO_POSITION) {
+				addFishEntry(command, commandEnd, time);
+			}
+			record = pos;
+			command = pos + 6 + startsWith(text, "- cmd: ");
+			commandEnd = lineEnd;
+			time = 0;
+		} else if (record != NO_POSITION && startsWith(text, "  when:")) {
+			const char* value = text.data() + 7;
+			while (value < m_data + lineEnd && *value == ' ') {
+				++value;
+			}
+			if (!parseNumber(value, m_data + lineEnd, &time)) {
+				time = 0;
+			}
+		}
+		pos = lineEnd + 1;
+	}
+
+	if (record == NO_POSITION) {
+		setScanEnd(scanEnd);
+		return;
+	}
+	setScanEnd(record);
+	addFishEntry(command, commandEnd, time);
+}
+
+void HistoryFile::addBashLine(size_t begin, size_t end)
+{
+	// Skip blank lines, like read_history()
+	if (begin == end) {
+		return;
+	}
+
+	// bash writes "#<seconds>" before each command when HISTTIMEFORMAT is set
+	if (m_data[begin] == '#' && end - begin > 1 && isdigit(static_cast<unsigned char>(m_data[begin + 1]))) {
+		parseNumber(m_data + begin + 1, m_data + end, &m_pendingTime);
+		m_pendingTimeStart = begin;
+		return;
+	}
+
+	addEntry(begin, end - begin, m_pendingTime);
+	m_pendingTime = 0;
+	m_pendingTimeStart = NO_POSITION;
+}
+
+void HistoryFile::addZshEntry(size_t begin, size_t end, bool continued)
+{
+	uint64_t time = 0;
+	const char* entryEnd = m_data + end;
+	const char* command = parseZshHeader(m_data + begin, entryEnd, &time);
+	if (command == entryEnd) {
+		return;
+	}
+
+	// Most entries are used in place and only the rest are decoded
+	size_t commandBegin = command - m_data;
+	if (!continued && !memchr(command, ZSH_META, end - commandBegin)) {
+		addEntry(commandBegin, end - commandBegin, time);
+		return;
+	}
+	m_decoded.clear();
+	for (const char* c = command; c < entryEnd; ++c) {
+		if (*c == '\\' && c + 1 < entryEnd && c[1] == '\n') {
+			m_decoded += '\n';
+			++c;
+		} else if (static_cast<unsigned char>(*c) == ZSH_META && c + 1 < entryEnd) {
+			m_decoded += static_cast<char>(c[1] ^ 32);
+			++c;
+		} else {
+			m_decoded += *c;
+		}
+	}
+	addDecoded(time);
+}
+
+void HistoryFile::addFishEntry(size_t begin, size_t end, uint64_t time)
+{
+	if (begin >= end) {
+		return;
+	}
+	if (!memchr(m_data + begin, '\\', end - begin)) {
+		addEntry(begin, end - begin, time);
+		return;
+	}
+
+	// fish escapes only newlines and backslashes
+	const char* entryEnd = m_data + end;
+	m_decoded.clear();
+	for (const char* c = m_data + begin; c < entryEnd; ++c) {
+		if (*c == '\\' && c + 1 < entryEnd && (c[1] == 'n' || c[1] == '\\')) {
+			m_decoded += c[1] == 'n' ? '\n' : '\\';
+			++c;
+		} else {
+			m_decoded += *c;
+		}
+	}
+	addDecoded(time);
+}
+
+void HistoryFile::addEntry(uint64_t offset, size_t length, uint64_t time)
+{
+	const char* data = offset & HISTORY_ARENA_OFFSET ? m_arena.data() + (offset & ~HISTORY_ARENA_OFFSET) : m_data + offset;
+	length = std::min<size_t>(length, std::numeric_limits<uint32_t>::max());
+	m_offsets.push_back(offset);
+	m_lengths.push_back(static_cast<uint32_t>(length));
+	m_hashes.push_back(hashBytes(data, length));
+	m_charMasks.push_back(fuzzyCharMask(std::string_view(data, length)));
+	m_times.push_back(time);
+}
+
+void HistoryFile::addDecoded(uint64_t time)
+{
+	size_t offset = m_arena.size();
+	m_arena.resize(offset + m_decoded.size());
+	memcpy(m_arena.mutableData() + offset, m_decoded.data(), m_decoded.size());
+	addEntry(HISTORY_ARENA_OFFSET | offset, m_decoded.size(), time);
+}
+
+void HistoryFile::insertDeltaLines()
+{
+	TRACE_SCOPE("HistoryFile::insertDeltaLines");
+	// Each replaces the line it replaced when it was first added
+	const uint32_t* end = m_distinct.data() + m_distinct.size();
+	const uint32_t* begin = std::lower_bound(m_distinct.data(), end, static_cast<uint32_t>(m_baseLines));
+	m_lineSet.reserve(*this, end - begin);
+	for (const uint32_t* line = begin; line != end; ++line) {
+		m_lineSet.insert(*this, *line);
+	}
+	m_deltaLinesPending = false;
+}
+
+void HistoryFile::dedupLines(size_t begin, size_t end, std::vector<uint32_t>* removedLines)
+{
+	TRACE_SCOPE("HistoryFile::dedupLines");
+	if (begin >= end) {
+		return;
+	}
+	if (m_deltaLinesPending) {
+		insertDeltaLines();
+	}
+	m_lineSet.reserve(*this, end - begin);
+
+	// A line replaces any earlier line with the same text, whether that is
+	// in this range or already in the distinct list
+	std::vector<uint8_t> replaced(end - begin);
+	std::vector<uint32_t> removed;
+	for (size_t i = begin; i < end; ++i) {
+		uint32_t older = m_lineSet.insert(*this, static_cast<uint32_t>(i));
+		if (older == LineSet::NONE) {
+			continue;
+		}
+		if (older >= begin) {
+			replaced[older - begin] = 1;
+		} else {
+			removed.push_back(older);
+		}
+	}
+
+	// Removed lines are found by binary search, and the runs between them
+	// moved down, so removing a few is cheap however long the list
+	if (removed.size()) {
+		std::sort(removed.begin(), removed.end());
+		uint32_t* distinct = m_distinct.mutableData();
+		uint32_t* distinctEnd = distinct + m_distinct.size();
+		uint32_t* out = std::lower_bound(distinct, distinctEnd, removed[0]);
+		uint32_t* in = out;
+		for (size_t i = 0; i < removed.size(); ++i) {
+			uint32_t* next = i + 1 < removed.size() ? std::lower_bound(in + 1, distinctEnd, removed[i + 1]) : distinctEnd;
+			memmove(out, in + 1, (next - in - 1) * sizeof(uint32_t));
+			out += next - in - 1;
+			in = next;
+		}
+		m_distinct.resize(out - distinct);
+		m_index.remove(removed);
+		if (removedLines) {
+			removedLines->insert(removedLines->end(), removed.begin(), removed.end());
+		}
+	}
+	if (m_distinct.capacity() < m_distinct.size() + end - begin) {
+		m_distinct.reserve(std::max(m_distinct.size() + end - begin, 2 * m_distinct.size()));
+	}
+
+	size_t added = m_distinct.size();
+	for (size_t i = begin; i < end; ++i) {
+		if (!replaced[i - begin]) {
+			m_distinct.push_back(static_cast<uint32_t>(i));
+		}
+	}
+	m_index.add(*this, m_distinct.data() + added, m_distinct.size() - added);
+}
@@ -0,0 +1,200 @@
+#pragma once
+#include "historycache.h"
+#include "lineset.h"
+#include "mappedarray.h"
+#include "trigramindex.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Offsets with this bit set point into the arena of decoded entries rather
+// than the mapped file
+#define HISTORY_ARENA_OFFSET (uint64_t(1) << 63)
+
+// Address space mapped past the end of the history file, so lines appended
+// while it is open appear in the existing mapping, which never moves. At
+// least this much, or the file's size if larger.
+#define HISTORY_MAP_RESERVE_BYTES (size_t(256) << 20)
+
+// Room left in the arena when it is opened, for decoding appended entries
+// without moving the others
+#define HISTORY_ARENA_RESERVE_BYTES (size_t(1) << 20)
+
+enum HistoryAppendResult {
+	// The file is as it was
+	HISTORY_APPEND_NONE,
+	// Lines were appended and added
+	HISTORY_APPEND_LINES,
+	// The file was replaced, rewritten or grew too much to add lines
+	// without moving existing ones. Only opening it again shows changes.
+	// A file that shrank reads as zeros until then, as pages past its new
+	// end can't be read.
+	HISTORY_APPEND_REOPEN,
+};
+
+enum HistoryFormat {
+	// A command per line, each optionally preceded by a "#<seconds>" line
+	HISTORY_FORMAT_BASH,
+	// ": <seconds>:<duration>;command" or plain lines. Newlines in commands
+	// are escaped with a backslash and some bytes are metafied.
+	HISTORY_FORMAT_ZSH,
+	// "- cmd: command" records followed by indented "when: <seconds>" and
+	// "paths:" fields. Newlines and backslashes in commands are escaped.
+	HISTORY_FORMAT_FISH,
+};
+
+// A shell history file mapped into memory. Lines are stored as offsets into
+// the mapping, so loading never allocates or copies per line. Lines are
+// ordered oldest first, as they appear in the file. Each line is a whole
+// history entry, so one written over several lines of the file is a single
+// line here. Entries that had to be decoded, such as multi-line zsh and fish
+// commands, are copied once into an arena instead.
+//
+// Lines appended to the file later are added by append(). The text of
+// existing lines never moves, so views of it stay valid while the line
+// table grows, but the table itself may be reallocated.
+//
+// The line table, its deduplication and a TrigramIndex of it are persisted
+// in a HistoryCache. When the history file is unchanged they are used
+// straight from the cache mapping, and when it has only been appended to
+// just the new bytes are scanned. What they add is saved in a delta segment
+// beside the cache, and the cache is only rewritten, on another thread,
+// once the delta has grown to a fraction of it.
+class HistoryFile {
+public:
+	HistoryFile() = default;
+	~HistoryFile();
+	HistoryFile(const HistoryFile&) = delete;
+	HistoryFile& operator=(const HistoryFile&) = delete;
+
+	// Maps the file and builds the line table. The format is detected from
+	// the contents, or the filename when they are ambiguous. Returns false
+	// and sets errno on failure. A missing or stale cache is not an error.
+	bool open(const std::string& filename);
+	void close();
+
+	// Adds lines appended to the file since it was opened or last appended
+	// to, scanning only the new bytes. Older lines that appended ones
+	// replace are removed from distinct() and the index, and their indices
+	// are appended to removed in ascending order.
+	HistoryAppendResult append(std::vector<uint32_t>* removed);
+
+	// True if the file's stat differs from when it was opened or appended to
+	bool changed() const;
+
+	const std::string& filename() const { return m_filename; }
+
+	HistoryFormat format() const { return m_format; }
+
+	size_t size() const { return m_lengths.size(); }
+
+	std::string_view line(size_t index) const
+	{
+		uint64_t offset = m_offsets[index];
+		const char* data = offset & HISTORY_ARENA_OFFSET ? m_arena.data() + (offset & ~HISTORY_ARENA_OFFSET) : m_data + offset;
+		return std::string_view(data, m_lengths[index]);
+	}
+
+	// When the entry was run in seconds since the epoch, or 0 if the file
+	// doesn't say
+	uint64_t time(size_t index) const { return m_times[index]; }
+
+	// hashBytes() of the line, for deduplication
+	uint64_t hash(size_t index) const { return m_hashes[index]; }
+
+	// fuzzyCharMask() of the line, to skip lines a fuzzy pattern can't match
+	uint64_t charMask(size_t index) const { return m_charMasks[index]; }
+
+	// Lines that are the most recent occurrence of their text, ascending.
+	// Searches only walk these, so results never need deduplicating.
+	const MappedArray<uint32_t>& distinct() const { return m_distinct; }
+
+	// Built over distinct() lines
+	const TrigramIndex& index() const { return m_index; }
+
+private:
+	bool loadCache();
+	bool loadDelta();
+	HistoryCacheHeader cacheHeader() const;
+	void saveCache(const uint32_t* distinct, size_t distinctCount, const LineSet& lineSet, const TrigramPostings& trigrams);
+	void saveDelta();
+	void startCompaction();
+	void finishCompaction();
+	void insertDeltaLines();
+	HistoryFormat detectFormat(const std::string& filename) const;
+	void setScanEnd(size_t pos);
+	void scanLines(size_t begin, size_t end);
+	void scanZsh(size_t begin, size_t end);
+	void scanFish(size_t begin, size_t end);
+	void addBashLine(size_t begin, size_t end);
+	void addZshEntry(size_t begin, size_t end, bool continued);
+	void addFishEntry(size_t begin, size_t end, uint64_t time);
+	void addEntry(uint64_t offset, size_t length, uint64_t time);
+	void addDecoded(uint64_t time);
+	void dedupLines(size_t begin, size_t end, std::vector<uint32_t>* removed = nullptr);
+	uint64_t scanEndHash() const;
+	void detach();
+
+	int m_fd = -1;
+	struct stat m_stat = {};
+	std::string m_filename;
+	const char* m_data = nullptr;
+	size_t m_dataSize = 0;
+	size_t m_mapSize = 0;
+	HistoryFormat m_format = HISTORY_FORMAT_BASH;
+
+	// Where scanning stopped: the start of the first entry that may not be
+	// complete, and the number of lines and arena bytes before it. Anything
+	// after is rescanned each time, e.g. an unterminated final line, the
+	// last fish record or a bash timestamp with no command yet.
+	size_t m_scanEnd = 0;
+	size_t m_scanEndLines = 0;
+	size_t m_scanEndArena = 0;
+
+	// scanEndHash() when scanning stopped, to check the file was only
+	// appended to since
+	uint64_t m_scanEndHash = 0;
+
+	// Bash timestamp for the next command, and where its line started
+	uint64_t m_pendingTime = 0;
+	size_t m_pendingTimeStart = 0;
+
+	// Scratch space for decoding an entry
+	std::string m_decoded;
+
+	// Lines from the full cache stay borrowed from it
+	SplitArray<uint64_t> m_offsets;
+	SplitArray<uint32_t> m_lengths;
+	SplitArray<uint64_t> m_hashes;
+	SplitArray<uint64_t> m_charMasks;
+	SplitArray<uint64_t> m_times;
+	MappedArray<char> m_arena;
+	LineSet m_lineSet;
+	MappedArray<uint32_t> m_distinct;
+	TrigramIndex m_index;
+
+	std::string m_cachePath;
+	HistoryCache m_cache;
+
+	// The extent of the full cache, which a delta segment adds to
+	uint64_t m_baseSize = 0;
+	uint64_t m_baseTailHash = 0;
+	size_t m_baseLines = 0;
+	size_t m_baseArena = 0;
+
+	std::string m_deltaPath;
+	HistoryCache m_deltaCache;
+
+	// Distinct lines from the delta segment are only added to m_lineSet
+	// before the next lines are deduplicated, so starting without new
+	// lines never copies it
+	bool m_deltaLinesPending = false;
+
+	// Writes a full cache from a snapshot of the lines up to the scan end.
+	// The line table is only appended to, and append() waits for it first.
+	std::thread m_compaction;
+};
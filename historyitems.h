@@ -0,0 +1,171 @@
+#pragma once
+#include "historyfile.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct LineRange {
+	uint32_t start, size;
+};
+
+// One result, as a view into a HistoryItems and the history file
+struct HistoryItem {
+	// Points directly into the mapped history file or its arena, or into
+	// the list for one without a file. Not null terminated.
+	std::string_view line;
+	uint32_t index;
+
+	// Encoded matches. Read them with a MatchReader.
+	const uint8_t* matches;
+	size_t matchBytes;
+};
+
+// Results stored struct-of-arrays: the line index of each result, and where
+// its matches start in one byte arena shared by all of them. Clearing keeps
+// capacity, so refilling a list, or copying one over another, doesn't
+// allocate once it has grown.
+//
+// Each match is two varints: the gap since the end of the previous match
+// and the match's size. A typical match on a short line takes two bytes,
+// and lines and match counts are unlimited. A zero size match marks where
+// matching stopped early, and the rest of the line from there still needs
+// searching.
+//
+// Each line is looked up when it is added, so a list can be read while the
+// file's line table grows. A list without a file, such as results received
+// from a daemon, keeps a copy of each line's text in a second arena.
+class HistoryItems {
+public:
+	HistoryItems(const HistoryFile* file = nullptr)
+		: m_file(file)
+	{
+	}
+
+	size_t size() const { return m_indices.size(); }
+	bool empty() const { return m_indices.empty(); }
+	uint32_t index(size_t i) const { return m_indices[i]; }
+
+	HistoryItem operator[](size_t i) const
+	{
+		size_t begin = m_matchStarts[i];
+		size_t end = i + 1 < m_matchStarts.size() ? m_matchStarts[i + 1] : m_matches.size();
+		return {line(i), m_indices[i], m_matches.data() + begin, end - begin};
+	}
+
+	// Appends a result. Its matches follow, in order, with addMatch().
+	void push_back(uint32_t index)
+	{
+		m_indices.push_back(index);
+		m_lines.push_back(m_file->line(index));
+		m_matchStarts.push_back(static_cast<uint32_t>(m_matches.size()));
+		m_lastEnd = 0;
+	}
+
+	// Appends a copy of a result from another list
+	void push_back(const HistoryItem& item)
+	{
+		m_indices.push_back(item.index);
+		m_matchStarts.push_back(static_cast<uint32_t>(m_matches.size()));
+		m_matches.insert(m_matches.end(), item.matches, item.matches + item.matchBytes);
+		m_lastEnd = 0;
+		if (m_file) {
+			m_lines.push_back(item.line);
+		} else {
+			m_textStarts.push_back(m_text.size());
+			m_text.append(item.line.data(), item.line.size());
+		}
+	}
+
+	void addMatch(LineRange range)
+	{
+		appendVarint(range.start - m_lastEnd);
+		appendVarint(range.size);
+		m_lastEnd = range.start + range.size;
+	}
+
+	// Marks the last result's matches as incomplete from position on
+	void addResume(uint32_t position)
+	{
+		addMatch({position, 0});
+	}
+
+	void clear()
+	{
+		m_indices.clear();
+		m_matchStarts.clear();
+		m_matches.clear();
+		m_lines.clear();
+		m_textStarts.clear();
+		m_text.clear();
+	}
+
+private:
+	std::string_view line(size_t i) const
+	{
+		if (m_file) {
+			return m_lines[i];
+		}
+		size_t end = i + 1 < m_textStarts.size() ? m_textStarts[i + 1] : m_text.size();
+		return std::string_view(m_text.data() + m_textStarts[i], end - m_textStarts[i]);
+	}
+
+	void appendVarint(uint32_t value)
+	{
+		while (value >= 0x80) {
+			m_matches.push_back(static_cast<uint8_t>(value | 0x80));
+			value >>= 7;
+		}
+		m_matches.push_back(static_cast<uint8_t>(value));
+	}
+
+	const HistoryFile* m_file;
+	std::vector<uint32_t> m_indices;
+	std::vector<uint32_t> m_matchStarts;
+	std::vector<uint8_t> m_matches;
+	std::vector<std::string_view> m_lines;
+	std::vector<size_t> m_textStarts;
+	std::string m_text;
+	uint32_t m_lastEnd = 0;
+};
+
+// Decodes a HistoryItem's matches in order
+class MatchReader {
+public:
+	MatchReader(const HistoryItem& item)
+		: m_pos(item.matches)
+		, m_end(item.matches + item.matchBytes)
+	{
+	}
+
+	// Returns false after the last match. A zero size match is a resume
+	// marker, as written by HistoryItems::addResume().
+	bool next(LineRange* range)
+	{
+		if (m_pos == m_end) {
+			return false;
+		}
+		range->start = m_lastEnd + readVarint();
+		range->size = readVarint();
+		m_lastEnd = range->start + range->size;
+		return true;
+	}
+
+private:
+	uint32_t readVarint()
+	{
+		uint32_t value = 0;
+		for (int shift = 0;; shift += 7) {
+			uint8_t byte = *m_pos++;
+			value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) {
+				return value;
+			}
+		}
+	}
+
+	const uint8_t* m_pos;
+	const uint8_t* m_end;
+	uint32_t m_lastEnd = 0;
+};
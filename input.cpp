@@ -5,7 +5,6 @@
 #include "input.h"
 #include <assert.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <unistd.h>
@@ -70,13 +69,17 @@ void readline_begin(const char* initialPattern, int initialCursorPos, redisplay_
 
 	rl_replace_line(initialPattern, 1);
 	rl_forward_char(initialCursorPos, 0);
+
+	// Show the initial pattern without waiting for a key
+	redisplay_proxy();
 }
 
 const char *readline_step(int c)
 {
 	assert(g_input == 0);
 	g_input = c;
-	// NOTE: needs to be called many times without input for esc only bind to work
+	// A 0 after a lone ESC resolves it to the ESC binding, since "\e\0"
+	// isn't bound to anything
 	rl_callback_read_char();
 	assert(g_input == 0);
 	return rl_line_buffer;
@@ -86,36 +89,3 @@ void readline_end()
 {
 	rl_callback_handler_remove();
 }
-
-int getStreamAvailableChars(int inputStreamFD)
-{
-	const useconds_t timeout = 10000;
-
-#if defined (HAVE_SELECT)
-
-	fd_set readfds, exceptfds;
-	struct timeval timeout;
-
-	FD_ZERO (&readfds);
-	FD_ZERO (&exceptfds);
-	FD_SET (tty, &readfds);
-	FD_SET (tty, &exceptfds);
-	timeout.tv_sec = 0;
-	timeout.tv_usec = _keyboard_input_timeout;
-	select(inputStreamFD + 1, &readfds, (fd_set *)NULL, &exceptfds, &timeout);
-	return FD_ISSET(inputStreamFD, &readfds) ? 1 : 0;
-
-#elif defined(FIONREAD)
-
-	int chars_avail = 0;
-	if (ioctl (inputStreamFD, FIONREAD, &chars_avail) == 0) {
-		if (chars_avail == 0) {
-			usleep(timeout);
-		}
-		return (chars_avail);
-	}
-
-#endif
-
-  return 0;
-}
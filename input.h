@@ -7,4 +7,3 @@ int readline_getch();
 void readline_begin(const char* initialPattern, int initialCursorPos,  redisplay_callback redisplay);
 const char *readline_step(int c);
 void readline_end();
-int getStreamAvailableChars(int inputStreamFD);
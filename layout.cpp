@@ -0,0 +1,109 @@
+#include "layout.h"
+#include <algorithm>
+
+namespace {
+
+const size_t ELLIPSIS_SIZE = sizeof(LAYOUT_ELLIPSIS) - 1;
+
+// A collapsed part keeps at least a character either side of the ellipsis
+const size_t MIN_COLLAPSED_SIZE = ELLIPSIS_SIZE + 2;
+
+// Cost of hiding a character of each type. Desirable features:
+// - Show the matches in the string
+// - Show the start of differences between adjacent strings
+// - Show the start of the string
+// - Show the end of the string
+// - Hide long common substrings
+int hideCost(LinePart::Type type)
+{
+	switch (type) {
+	case LinePart::UNIQUE: return 2;
+	case LinePart::START: return 1;
+	case LinePart::END: return 1;
+	case LinePart::MATCH: return 0;
+	case LinePart::COMMON: return 4;
+	}
+	return 0;
+}
+
+}
+
+size_t LinePart::size() const
+{
+	return head.size() + (collapsed ? ELLIPSIS_SIZE + tail.size() : 0);
+}
+
+LineText makeLineFromHistory(const HistoryItem& item, const std::vector<LineRange>& matches)
+{
+	LineText lineText;
+	size_t lastPos = 0;
+	size_t lineLen = item.line.size();
+
+	// TODO: split line into common substrings
+
+	LinePart::Type previousType = LinePart::START;
+	for (const LineRange& match : matches) {
+		// Add bits between lastPos and each match
+		lineText.parts.push_back({item.line.substr(lastPos, match.start - lastPos), {}, false, 0, previousType});
+
+		// Add the matches
+		lineText.parts.push_back({item.line.substr(match.start, match.size), {}, false, 1, LinePart::MATCH});
+		lastPos = match.start + match.size;
+
+		previousType = LinePart::UNIQUE;
+	}
+
+	// Add any remainder
+	if (lastPos < lineLen) {
+		lineText.parts.push_back({item.line.substr(lastPos), {}, false, 0, LinePart::END});
+	}
+
+	lineText.size = lineLen;
+	return lineText;
+}
+
+void fitLine(LineText& line, size_t maxWidth)
+{
+	if (line.size <= maxWidth) {
+		return;
+	}
+
+	// Hiding characters of one part saves the same per character however
+	// many are hidden, so the best fit hides as much as needed of the most
+	// costly parts first. Longer parts go first among equals.
+	std::vector<size_t> order;
+	order.reserve(line.parts.size());
+	for (size_t i = 0; i < line.parts.size(); ++i) {
+		if (hideCost(line.parts[i].type) > 0 && line.parts[i].head.size() > MIN_COLLAPSED_SIZE) {
+			order.push_back(i);
+		}
+	}
+	std::stable_sort(order.begin(), order.end(), [&line](size_t a, size_t b) {
+		int costA = hideCost(line.parts[a].type);
+		int costB = hideCost(line.parts[b].type);
+		if (costA != costB) {
+			return costA > costB;
+		}
+		return line.parts[a].head.size() > line.parts[b].head.size();
+	});
+
+	size_t excess = line.size - maxWidth;
+	for (size_t i : order) {
+		LinePart& part = line.parts[i];
+		size_t size = part.head.size();
+		size_t saving = std::min(excess, size - MIN_COLLAPSED_SIZE);
+
+		// Keep a little more of the start than the end
+		size_t kept = size - saving - ELLIPSIS_SIZE;
+		size_t tailSize = kept / 2;
+		part.tail = part.head.substr(size - tailSize);
+		part.head = part.head.substr(0, kept - tailSize);
+		part.collapsed = true;
+
+		line.size -= saving;
+		excess -= saving;
+		if (!excess) {
+			break;
+		}
+	}
+}
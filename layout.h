@@ -0,0 +1,41 @@
+#pragma once
+#include "historyitems.h"
+#include <stddef.h>
+#include <string_view>
+#include <vector>
+
+// Shown in place of the hidden middle of a collapsed part
+#define LAYOUT_ELLIPSIS "..."
+
+// A run of a history line drawn in one colour. Views point into the mapped
+// history file. A collapsed part shows head, then the ellipsis, then tail.
+struct LinePart {
+	enum Type {
+		UNIQUE,
+		START,
+		END,
+		MATCH,
+		COMMON,
+	};
+
+	std::string_view head;
+	std::string_view tail;
+	bool collapsed;
+	int colour;
+	Type type;
+
+	size_t size() const;
+};
+
+struct LineText {
+	std::vector<LinePart> parts;
+	size_t size;
+};
+
+// Splits a line into plain and matching parts
+LineText makeLineFromHistory(const HistoryItem& item, const std::vector<LineRange>& matches);
+
+// Collapses parts until the line fits in maxWidth, if it can. Parts are
+// collapsed in order of how little they matter, so matches stay visible,
+// and each part is collapsed at most once, in one pass.
+void fitLine(LineText& line, size_t maxWidth);
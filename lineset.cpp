@@ -0,0 +1,74 @@
+#include "lineset.h"
+#include "historyfile.h"
+#include <algorithm>
+#include <vector>
+
+// Smallest table. Tables are kept at most half full so probes stay short.
+static const size_t g_minSlots = 64;
+
+void LineSet::reserve(const HistoryFile& file, size_t count)
+{
+	size_t slotCount = std::max(m_slots.size(), g_minSlots);
+	while (slotCount < 2 * (m_size + count)) {
+		slotCount *= 2;
+	}
+	if (slotCount != m_slots.size()) {
+		rehash(file, slotCount);
+	}
+}
+
+uint32_t LineSet::insert(const HistoryFile& file, uint32_t index)
+{
+	if (2 * (m_size + 1) > m_slots.size()) {
+		reserve(file, 1);
+	}
+
+	uint32_t* slots = m_slots.mutableData();
+	const size_t mask = m_slots.size() - 1;
+	const uint64_t hash = file.hash(index);
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		if (slots[i] == 0) {
+			slots[i] = index + 1;
+			++m_size;
+			return NONE;
+		}
+		uint32_t other = slots[i] - 1;
+		if (file.hash(other) == hash && file.line(other) == file.line(index)) {
+			slots[i] = index + 1;
+			return other;
+		}
+	}
+}
+
+void LineSet::clear()
+{
+	m_slots.clear();
+	m_size = 0;
+}
+
+void LineSet::borrow(const uint32_t* slots, size_t slotCount, size_t size)
+{
+	m_slots.borrow(slots, slotCount);
+	m_size = size;
+}
+
+void LineSet::rehash(const HistoryFile& file, size_t slotCount)
+{
+	std::vector<uint32_t> old(m_slots.data(), m_slots.data() + m_slots.size());
+	m_slots.clear();
+	m_slots.resize(slotCount);
+
+	// Entries are already distinct, so only the hashes are needed
+	uint32_t* slots = m_slots.mutableData();
+	const size_t mask = slotCount - 1;
+	for (uint32_t entry : old) {
+		if (entry == 0) {
+			continue;
+		}
+		size_t i = file.hash(entry - 1) & mask;
+		while (slots[i] != 0) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = entry;
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "mappedarray.h"
+#include <stdint.h>
+#include <stddef.h>
+
+class HistoryFile;
+
+// Open addressing hash set of line indices, hashed and compared by line
+// text, holding the most recent occurrence of each distinct line. Uses the
+// hashes already in the line table, so nothing is copied or allocated per
+// line. Slots hold index + 1 so zero is empty, and can be stored in and
+// used straight from the cache.
+class LineSet {
+public:
+	static const uint32_t NONE = UINT32_MAX;
+
+	// Make room for count more lines without rehashing
+	void reserve(const HistoryFile& file, size_t count);
+
+	// Adds a line, replacing any older occurrence of the same text. Returns
+	// the replaced line, or NONE.
+	uint32_t insert(const HistoryFile& file, uint32_t index);
+
+	void clear();
+	size_t size() const { return m_size; }
+
+	const MappedArray<uint32_t>& slots() const { return m_slots; }
+	void borrow(const uint32_t* slots, size_t slotCount, size_t size);
+
+private:
+	void rehash(const HistoryFile& file, size_t slotCount);
+
+	MappedArray<uint32_t> m_slots;
+	size_t m_size = 0;
+};
@@ -1,10 +1,21 @@
 
+#include "daemon.h"
+#include "daemonclient.h"
+#include "filterworker.h"
 #include "input.h"
 #include "output.h"
+#include "query.h"
 #include "screen.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <iostream>
 #include <string>
 #include <readline/readline.h>
@@ -12,6 +23,10 @@
 #include <signal.h>
 #include <cxxopts.hpp>
 
+// How long a lone ESC waits for the rest of an escape sequence before it
+// counts as the ESC key
+#define ESC_TIMEOUT_MS 25
+
 std::unique_ptr<Screen> gScreen;
 
 enum Action {
@@ -31,12 +46,42 @@ int arrow_up(int a, int b) {gScreen->moveSelection(1, false, false); return 0;}
 int arrow_down(int a, int b) {gScreen->moveSelection(-1, false, false); return 0;}
 int page_up(int a, int b) {gScreen->moveSelection(1, true, false); return 0;}
 int page_down(int a, int b) {gScreen->moveSelection(-1, true, false); return 0;}
+int toggle_mode(int a, int b) {gScreen->toggleMode(); return 0;}
 void pattern_changed(const char* pattern, int cursor) {gScreen->setFilter(pattern, cursor);}
 
+static void armTimer(int timerFd, int milliseconds)
+{
+	struct itimerspec timeout = {};
+	timeout.it_value.tv_sec = milliseconds / 1000;
+	timeout.it_value.tv_nsec = (milliseconds % 1000) * 1000000L;
+	timerfd_settime(timerFd, 0, &timeout, nullptr);
+}
+
+// Bash can't run a command from a bind -x function, so Ctrl-R is a macro
+// that runs the function and then a key it rebinds to accept-line or to
+// nothing, depending on whether the selection should be executed.
+static const char* BASH_BIND_COMMAND = R"BASH(__shist_select() {
+	local output header
+	bind '"\C-x\C-m": redraw-current-line'
+	output=$(READLINE_LINE=$READLINE_LINE READLINE_POINT=$READLINE_POINT shist --output-fd 3 3>&1 1>/dev/tty)
+	[[ -n $output ]] || return
+	header=${output%%$'\n'*}
+	READLINE_LINE=${output#*$'\n'}
+	READLINE_POINT=${header#* }
+	if [[ ${header%% *} == execute ]]; then
+		bind '"\C-x\C-m": accept-line'
+	fi
+}
+bind -x '"\C-x\C-r": __shist_select'
+bind '"\C-r": "\C-x\C-r\C-x\C-m"')BASH";
+
+// Older integration, pushing the selection back through the tty
+static const char* BASH_BIND_COMMAND_IOCSTI = R"BASH(bind -x '"\C-r": READLINE_LINE=$READLINE_LINE READLINE_POINT=$READLINE_POINT shist --iocsti')BASH";
+
 int printBindCommand(std::string shell, bool iocsti)
 {
 	if (shell == "bash") {
-		std::cout << "" << std::endl;
+		std::cout << (iocsti ? BASH_BIND_COMMAND_IOCSTI : BASH_BIND_COMMAND) << std::endl;
 	} else {
 		std::cerr << "Unsupported shell" << std::endl;
 		return 1;
@@ -44,6 +89,48 @@ int printBindCommand(std::string shell, bool iocsti)
 	return 0;
 }
 
+// Answers --query or --batch without starting ncurses. Like the picker,
+// results come from a daemon if one is running, and from the history
+// loaded here if it exits.
+static int runQueries(const std::string& pattern, const QueryOptions& options, bool useDaemon)
+{
+	std::unique_ptr<History> history;
+	std::unique_ptr<ResultSource> source;
+	std::string historyFilename = History::defaultFilename();
+	QueryFallback fallback = [&]() -> std::unique_ptr<ResultSource> {
+		history = std::make_unique<History>(historyFilename);
+		return std::make_unique<FilterWorker>(*history);
+	};
+	if (useDaemon) {
+		source = DaemonClient::connect(historyFilename);
+	}
+	if (!source) {
+		try {
+			source = fallback();
+		} catch (std::runtime_error err) {
+			std::cerr << err.what() << std::endl;
+			return 2;
+		}
+	}
+
+	// Like grep, a single query fails if nothing matches
+	try {
+		if (!options.batch) {
+			return printQuery(source, pattern, options, stdout, fallback) ? 0 : 1;
+		}
+		if (!printQueries(source, stdin, options, stdout, fallback)) {
+			perror("shist: stdin");
+			return 2;
+		}
+	} catch (std::runtime_error err) {
+		// What was printed before the daemon exited isn't the answer
+		std::cerr << "shist: the daemon exited before answering" << std::endl;
+		std::cerr << err.what() << std::endl;
+		return 2;
+	}
+	return 0;
+}
+
 // Print a backtrace when compiled with debug mode
 void segfault_handler(int sig) {
 	// Exit ncurses and restore the terminal screen.
@@ -66,30 +153,89 @@ int main(int argc, char** argv)
 {
 #if !NDEBUG
 	signal(SIGSEGV, segfault_handler);
+	signal(SIGBUS, segfault_handler);
 #endif
+	traceInit();
 
 	bool iocsti = false;
+	bool useDaemon = true;
+	int outputFd = -1;
+	MatchMode mode = MATCH_EXACT;
 
 	cxxopts::Options options("shist", "Shell history selector - a replacement for standard reverse search.");
 	try {
 		options.add_options()
 			("iocsti", "Use TIOCSTI to inject commands into the shell")
-			("b,bind", "Print bind replacement command for the given shell.", cxxopts::value<std::string>()->implicit_value("bash"))
+			("output-fd", "Write the action, cursor position and selection to this fd instead of injecting them. Used by --bind.", cxxopts::value<int>())
+			("b,bind", "Print bind replacement command for the given shell. Add it to e.g. ~/.bashrc with eval \"$(shist --bind bash)\".", cxxopts::value<std::string>()->implicit_value("bash"))
+			("m,mode", "Matching mode to start in: exact, fuzzy or regex. Ctrl-T cycles through them.", cxxopts::value<std::string>()->default_value("exact"))
+			("daemon", "Keep the history loaded and search it for other shist processes, until interrupted. Needs XDG_RUNTIME_DIR.")
+			("no-daemon", "Search in this process even if a daemon is running")
+			("q,query", "Print the history lines matching a pattern, without the picker", cxxopts::value<std::string>())
+			("batch", "Like --query, for each pattern read from stdin, a line each or NUL terminated with --format null")
+			("limit", "Most results printed per pattern by --query or --batch. 0 prints all of them.", cxxopts::value<size_t>()->default_value("0"))
+			("format", "Output of --query and --batch: plain, null or json. In a batch, an empty result ends each pattern's results, or json prints an object per pattern.", cxxopts::value<std::string>()->default_value("plain"))
 		;
 		auto result = options.parse(argc, argv);
 		iocsti = result["iocsti"].as<bool>();
+		if (result["output-fd"].count()) {
+			outputFd = result["output-fd"].as<int>();
+			if (fcntl(outputFd, F_GETFD) < 0) {
+				std::cerr << "Bad --output-fd " << outputFd << ": " << strerror(errno) << std::endl;
+				return 1;
+			}
+		}
+		auto modeName = result["mode"].as<std::string>();
+		if (!parseMatchMode(modeName, &mode)) {
+			std::cerr << "Unknown mode " << modeName << std::endl;
+			return 1;
+		}
 		if (result["bind"].count()) {
 			auto bindCommandShell = result["bind"].as<std::string>();
-			std::cout << bindCommandShell << std::endl;
 			return printBindCommand(bindCommandShell, iocsti);
 		}
+		if (result["daemon"].as<bool>()) {
+			return Daemon(History::defaultFilename()).run();
+		}
+		useDaemon = !result["no-daemon"].as<bool>();
+
+		if (result["query"].count() || result["batch"].as<bool>()) {
+			QueryOptions query;
+			query.mode = mode;
+			query.limit = result["limit"].as<size_t>();
+			query.batch = result["batch"].as<bool>();
+			auto formatName = result["format"].as<std::string>();
+			if (formatName == "null") {
+				query.format = QUERY_FORMAT_NULL;
+			} else if (formatName == "json") {
+				query.format = QUERY_FORMAT_JSON;
+			} else if (formatName != "plain") {
+				std::cerr << "Unknown format " << formatName << std::endl;
+				return 1;
+			}
+			return runQueries(result["query"].count() ? result["query"].as<std::string>() : "", query, useDaemon);
+		}
 	} catch (cxxopts::OptionException e) {
 		std::cerr << e.what() << std::endl;
 		return 1;
 	}
 
+	// SIGWINCH arrives through a signalfd. Block it before any threads are
+	// started so none of them take it, and ncurses' handler never runs.
+	sigset_t winch;
+	sigemptyset(&winch);
+	sigaddset(&winch, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &winch, nullptr);
+	int signalFd = signalfd(-1, &winch, SFD_CLOEXEC | SFD_NONBLOCK);
+	int escTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (signalFd < 0 || escTimerFd < 0) {
+		perror("shist");
+		return 2;
+	}
+
 	try {
-		gScreen = std::make_unique<Screen>();
+		TRACE_SCOPE("startup");
+		gScreen = std::make_unique<Screen>(mode, useDaemon);
 	} catch (std::runtime_error err) {
 		std::cerr << err.what() << std::endl;
 		return 2;
@@ -115,47 +261,123 @@ int main(int argc, char** argv)
 	rl_bind_keyseq("\\C-s", arrow_up);
 	rl_bind_keyseq("\\e[5~", page_up);
 	rl_bind_keyseq("\\e[6~", page_down);
+	rl_bind_keyseq("\\C-t", toggle_mode);
 
 	readline_begin(initialPattern, initialCursorPos, pattern_changed);
 
+	// Sleep until there is input, a lone ESC times out, the terminal is
+	// resized or the filter worker publishes results
+	enum { POLL_INPUT, POLL_ESC_TIMER, POLL_SIGNAL, POLL_RESULTS, POLL_COUNT };
+	struct pollfd fds[POLL_COUNT] = {};
+	fds[POLL_INPUT].fd = STDIN_FILENO;
+	fds[POLL_ESC_TIMER].fd = escTimerFd;
+	fds[POLL_SIGNAL].fd = signalFd;
+	for (struct pollfd& fd : fds) {
+		fd.events = POLLIN;
+	}
+
+	// Falling back from a daemon that exited loads the history, which can
+	// fail like it would have at startup
+	std::string error;
 	const char* lastPattern = nullptr;
 	while(!g_done) {
-		// This is needed so the bind for ESC works because we are still living in the dark ages.
-		if (!getStreamAvailableChars(STDIN_FILENO)) {
-			// TODO: Could rl_prep_terminal be an alternative to this stupid loop?
-			readline_step(0);
-			continue;
+		fds[POLL_RESULTS].fd = gScreen->resultsFd();
+		if (poll(fds, POLL_COUNT, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		if (fds[POLL_RESULTS].revents) {
+			try {
+				gScreen->update();
+			} catch (std::runtime_error err) {
+				error = err.what();
+				break;
+			}
 		}
 
-		int c = gScreen->getChar();
-		//int c = readline_getch();
+		if (fds[POLL_SIGNAL].revents) {
+			struct signalfd_siginfo info;
+			while (read(signalFd, &info, sizeof(info)) > 0) {
+			}
+			gScreen->resize();
+		}
+
+		// Readline takes a 0 as the end of a lone ESC
+		if (fds[POLL_ESC_TIMER].revents) {
+			uint64_t expirations;
+			if (read(escTimerFd, &expirations, sizeof(expirations)) > 0) {
+				lastPattern = readline_step(0);
+			}
+		}
 
-		lastPattern = readline_step(c);
+		if (fds[POLL_INPUT].revents) {
+			TRACE_SCOPE("input");
+			armTimer(escTimerFd, 0);
+			int c;
+			bool any = false;
+			bool lastEscape = false;
+			while (!g_done && gScreen->getChar(&c)) {
+				lastPattern = readline_step(c);
+				any = true;
+				lastEscape = c == '\e';
+			}
+			if (lastEscape && !g_done) {
+				armTimer(escTimerFd, ESC_TIMEOUT_MS);
+			} else if (!any && (fds[POLL_INPUT].revents & (POLLHUP | POLLERR))) {
+				// The terminal has gone
+				break;
+			}
+		}
 	}
 
 	readline_end();
 
 	// Get the currently selected item from the history list
-	const char* selection = gScreen->selection();
+	std::string_view selection;
+	if (error.empty()) {
+		try {
+			selection = gScreen->selection();
+		} catch (std::runtime_error err) {
+			error = err.what();
+		}
+	}
+	if (!error.empty()) {
+		gScreen.reset();
+		std::cerr << error << std::endl;
+		return 2;
+	}
 
 	// If there was no selected item, e.g. filtered history is empty,
 	// use the entered pattern instead.
-	if (!selection) {
+	if (!selection.data() && lastPattern) {
 		selection = lastPattern;
 	}
 
+	// A shell integration reading outputFd loads the result itself.
+	// Otherwise it's typed back in with TIOCSTI.
 	switch (g_action) {
 	case ACTION_EXECUTE_SELECTION:
-		if (selection) {
-			term_replace_command(selection);
-			term_execute();
+		if (selection.data()) {
+			if (outputFd >= 0) {
+				status = fd_write_result(outputFd, "execute", selection, selection.size()) ? 0 : 2;
+			} else {
+				term_replace_command(selection);
+				term_execute();
+			}
 			break;
 		}
 		status = 1;
 		break;
 	case ACTION_REPLACE_COMMAND:
-		if (selection) {
-			term_replace_command(selection);
+		if (selection.data()) {
+			if (outputFd >= 0) {
+				status = fd_write_result(outputFd, "replace", selection, selection.size()) ? 0 : 2;
+			} else {
+				term_replace_command(selection);
+			}
 			break;
 		}
 		status = 1;
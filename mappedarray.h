@@ -0,0 +1,159 @@
+#pragma once
+#include <stddef.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// An array that either borrows read-only memory, such as a section of a
+// mapped cache file, or owns its elements. Modifying a borrowed array first
+// copies it into owned storage.
+template <typename T>
+class MappedArray {
+public:
+	MappedArray() = default;
+	MappedArray(const MappedArray&) = delete;
+	MappedArray& operator=(const MappedArray&) = delete;
+
+	MappedArray(MappedArray&& other) noexcept
+	{
+		*this = std::move(other);
+	}
+
+	MappedArray& operator=(MappedArray&& other) noexcept
+	{
+		bool otherBorrowed = other.borrowed();
+		m_owned = std::move(other.m_owned);
+		m_data = otherBorrowed ? other.m_data : m_owned.data();
+		m_size = other.m_size;
+		other.m_owned.clear();
+		other.m_data = other.m_owned.data();
+		other.m_size = 0;
+		return *this;
+	}
+
+	const T* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	bool borrowed() const { return m_data != m_owned.data(); }
+
+	// Elements that fit before owned storage moves. Borrowed arrays always
+	// move on modification.
+	size_t capacity() const { return borrowed() ? 0 : m_owned.capacity(); }
+	const T& operator[](size_t i) const { return m_data[i]; }
+	const T& back() const { return m_data[m_size - 1]; }
+
+	// Writable elements, copying borrowed memory first
+	T* mutableData()
+	{
+		own();
+		return m_owned.data();
+	}
+
+	void borrow(const T* data, size_t size)
+	{
+		m_owned.clear();
+		m_owned.shrink_to_fit();
+		m_data = data;
+		m_size = size;
+	}
+
+	// Copies borrowed memory straight into storage of this size, rather than
+	// copying it and then moving it
+	void reserve(size_t size)
+	{
+		if (borrowed()) {
+			std::vector<T> owned;
+			owned.reserve(std::max(size, m_size));
+			owned.assign(m_data, m_data + m_size);
+			m_owned = std::move(owned);
+		}
+		m_owned.reserve(size);
+		m_data = m_owned.data();
+	}
+
+	void push_back(const T& value)
+	{
+		own();
+		m_owned.push_back(value);
+		m_data = m_owned.data();
+		m_size = m_owned.size();
+	}
+
+	void append(const T* data, size_t count)
+	{
+		own();
+		m_owned.insert(m_owned.end(), data, data + count);
+		m_data = m_owned.data();
+		m_size = m_owned.size();
+	}
+
+	void resize(size_t size)
+	{
+		own();
+		m_owned.resize(size);
+		m_data = m_owned.data();
+		m_size = size;
+	}
+
+	void clear()
+	{
+		m_owned.clear();
+		m_data = m_owned.data();
+		m_size = 0;
+	}
+
+private:
+	void own()
+	{
+		if (borrowed()) {
+			m_owned.assign(m_data, m_data + m_size);
+			m_data = m_owned.data();
+		}
+	}
+
+	std::vector<T> m_owned;
+	const T* m_data = nullptr;
+	size_t m_size = 0;
+};
+
+// An array whose first elements are borrowed, such as a table in a mapped
+// cache file, and whose later ones are owned. Appending never copies the
+// borrowed part, but elements are only contiguous within each part, and
+// borrowed ones can't be removed.
+template <typename T>
+class SplitArray {
+public:
+	size_t size() const { return m_borrowedSize + m_owned.size(); }
+	bool empty() const { return size() == 0; }
+	const T& operator[](size_t i) const { return i < m_borrowedSize ? m_borrowed[i] : m_owned[i - m_borrowedSize]; }
+
+	const T* borrowedData() const { return m_borrowed; }
+	size_t borrowedSize() const { return m_borrowedSize; }
+	const T* ownedData() const { return m_owned.data(); }
+
+	void borrow(const T* data, size_t size)
+	{
+		m_borrowed = data;
+		m_borrowedSize = size;
+		m_owned.clear();
+	}
+
+	void reserve(size_t size) { m_owned.reserve(size > m_borrowedSize ? size - m_borrowedSize : 0); }
+	void push_back(const T& value) { m_owned.push_back(value); }
+	void append(const T* data, size_t count) { m_owned.insert(m_owned.end(), data, data + count); }
+
+	// Never less than borrowedSize()
+	void resize(size_t size) { m_owned.resize(size - m_borrowedSize); }
+
+	void clear()
+	{
+		m_borrowed = nullptr;
+		m_borrowedSize = 0;
+		m_owned.clear();
+	}
+
+private:
+	const T* m_borrowed = nullptr;
+	size_t m_borrowedSize = 0;
+	std::vector<T> m_owned;
+};
@@ -1,15 +1,18 @@
 
-#include "input.h"
+#include "output.h"
+#include <errno.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
+#include <string>
 
-static inline void term_send(const char *str)
+static inline void term_send(std::string_view str)
 {
-	for (const char* c = str; *c != '\0'; ++c) {
-		ioctl(0, TIOCSTI, c);
+	for (const char& c : str) {
+		ioctl(0, TIOCSTI, &c);
 	}
 }
 
-void term_replace_command(const char *contents)
+void term_replace_command(std::string_view contents)
 {
 	// ansi escape sequences (?)
 	// http://www.expandinghead.net/keycode.html
@@ -19,8 +22,8 @@ void term_replace_command(const char *contents)
 	// Just had to use a debugger and see what constants to use here.
 	// ^A - cursor to beginning of line
 	// ^K - clear rest of line
-	const char clear_line[] = {1, 11, 0};
-	term_send(clear_line);
+	const char clear_line[] = {1, 11};
+	term_send(std::string_view(clear_line, sizeof(clear_line)));
 
 	// print string
 	term_send(contents);
@@ -29,6 +32,27 @@ void term_replace_command(const char *contents)
 void term_execute()
 {
 	// ^J - run the command
-	const char execute[] = {10, 0};
-	term_send(execute);
+	const char execute[] = {10};
+	term_send(std::string_view(execute, sizeof(execute)));
+}
+
+bool fd_write_result(int fd, std::string_view action, std::string_view line, size_t point)
+{
+	std::string result(action);
+	result += ' ';
+	result += std::to_string(point);
+	result += '\n';
+	result += line;
+
+	for (size_t written = 0; written < result.size();) {
+		ssize_t bytes = write(fd, result.data() + written, result.size() - written);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		written += bytes;
+	}
+	return true;
 }
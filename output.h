@@ -1,4 +1,9 @@
 #pragma once
+#include <string_view>
 
-void term_replace_command(const char* contents);
+void term_replace_command(std::string_view contents);
 void term_execute();
+
+// Writes "<action> <point>\n<line>" to fd, for a shell integration to
+// load into its line editor. Returns false on error.
+bool fd_write_result(int fd, std::string_view action, std::string_view line, size_t point);
@@ -0,0 +1,152 @@
+#include "query.h"
+#include "resultsource.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Appends text as a quoted JSON string. Bytes that aren't control
+// characters pass through, so UTF-8 lines stay readable.
+static void appendJsonString(std::string& out, std::string_view text)
+{
+	out += '"';
+	for (char c : text) {
+		switch (c) {
+		case '"':
+			out += "\\\"";
+			break;
+		case '\\':
+			out += "\\\\";
+			break;
+		case '\n':
+			out += "\\n";
+			break;
+		case '\t':
+			out += "\\t";
+			break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+				char escaped[8];
+				snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+				out += escaped;
+			} else {
+				out += c;
+			}
+		}
+	}
+	out += '"';
+}
+
+static void appendResult(std::string& out, const HistoryItem& item, const FilterResults& results, const QueryOptions& options,
+	std::vector<LineRange>& matches)
+{
+	switch (options.format) {
+	case QUERY_FORMAT_PLAIN:
+		out.append(item.line.data(), item.line.size());
+		out += '\n';
+		break;
+	case QUERY_FORMAT_NULL:
+		out.append(item.line.data(), item.line.size());
+		out += '\0';
+		break;
+	case QUERY_FORMAT_JSON:
+		History::itemMatches(item, results.pattern, results.mode, matches);
+		out += "{\"line\":";
+		appendJsonString(out, item.line);
+		out += ",\"matches\":[";
+		for (size_t i = 0; i < matches.size(); ++i) {
+			out += i ? ",[" : "[";
+			out += std::to_string(matches[i].start);
+			out += ',';
+			out += std::to_string(matches[i].size);
+			out += ']';
+		}
+		out += "]}";
+		break;
+	}
+}
+
+size_t printQuery(std::unique_ptr<ResultSource>& source, const std::string& pattern, const QueryOptions& options, FILE* out,
+	const QueryFallback& fallback)
+{
+	size_t limit = options.limit ? options.limit : SIZE_MAX;
+	size_t page = std::min<size_t>(limit, QUERY_FIRST_PAGE_RESULTS);
+	source->setFilter(pattern, options.mode, page);
+
+	std::string buffer;
+	if (options.format == QUERY_FORMAT_JSON) {
+		buffer = "{\"pattern\":";
+		appendJsonString(buffer, pattern);
+		buffer += ",\"mode\":\"";
+		buffer += matchModeName(options.mode);
+		buffer += "\",\"results\":[";
+	}
+
+	// Each page is printed as soon as it's found. Results only grow at the
+	// end while a search continues.
+	std::vector<LineRange> matches;
+	size_t printed = 0;
+	bool complete = false;
+	while (printed < limit) {
+		std::shared_ptr<const FilterResults> results;
+		while (!(results = source->wait(page))) {
+			// The daemon exited. Searching the same history here finds the
+			// same results, so printing carries on after those printed.
+			source = fallback();
+			source->setFilter(pattern, options.mode, page);
+		}
+		size_t end = std::min(results->items.size(), limit);
+		for (size_t i = printed; i < end; ++i) {
+			if (options.format == QUERY_FORMAT_JSON && i) {
+				buffer += ',';
+			}
+			appendResult(buffer, results->items[i], *results, options, matches);
+		}
+		printed = std::max(printed, end);
+		fwrite(buffer.data(), 1, buffer.size(), out);
+		buffer.clear();
+		complete = results->complete && printed == results->items.size();
+		if (results->complete) {
+			break;
+		}
+		page = std::min(limit, 2 * page);
+	}
+
+	// A batch's answers are delimited so a caller knows when one ends
+	switch (options.format) {
+	case QUERY_FORMAT_PLAIN:
+		buffer = options.batch ? "\n" : "";
+		break;
+	case QUERY_FORMAT_NULL:
+		buffer = options.batch ? std::string(1, '\0') : "";
+		break;
+	case QUERY_FORMAT_JSON:
+		buffer = complete ? "],\"complete\":true}\n" : "],\"complete\":false}\n";
+		break;
+	}
+	fwrite(buffer.data(), 1, buffer.size(), out);
+	return printed;
+}
+
+bool printQueries(std::unique_ptr<ResultSource>& source, FILE* in, const QueryOptions& options, FILE* out,
+	const QueryFallback& fallback)
+{
+	int delimiter = options.format == QUERY_FORMAT_NULL ? '\0' : '\n';
+	char* line = nullptr;
+	size_t capacity = 0;
+	ssize_t size;
+	while ((size = getdelim(&line, &capacity, delimiter, in)) >= 0) {
+		std::string pattern(line, size);
+		if (!pattern.empty() && pattern.back() == delimiter) {
+			pattern.pop_back();
+		}
+		printQuery(source, pattern, options, out, fallback);
+		fflush(out);
+	}
+	free(line);
+	return !ferror(in);
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "history.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <functional>
+#include <memory>
+#include <string>
+
+class ResultSource;
+
+// Results are asked for in pages that double in size, so the first are
+// printed quickly and a daemon resends all of them only a few times
+#define QUERY_FIRST_PAGE_RESULTS 256
+
+enum QueryFormat {
+	// A line per result, and an empty line after each pattern's results
+	// in a batch
+	QUERY_FORMAT_PLAIN,
+	// Results terminated by NUL, and an empty one after each pattern's
+	// results in a batch. Patterns in a batch are NUL terminated too.
+	QUERY_FORMAT_NULL,
+	// A JSON object per pattern on one line, with the matched byte ranges
+	// of each result
+	QUERY_FORMAT_JSON,
+};
+
+struct QueryOptions {
+	MatchMode mode = MATCH_EXACT;
+	// Most results printed per pattern, or 0 for all of them
+	size_t limit = 0;
+	QueryFormat format = QUERY_FORMAT_PLAIN;
+	// Patterns are read from a stream, and their results delimited
+	bool batch = false;
+};
+
+// Makes a source searching in this process, for when the daemon a query
+// was sent to exits. Throws if the history can't be loaded.
+typedef std::function<std::unique_ptr<ResultSource>()> QueryFallback;
+
+// Answers patterns from a ResultSource without a terminal, for scripts.
+// Prints the results for pattern to out as they arrive, most recent or
+// best scoring first. Returns the number printed. A source that
+// disconnects is replaced by fallback's, which finishes the query.
+size_t printQuery(std::unique_ptr<ResultSource>& source, const std::string& pattern, const QueryOptions& options, FILE* out,
+	const QueryFallback& fallback);
+
+// Answers each pattern read from in, flushing out after each so a caller
+// can wait for one answer before asking the next. Returns false if in
+// couldn't be read.
+bool printQueries(std::unique_ptr<ResultSource>& source, FILE* in, const QueryOptions& options, FILE* out,
+	const QueryFallback& fallback);
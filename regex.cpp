@@ -0,0 +1,838 @@
+#include "regex.h"
+#include <ctype.h>
+#include <algorithm>
+#include <bitset>
+
+// Patterns are parsed into a tree, which compiles to a Thompson NFA twice:
+// forwards, and reversed for finding where matches start. Required
+// literals are collected from the tree.
+struct RegexInst {
+	enum Op : uint8_t {
+		// Consume a byte in sets[x], then go to y
+		INST_CLASS,
+		// Go to both x and y
+		INST_SPLIT,
+		// Only at the beginning or end of the text, then go to x
+		INST_BEGIN,
+		INST_END,
+		INST_MATCH,
+	};
+	Op op;
+	uint32_t x, y;
+};
+
+struct RegexProgram {
+	std::vector<RegexInst> insts;
+	std::vector<std::bitset<256>> sets;
+	uint32_t start = 0;
+
+	// Bytes no set tells apart share a class, keeping DFA tables small
+	uint8_t classOf[256];
+	int classCount = 0;
+};
+
+namespace {
+
+using ByteSet = std::bitset<256>;
+
+const int REPEAT_UNBOUNDED = -1;
+
+struct Node {
+	enum Type {
+		NODE_EMPTY,
+		NODE_CLASS,
+		NODE_CONCAT,
+		NODE_ALTERNATE,
+		NODE_REPEAT,
+		NODE_BEGIN,
+		NODE_END,
+	};
+	Type type;
+	ByteSet set;
+	std::vector<int> children;
+	int min = 0, max = 0;
+};
+
+ByteSet rangeSet(int first, int last)
+{
+	ByteSet set;
+	for (int c = first; c <= last; ++c) {
+		set.set(c);
+	}
+	return set;
+}
+
+// The only byte in set, or -1 if it has more or none
+int onlyByte(const ByteSet& set)
+{
+	if (set.count() != 1) {
+		return -1;
+	}
+	int c = 0;
+	while (!set[c]) {
+		++c;
+	}
+	return c;
+}
+
+ByteSet digitSet()
+{
+	return rangeSet('0', '9');
+}
+
+ByteSet wordSet()
+{
+	return rangeSet('a', 'z') | rangeSet('A', 'Z') | digitSet() | rangeSet('_', '_');
+}
+
+ByteSet spaceSet()
+{
+	ByteSet set;
+	for (char c : std::string_view(" \t\n\r\f\v")) {
+		set.set(static_cast<unsigned char>(c));
+	}
+	return set;
+}
+
+class Parser {
+public:
+	Parser(std::string_view pattern, std::vector<Node>& nodes)
+		: m_pattern(pattern)
+		, m_nodes(nodes)
+	{
+	}
+
+	// Returns the root node, or -1 and sets error
+	int parse(std::string& error)
+	{
+		int root = alternation();
+		if (root >= 0 && m_pos < m_pattern.size()) {
+			// Only an unmatched ) stops an alternation early
+			fail("unmatched )");
+		}
+		error = m_error;
+		return m_error.empty() ? root : -1;
+	}
+
+private:
+	int add(Node node)
+	{
+		m_nodes.push_back(std::move(node));
+		return static_cast<int>(m_nodes.size() - 1);
+	}
+
+	int addClass(const ByteSet& set)
+	{
+		Node node{Node::NODE_CLASS};
+		node.set = set;
+		return add(node);
+	}
+
+	int fail(const char* error)
+	{
+		if (m_error.empty()) {
+			m_error = error;
+		}
+		return -1;
+	}
+
+	bool more() const { return m_pos < m_pattern.size(); }
+	char peek() const { return m_pattern[m_pos]; }
+
+	int alternation()
+	{
+		std::vector<int> choices{concatenation()};
+		while (m_error.empty() && more() && peek() == '|') {
+			++m_pos;
+			choices.push_back(concatenation());
+		}
+		if (!m_error.empty()) {
+			return -1;
+		}
+		if (choices.size() == 1) {
+			return choices[0];
+		}
+		Node node{Node::NODE_ALTERNATE};
+		node.children = std::move(choices);
+		return add(node);
+	}
+
+	int concatenation()
+	{
+		std::vector<int> parts;
+		while (m_error.empty() && more() && peek() != '|' && peek() != ')') {
+			int part = repeat();
+			if (part >= 0) {
+				parts.push_back(part);
+			}
+		}
+		if (!m_error.empty()) {
+			return -1;
+		}
+		if (parts.size() == 1) {
+			return parts[0];
+		}
+		Node node{parts.empty() ? Node::NODE_EMPTY : Node::NODE_CONCAT};
+		node.children = std::move(parts);
+		return add(node);
+	}
+
+	int repeat()
+	{
+		int atom = this->atom();
+		while (atom >= 0 && more()) {
+			int min, max;
+			char c = peek();
+			if (c == '*') {
+				min = 0, max = REPEAT_UNBOUNDED;
+				++m_pos;
+			} else if (c == '+') {
+				min = 1, max = REPEAT_UNBOUNDED;
+				++m_pos;
+			} else if (c == '?') {
+				min = 0, max = 1;
+				++m_pos;
+			} else if (c != '{' || !counts(min, max)) {
+				break;
+			}
+			if (!m_error.empty()) {
+				return -1;
+			}
+			// Lazy repeats match the same lines, and matches are always
+			// the longest
+			if (more() && peek() == '?') {
+				++m_pos;
+			}
+			Node node{Node::NODE_REPEAT};
+			node.children = {atom};
+			node.min = min;
+			node.max = max;
+			atom = add(node);
+		}
+		return atom;
+	}
+
+	// Parses {n}, {n,} or {n,m}. Anything else is a literal {.
+	bool counts(int& min, int& max)
+	{
+		size_t pos = m_pos + 1;
+		if (!number(pos, min)) {
+			return false;
+		}
+		max = min;
+		if (pos < m_pattern.size() && m_pattern[pos] == ',') {
+			++pos;
+			max = REPEAT_UNBOUNDED;
+			if (pos < m_pattern.size() && m_pattern[pos] != '}' && !number(pos, max)) {
+				return false;
+			}
+		}
+		if (pos >= m_pattern.size() || m_pattern[pos] != '}') {
+			return false;
+		}
+		m_pos = pos + 1;
+		if (min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT) {
+			fail("repeat count too large");
+		} else if (max != REPEAT_UNBOUNDED && max < min) {
+			fail("bad repeat range");
+		}
+		return true;
+	}
+
+	bool number(size_t& pos, int& value)
+	{
+		size_t first = pos;
+		value = 0;
+		while (pos < m_pattern.size() && m_pattern[pos] >= '0' && m_pattern[pos] <= '9') {
+			value = std::min(value * 10 + (m_pattern[pos++] - '0'), REGEX_MAX_REPEAT + 1);
+		}
+		return pos > first;
+	}
+
+	int atom()
+	{
+		char c = m_pattern[m_pos++];
+		switch (c) {
+		case '(': {
+			if (m_pattern.substr(m_pos, 2) == "?:") {
+				m_pos += 2;
+			}
+			int inner = alternation();
+			if (inner < 0) {
+				return -1;
+			}
+			if (!more() || peek() != ')') {
+				return fail("missing )");
+			}
+			++m_pos;
+			return inner;
+		}
+		case '*':
+		case '+':
+		case '?':
+			return fail("nothing to repeat");
+		case '.':
+			return addClass(~rangeSet('\n', '\n'));
+		case '^':
+			return add(Node{Node::NODE_BEGIN});
+		case '$':
+			return add(Node{Node::NODE_END});
+		case '[':
+			return bracket();
+		case '\\': {
+			ByteSet set;
+			if (!escape(set)) {
+				return -1;
+			}
+			return addClass(set);
+		}
+		default:
+			return addClass(rangeSet(static_cast<unsigned char>(c), static_cast<unsigned char>(c)));
+		}
+	}
+
+	// Parses the escape after a backslash into set
+	bool escape(ByteSet& set)
+	{
+		if (!more()) {
+			fail("trailing \\");
+			return false;
+		}
+		char c = m_pattern[m_pos++];
+		switch (c) {
+		case 'd': set = digitSet(); break;
+		case 'D': set = ~digitSet(); break;
+		case 'w': set = wordSet(); break;
+		case 'W': set = ~wordSet(); break;
+		case 's': set = spaceSet(); break;
+		case 'S': set = ~spaceSet(); break;
+		case 't': set.set('\t'); break;
+		case 'n': set.set('\n'); break;
+		case 'r': set.set('\r'); break;
+		case 'f': set.set('\f'); break;
+		case 'v': set.set('\v'); break;
+		default:
+			// Other letters and digits are reserved for escapes this
+			// doesn't support, like \b, rather than silently meaning
+			// themselves
+			if (isalnum(static_cast<unsigned char>(c))) {
+				fail("unsupported escape");
+				return false;
+			}
+			set.set(static_cast<unsigned char>(c));
+		}
+		return true;
+	}
+
+	int bracket()
+	{
+		ByteSet set;
+		bool negate = more() && peek() == '^';
+		if (negate) {
+			++m_pos;
+		}
+		bool first = true;
+		while (more() && (first || peek() != ']')) {
+			first = false;
+			ByteSet item;
+			int low = -1;
+			if (peek() == '\\') {
+				++m_pos;
+				if (!escape(item)) {
+					return -1;
+				}
+				low = onlyByte(item);
+			} else {
+				low = static_cast<unsigned char>(m_pattern[m_pos++]);
+				item.set(low);
+			}
+
+			// A range, unless the - ends the class
+			if (low >= 0 && m_pos + 1 < m_pattern.size() && peek() == '-' && m_pattern[m_pos + 1] != ']') {
+				++m_pos;
+				int high = static_cast<unsigned char>(m_pattern[m_pos++]);
+				if (high == '\\') {
+					ByteSet end;
+					if (!escape(end)) {
+						return -1;
+					}
+					high = onlyByte(end);
+				}
+				if (high < low) {
+					return fail("bad class range");
+				}
+				item = rangeSet(low, high);
+			}
+			set |= item;
+		}
+		if (!more()) {
+			return fail("missing ]");
+		}
+		++m_pos;
+		return addClass(negate ? ~set : set);
+	}
+
+	std::string_view m_pattern;
+	std::vector<Node>& m_nodes;
+	size_t m_pos = 0;
+	std::string m_error;
+};
+
+class Compiler {
+public:
+	Compiler(const std::vector<Node>& nodes, bool reverse, RegexProgram& program)
+		: m_nodes(nodes)
+		, m_reverse(reverse)
+		, m_program(program)
+	{
+	}
+
+	bool compile(int root)
+	{
+		uint32_t match = add({RegexInst::INST_MATCH, 0, 0});
+		m_program.start = emit(root, match);
+		if (m_program.insts.size() > REGEX_MAX_PROGRAM_SIZE) {
+			return false;
+		}
+		byteClasses();
+		return true;
+	}
+
+private:
+	uint32_t add(RegexInst inst)
+	{
+		m_program.insts.push_back(inst);
+		return static_cast<uint32_t>(m_program.insts.size() - 1);
+	}
+
+	// Emits node, continuing to next, and returns its first instruction.
+	// Built back to front so no instruction needs patching except loops.
+	uint32_t emit(int index, uint32_t next)
+	{
+		// Give up on patterns that expand too far, checked by compile()
+		if (m_program.insts.size() > REGEX_MAX_PROGRAM_SIZE) {
+			return next;
+		}
+		const Node& node = m_nodes[index];
+		switch (node.type) {
+		case Node::NODE_EMPTY:
+			return next;
+		case Node::NODE_CLASS:
+			m_program.sets.push_back(node.set);
+			return add({RegexInst::INST_CLASS, static_cast<uint32_t>(m_program.sets.size() - 1), next});
+		case Node::NODE_BEGIN:
+		case Node::NODE_END: {
+			// Reversed text begins where the line ends
+			bool begin = (node.type == Node::NODE_BEGIN) != m_reverse;
+			return add({begin ? RegexInst::INST_BEGIN : RegexInst::INST_END, next, 0});
+		}
+		case Node::NODE_CONCAT:
+			if (m_reverse) {
+				for (int child : node.children) {
+					next = emit(child, next);
+				}
+			} else {
+				for (auto child = node.children.rbegin(); child != node.children.rend(); ++child) {
+					next = emit(*child, next);
+				}
+			}
+			return next;
+		case Node::NODE_ALTERNATE: {
+			uint32_t pc = emit(node.children.back(), next);
+			for (size_t i = node.children.size() - 1; i-- > 0;) {
+				uint32_t choice = emit(node.children[i], next);
+				pc = add({RegexInst::INST_SPLIT, choice, pc});
+			}
+			return pc;
+		}
+		case Node::NODE_REPEAT: {
+			int child = node.children[0];
+			uint32_t pc = next;
+			if (node.max == REPEAT_UNBOUNDED) {
+				uint32_t loop = add({RegexInst::INST_SPLIT, 0, next});
+				uint32_t body = emit(child, loop);
+				m_program.insts[loop].x = body;
+				pc = loop;
+			} else {
+				for (int i = node.min; i < node.max; ++i) {
+					pc = add({RegexInst::INST_SPLIT, emit(child, pc), next});
+				}
+			}
+			for (int i = 0; i < node.min; ++i) {
+				pc = emit(child, pc);
+			}
+			return pc;
+		}
+		}
+		return next;
+	}
+
+	void byteClasses()
+	{
+		std::map<std::vector<bool>, int> classes;
+		std::vector<bool> signature(m_program.sets.size());
+		for (int c = 0; c < 256; ++c) {
+			for (size_t i = 0; i < m_program.sets.size(); ++i) {
+				signature[i] = m_program.sets[i][c];
+			}
+			auto inserted = classes.emplace(signature, static_cast<int>(classes.size()));
+			m_program.classOf[c] = static_cast<uint8_t>(inserted.first->second);
+		}
+		m_program.classCount = static_cast<int>(classes.size());
+	}
+
+	const std::vector<Node>& m_nodes;
+	bool m_reverse;
+	RegexProgram& m_program;
+};
+
+// What a subtree says about the literal text of its matches
+struct Literals {
+	// Every match is exactly text, ignoring anchors
+	bool exact = true;
+	std::string text;
+	// Every match starts with prefix, ends with suffix and contains
+	// required
+	std::string prefix, suffix, required;
+};
+
+void keepLongest(std::string& best, const std::string& candidate)
+{
+	if (candidate.size() > best.size()) {
+		best = candidate;
+	}
+}
+
+Literals literals(const std::vector<Node>& nodes, int index)
+{
+	const Node& node = nodes[index];
+	Literals result;
+	switch (node.type) {
+	case Node::NODE_EMPTY:
+	case Node::NODE_BEGIN:
+	case Node::NODE_END:
+		return result;
+	case Node::NODE_CLASS:
+		if (onlyByte(node.set) >= 0) {
+			result.text = std::string(1, static_cast<char>(onlyByte(node.set)));
+			result.prefix = result.suffix = result.required = result.text;
+		} else {
+			result.exact = false;
+		}
+		return result;
+	case Node::NODE_CONCAT: {
+		// Adjacent exact children join into one run of text
+		std::string run;
+		for (int child : node.children) {
+			Literals part = literals(nodes, child);
+			if (part.exact) {
+				run += part.text;
+				continue;
+			}
+			keepLongest(result.required, run + part.prefix);
+			keepLongest(result.required, part.required);
+			if (result.exact) {
+				result.prefix = run + part.prefix;
+				result.exact = false;
+			}
+			run = part.suffix;
+		}
+		if (result.exact) {
+			result.text = result.prefix = run;
+		}
+		result.suffix = run;
+		keepLongest(result.required, run);
+		return result;
+	}
+	case Node::NODE_ALTERNATE: {
+		// Only what all choices start or end with is certain
+		result = literals(nodes, node.children[0]);
+		for (size_t i = 1; i < node.children.size(); ++i) {
+			Literals choice = literals(nodes, node.children[i]);
+			result.exact = result.exact && choice.exact && result.text == choice.text;
+			size_t prefix = std::mismatch(result.prefix.begin(), result.prefix.end(), choice.prefix.begin(), choice.prefix.end()).first - result.prefix.begin();
+			result.prefix.resize(prefix);
+			size_t suffix = std::mismatch(result.suffix.rbegin(), result.suffix.rend(), choice.suffix.rbegin(), choice.suffix.rend()).first - result.suffix.rbegin();
+			result.suffix.erase(0, result.suffix.size() - suffix);
+		}
+		if (!result.exact) {
+			result.text.clear();
+			result.required.clear();
+			keepLongest(result.required, result.prefix);
+			keepLongest(result.required, result.suffix);
+		}
+		return result;
+	}
+	case Node::NODE_REPEAT: {
+		Literals child = literals(nodes, node.children[0]);
+		if (node.max == 0 || (child.exact && child.text.empty())) {
+			return result;
+		}
+		result.exact = false;
+		if (node.min == 0) {
+			return result;
+		}
+		if (child.exact) {
+			for (int i = 0; i < node.min && result.text.size() < 256; ++i) {
+				result.text += child.text;
+			}
+			result.exact = node.min == node.max;
+			result.prefix = result.suffix = result.required = result.text;
+			if (!result.exact) {
+				result.text.clear();
+			}
+		} else {
+			result.prefix = child.prefix;
+			result.suffix = child.suffix;
+			result.required = child.required;
+		}
+		return result;
+	}
+	}
+	return result;
+}
+
+} // namespace
+
+void RegexDfa::init(std::shared_ptr<const RegexProgram> program, bool unanchored)
+{
+	m_program = std::move(program);
+	m_unanchored = unanchored;
+	m_states.clear();
+	m_ids.clear();
+	m_next.clear();
+	m_start[0] = m_start[1] = -1;
+	m_seen.assign(m_program->insts.size(), 0);
+}
+
+// Adds the instructions reachable from pc without consuming a byte. Only
+// those that consume, match, or wait on an anchor are kept.
+void RegexDfa::closure(uint32_t pc, bool atBeginning, bool atEnd, std::vector<uint32_t>& pcs)
+{
+	const std::vector<RegexInst>& insts = m_program->insts;
+	m_stack.push_back(pc);
+	while (!m_stack.empty()) {
+		pc = m_stack.back();
+		m_stack.pop_back();
+		if (m_seen[pc]) {
+			continue;
+		}
+		m_seen[pc] = 1;
+		const RegexInst& inst = insts[pc];
+		switch (inst.op) {
+		case RegexInst::INST_SPLIT:
+			m_stack.push_back(inst.y);
+			m_stack.push_back(inst.x);
+			break;
+		case RegexInst::INST_BEGIN:
+			if (atBeginning) {
+				m_stack.push_back(inst.x);
+			}
+			break;
+		case RegexInst::INST_END:
+			if (atEnd) {
+				m_stack.push_back(inst.x);
+			} else {
+				pcs.push_back(pc);
+			}
+			break;
+		default:
+			pcs.push_back(pc);
+		}
+	}
+}
+
+// Returns the state for a set of instructions, adding it if new
+int RegexDfa::intern(std::vector<uint32_t>& pcs)
+{
+	std::sort(pcs.begin(), pcs.end());
+	auto found = m_ids.find(pcs);
+	if (found != m_ids.end()) {
+		return found->second;
+	}
+
+	// Start again rather than grow without bound on patterns like
+	// (a|b)*a(a|b){12}
+	if (m_states.size() >= REGEX_MAX_DFA_STATES) {
+		m_states.clear();
+		m_ids.clear();
+		m_next.clear();
+		m_start[0] = m_start[1] = -1;
+		++m_resets;
+	}
+
+	const std::vector<RegexInst>& insts = m_program->insts;
+	State state{pcs, false, false};
+	std::vector<uint32_t> atEnd;
+	std::fill(m_seen.begin(), m_seen.end(), 0);
+	for (uint32_t pc : pcs) {
+		if (insts[pc].op == RegexInst::INST_MATCH) {
+			state.match = true;
+		} else if (insts[pc].op == RegexInst::INST_END) {
+			closure(insts[pc].x, false, true, atEnd);
+		}
+	}
+	state.matchAtEnd = state.match;
+	for (uint32_t pc : atEnd) {
+		state.matchAtEnd = state.matchAtEnd || insts[pc].op == RegexInst::INST_MATCH;
+	}
+
+	int id = static_cast<int>(m_states.size());
+	m_states.push_back(std::move(state));
+	m_ids.emplace(pcs, id);
+	m_next.resize(m_next.size() + m_program->classCount, -1);
+	return id;
+}
+
+int RegexDfa::start(bool atBeginning)
+{
+	int& cached = m_start[atBeginning];
+	if (cached < 0) {
+		m_pcs.clear();
+		std::fill(m_seen.begin(), m_seen.end(), 0);
+		closure(m_program->start, atBeginning, false, m_pcs);
+		cached = intern(m_pcs);
+	}
+	return cached;
+}
+
+bool RegexDfa::matchesEmpty()
+{
+	// Both anchors hold at once, which no state accounts for
+	m_pcs.clear();
+	std::fill(m_seen.begin(), m_seen.end(), 0);
+	closure(m_program->start, true, true, m_pcs);
+	for (uint32_t pc : m_pcs) {
+		if (m_program->insts[pc].op == RegexInst::INST_MATCH) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int RegexDfa::next(int state, uint8_t byte)
+{
+	size_t slot = static_cast<size_t>(state) * m_program->classCount + m_program->classOf[byte];
+	int known = m_next[slot];
+	if (known >= 0) {
+		return known;
+	}
+
+	const RegexProgram& program = *m_program;
+	m_pcs.clear();
+	std::fill(m_seen.begin(), m_seen.end(), 0);
+	for (uint32_t pc : m_states[state].pcs) {
+		const RegexInst& inst = program.insts[pc];
+		if (inst.op == RegexInst::INST_CLASS && program.sets[inst.x][byte]) {
+			closure(inst.y, false, false, m_pcs);
+		}
+	}
+	if (m_unanchored) {
+		closure(program.start, false, false, m_pcs);
+	}
+
+	// Unless interning emptied the cache, which took state with it
+	unsigned resets = m_resets;
+	int id = intern(m_pcs);
+	if (m_resets == resets) {
+		m_next[slot] = id;
+	}
+	return id;
+}
+
+Regex::Regex(std::string_view pattern)
+{
+	std::vector<Node> nodes;
+	int root = Parser(pattern, nodes).parse(m_error);
+	if (root < 0) {
+		return;
+	}
+
+	auto forward = std::make_shared<RegexProgram>();
+	auto reverse = std::make_shared<RegexProgram>();
+	if (!Compiler(nodes, false, *forward).compile(root) || !Compiler(nodes, true, *reverse).compile(root)) {
+		m_error = "pattern too large";
+		return;
+	}
+	m_search.init(forward, true);
+	m_ends.init(forward, false);
+	m_starts.init(reverse, true);
+
+	Literals found = literals(nodes, root);
+	m_literal = found.exact ? found.text : found.required;
+}
+
+bool Regex::search(std::string_view text) const
+{
+	if (!valid()) {
+		return false;
+	}
+	if (text.empty()) {
+		return m_search.matchesEmpty();
+	}
+	int state = m_search.start(true);
+	if (m_search.match(state)) {
+		return true;
+	}
+	// Patterns anchored with ^ die once past the beginning
+	for (char c : text) {
+		state = m_search.next(state, static_cast<uint8_t>(c));
+		if (m_search.match(state)) {
+			return true;
+		}
+		if (m_search.dead(state)) {
+			return false;
+		}
+	}
+	return m_search.matchAtEnd(state);
+}
+
+size_t Regex::findAll(std::string_view text, size_t from, size_t to, std::vector<RegexMatch>& matches) const
+{
+	size_t size = text.size();
+	to = std::min(to, size);
+	if (!valid() || from >= to) {
+		return std::max(from, to);
+	}
+
+	// Scanning the reversed pattern back from the end of the line marks
+	// every position a match starts at. The reversed text begins where the
+	// line ends.
+	m_startPositions.assign(size + 1, 0);
+	int state = m_starts.start(true);
+	m_startPositions[size] = size == 0 ? m_starts.matchAtEnd(state) : m_starts.match(state);
+	for (size_t i = size; i-- > from;) {
+		state = m_starts.next(state, static_cast<uint8_t>(text[i]));
+		m_startPositions[i] = i == 0 ? m_starts.matchAtEnd(state) : m_starts.match(state);
+	}
+
+	// Then each match is the longest from the first start after the last.
+	// Scanning on until the anchored DFA dies can pass far beyond where the
+	// match ends, so once the budget is spent matches end at the first
+	// end found, keeping the whole call linear.
+	size_t budget = REGEX_LONGEST_SCAN_FACTOR * std::max<size_t>(to - from, REGEX_MIN_LONGEST_SCAN);
+	for (size_t start = from; start < to; ++start) {
+		if (start < from || !m_startPositions[start]) {
+			continue;
+		}
+		size_t end = start;
+		bool matched = m_ends.match(state = m_ends.start(start == 0));
+		for (size_t i = start; i < size && !(matched && budget == 0); ++i) {
+			budget -= budget > 0;
+			state = m_ends.next(state, static_cast<uint8_t>(text[i]));
+			if (m_ends.dead(state)) {
+				break;
+			}
+			if (i + 1 == size ? m_ends.matchAtEnd(state) : m_ends.match(state)) {
+				end = i + 1;
+				matched = true;
+			}
+		}
+		// Empty matches have nothing to highlight
+		if (end > start) {
+			matches.push_back({static_cast<uint32_t>(start), static_cast<uint32_t>(end - start)});
+			from = end;
+		}
+	}
+	return std::max(from, to);
+}
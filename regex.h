@@ -0,0 +1,127 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// States each lazily built DFA keeps. Past this its cache is emptied and
+// states are built again as they are reached.
+#define REGEX_MAX_DFA_STATES 2048
+
+// Instructions in a compiled pattern, which bounds counted repeats
+#define REGEX_MAX_PROGRAM_SIZE 20000
+
+// Largest count in a {n,m} repeat
+#define REGEX_MAX_REPEAT 1000
+
+// Bytes Regex::findAll() may scan looking for the longest end of each
+// match, per byte of the range it searches, and at least
+// REGEX_MIN_LONGEST_SCAN. Bounds patterns like a|a[^y]*y on a long line of
+// a's, which would otherwise scan to the end of the line from every a.
+// Past it, matches end at the first end found.
+#define REGEX_LONGEST_SCAN_FACTOR 8
+#define REGEX_MIN_LONGEST_SCAN 4096
+
+struct RegexProgram;
+
+// Where a match is in the text, in bytes
+struct RegexMatch {
+	uint32_t start, size;
+};
+
+// A DFA built from a RegexProgram as text is matched. States are sets of
+// NFA instructions, and each transition is worked out the first time it is
+// taken, so matching is linear in the text without building every state.
+class RegexDfa {
+public:
+	// An unanchored DFA finds matches starting anywhere, as if the pattern
+	// began with .*
+	void init(std::shared_ptr<const RegexProgram> program, bool unanchored);
+
+	// The state before any text. ^ only matches at the beginning.
+	int start(bool atBeginning);
+
+	// The state after byte. May empty the cache, so older states are
+	// invalid afterwards.
+	int next(int state, uint8_t byte);
+
+	// True if a match ends here, or would if the text ended here
+	bool match(int state) const { return m_states[state].match; }
+	bool matchAtEnd(int state) const { return m_states[state].matchAtEnd; }
+
+	// True if the pattern matches empty text
+	bool matchesEmpty();
+
+	// True if no match can continue from here
+	bool dead(int state) const { return m_states[state].pcs.empty(); }
+
+private:
+	struct State {
+		std::vector<uint32_t> pcs;
+		bool match;
+		bool matchAtEnd;
+	};
+
+	void closure(uint32_t pc, bool atBeginning, bool atEnd, std::vector<uint32_t>& pcs);
+	int intern(std::vector<uint32_t>& pcs);
+
+	std::shared_ptr<const RegexProgram> m_program;
+	bool m_unanchored = false;
+	std::vector<State> m_states;
+	std::map<std::vector<uint32_t>, int> m_ids;
+
+	// Next state by state and byte class, or -1 until first taken
+	std::vector<int32_t> m_next;
+	int m_start[2] = {-1, -1};
+	unsigned m_resets = 0;
+
+	// Scratch space for closures
+	std::vector<uint32_t> m_stack;
+	std::vector<uint8_t> m_seen;
+	std::vector<uint32_t> m_pcs;
+};
+
+// A regular expression over bytes, matched by lazily built DFAs, so no
+// pattern backtracks and matching is linear in the line. Supports
+// literals, ., [classes], \d \w \s and their negations, ^ and $ at the
+// ends of the line, groups, | and the * + ? {n,m} repeats. Matches are
+// leftmost-longest. Each Regex caches its own DFA states, so threads each
+// need a copy.
+class Regex {
+public:
+	Regex(std::string_view pattern = std::string_view());
+
+	// Empty if the pattern compiled. An invalid pattern matches nothing.
+	const std::string& error() const { return m_error; }
+	bool valid() const { return m_error.empty(); }
+
+	// A substring every match contains, as long as could be found, for
+	// rejecting lines before running a DFA. May be empty.
+	const std::string& literal() const { return m_literal; }
+
+	// True if there is a match anywhere in text
+	bool search(std::string_view text) const;
+
+	// Appends the position of every non-empty match in text that starts in
+	// [from, to), in order, and returns where the next match could start.
+	// Each match is the leftmost-longest after the one before it, and
+	// finding their starts scans back from the end of text.
+	size_t findAll(std::string_view text, size_t from, size_t to, std::vector<RegexMatch>& matches) const;
+
+private:
+	std::string m_error;
+	std::string m_literal;
+
+	// Finds whether a line matches
+	mutable RegexDfa m_search;
+
+	// The reversed pattern, scanning back from the end of a line to find
+	// where matches start, and then the pattern anchored at each start to
+	// find where the longest match ends
+	mutable RegexDfa m_starts;
+	mutable RegexDfa m_ends;
+	mutable std::vector<uint8_t> m_startPositions;
+};
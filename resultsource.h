@@ -0,0 +1,69 @@
+#pragma once
+#include "history.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+// Matches for one pattern, as published by a ResultSource. Never modified
+// once published, so it can be read without locking.
+struct FilterResults {
+	uint64_t generation;
+	std::string pattern;
+	MatchMode mode;
+	HistoryItems items;
+
+	// The oldest matches, oldest first, if asked for. Empty when complete.
+	HistoryItems oldest;
+
+	// True if items holds every match
+	bool complete;
+
+	// History::revision() when published. Lines appended to the history
+	// change the results without starting a new generation.
+	uint64_t revision;
+
+	// The file items view, kept mapped after the history is reloaded.
+	// Null for results without one.
+	std::shared_ptr<const HistoryFile> file;
+};
+
+// Searches the history in the background for Screen. Each new pattern bumps
+// a generation counter, and results for older generations are ignored.
+// Results are either found in this process by a FilterWorker, or asked of a
+// shist --daemon by a DaemonClient.
+class ResultSource {
+public:
+	virtual ~ResultSource() = default;
+
+	// Start searching for the first count results of a new pattern or mode,
+	// abandoning any current search
+	virtual void setFilter(const std::string& pattern, MatchMode mode, size_t count) = 0;
+
+	// Ask for at least count results for the current pattern
+	virtual void request(size_t count) = 0;
+
+	// Ask for at least count of the oldest results for the current pattern
+	virtual void requestOldest(size_t count) = 0;
+
+	virtual uint64_t generation() const = 0;
+
+	// An eventfd that becomes readable when results are published, for
+	// waiting on alongside input. Read it to reset it.
+	virtual int notifyFd() const = 0;
+
+	// The latest published results, possibly for an older generation.
+	// Null until the first results are published.
+	virtual std::shared_ptr<const FilterResults> results() const = 0;
+
+	// Block until the current pattern has at least count results and
+	// oldestCount of the oldest results, or all of them. Returns null if
+	// the source disconnects first.
+	virtual std::shared_ptr<const FilterResults> wait(size_t count, size_t oldestCount = 0) = 0;
+
+	// True once no more results will be published, because the daemon
+	// exited. notifyFd() becomes readable when it happens. The caller
+	// should search with a FilterWorker instead, asking it again for the
+	// current pattern.
+	virtual bool disconnected() const = 0;
+};
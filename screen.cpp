@@ -1,124 +1,72 @@
 
 
 #include "screen.h"
-#include "history.h"
+#include "daemonclient.h"
+#include "filterworker.h"
 #include "input.h"
+#include "trace.h"
 #include <ncurses.h>
 #include <assert.h>
 #include <string>
 #include <memory>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 
 #include <readline/readline.h>
 
-struct LinePart {
-	std::string text;
-	int colour;
-	int scoreMultiplier;
-
-	enum Type {
-		UNIQUE,
-		START,
-		END,
-		MATCH,
-		COMMON,
-	};
-
-	Type type;
-
-	LinePart(const char *str, size_t start, size_t len, int partColour, Type partType)
-		: text(str, start, len), colour(partColour), type(partType)
-	{
-	}
-
-	int score() const
-	{
-		// Desirable score features:
-		// - Show the matches in the string
-		// - Show the start of differences between adjacent strings
-		// - Show the start of the string
-		// - Show the end of the string
-		// - Hide long common substrings
-
-		switch (type) {
-		case UNIQUE: return text.size() * 2;
-		case START: return text.size();
-		case END: return text.size();
-		case MATCH: return 0;
-		case COMMON: return text.size() * 4;
-		}
-
-		assert(!"Invalid type");
-	}
-
-	size_t collapse(size_t numCharsToRemove)
-	{
-		const std::string replaceWith = "...";
-
-		size_t contextChars = 1;
-		if (text.size() > numCharsToRemove + replaceWith.size()) {
-			contextChars = (text.size() - replaceWith.size() - numCharsToRemove) / 2;
-		}
-
-		const size_t minRemoveChars = replaceWith.size() + contextChars * 2;
-
-		if (text.size() <= minRemoveChars) {
-			return 0;
-		}
-
-		numCharsToRemove = std::min(numCharsToRemove, text.size() - minRemoveChars);
-		text = text.substr(0, text.size() - numCharsToRemove - replaceWith.size() - contextChars) + replaceWith + text.substr(text.size() - contextChars, contextChars);
-		return numCharsToRemove;
-	}
-};
-
-struct LineText {
-	std::vector<LinePart> parts;
-	size_t size;
-	int score;
-
-	void update()
-	{
-		score = 0;
-		size = 0;
-		for (size_t i = 0; i < parts.size(); ++i) {
-			size += parts[i].text.size();
-			score += parts[i].score();;
-		}
+static const char* promptFor(MatchMode mode)
+{
+	switch (mode) {
+	case MATCH_FUZZY:
+		return "~ ";
+	case MATCH_REGEX:
+		return "/ ";
+	default:
+		return "$ ";
 	}
-};
+}
 
-Screen::Screen()
-	: m_history(std::make_unique<History>())
-	, m_promptLine(0)
+Screen::Screen(MatchMode mode, bool useDaemon)
+	: m_promptLine(0)
 	, m_histLineTop(0)
 	, m_histLineCount(0)
 	, m_histScroll(0)
-	, m_prompt("$ ")
+	, m_prompt(promptFor(mode))
 	, m_pattern("")
+	, m_mode(mode)
 	, m_cursor(0)
 	, m_selection(0)
 {
+	// A daemon already has the history loaded and indexed
+	std::string historyFilename = History::defaultFilename();
+	if (useDaemon) {
+		m_source = DaemonClient::connect(historyFilename);
+	}
+	if (!m_source) {
+		m_history = std::make_unique<History>(historyFilename);
+		m_source = std::make_unique<FilterWorker>(*m_history);
+	}
 
 	// start curses mode
+	TRACE_SCOPE("ncurses init");
 	if(!isatty(fileno(stdout))) {
 		// Handle the case when stdout has been redirected.
 		// https://stackoverflow.com/questions/17450014/ncurses-program-not-working-correctly-when-used-for-command-substitution
 		// https://stackoverflow.com/questions/8371877/ncurses-and-linux-pipeline
-		FILE* out = stdout;
-		out = fopen("/dev/tty", "w");
-
-		// Should really test `out` to make sure that worked.
-		setbuf(out, NULL);
-
-		// Here, we don't worry about the case where stdin has been
-		// redirected, but we could do something similar to out
-		// for input, opening "/dev/tty" in mode "r" for in if necessary.
-		m_newtermScreen = newterm(NULL, out, stdin);
+		m_out = m_frame.open(::open("/dev/tty", O_WRONLY | O_CLOEXEC));
 	} else {
-		initscr();
+		m_out = m_frame.open(dup(fileno(stdout)));
+	}
+	if (!m_out) {
+		throw std::runtime_error("Failed to open the terminal for output");
 	}
 
+	// Here, we don't worry about the case where stdin has been
+	// redirected, but we could do something similar to out
+	// for input, opening "/dev/tty" in mode "r" for in if necessary.
+	m_newtermScreen = newterm(NULL, m_out, stdin);
+
 	if (has_colors()) {
 		start_color();
 		use_default_colors();
@@ -126,12 +74,20 @@ Screen::Screen()
 	}
 	cbreak();
 	noecho();
+
+	// ncurses flushes after each row to check for typeahead, which would
+	// split a frame into a write per row
+	typeahead(-1);
 	nonl();
 	intrflush(NULL, FALSE);
 
+	// Input is read when poll() says it's there
+	nodelay(stdscr, TRUE);
+
 //	keypad(stdscr, TRUE);
 
 	onResize();
+	m_source->setFilter(m_pattern, m_mode, 2 * m_histLineCount);
 }
 
 Screen::~Screen()
@@ -141,12 +97,23 @@ Screen::~Screen()
 	if (m_newtermScreen) {
 		delscreen(reinterpret_cast<SCREEN*>(m_newtermScreen));
 	}
+	if (m_out) {
+		fclose(m_out);
+	}
+
+	if (m_frame.statsEnabled()) {
+		const FrameStats& stats = m_frame.stats();
+		fprintf(stderr, "shist: %llu keystrokes, %llu frames, %llu bytes in %llu writes, %.1f bytes per keystroke\n",
+			(unsigned long long)m_keystrokes, (unsigned long long)stats.frames,
+			(unsigned long long)stats.bytes, (unsigned long long)stats.writes,
+			m_keystrokes ? double(stats.bytes) / m_keystrokes : 0.0);
+	}
 }
 
 void Screen::onPostDraw()
 {
 	move(m_promptLine, m_prompt.size() + m_cursor);
-	refresh();
+	m_frame.present();
 }
 
 void Screen::onResize()
@@ -162,6 +129,7 @@ void Screen::onResize()
 	m_histLineTop = top;
 	m_histLineCount = bottom - top;
 
+	m_frame.reset(LINES, COLS);
 	drawHistory();
 	drawPrompt();
 	onPostDraw();
@@ -172,145 +140,296 @@ std::pair<size_t, size_t> longestCommonSubstring(const std::string& a, const std
 
 }
 
-LineText fitLine(LineText line, size_t maxWidth, size_t startPart = 0)
+int Screen::historyItemToLine(int itemIndex)
 {
-	while (line.size > maxWidth) {
-		LineText best = line;
-		size_t charsToRemove = line.size - maxWidth;
-		for (size_t i = startPart; i < line.parts.size(); ++i) {
-			LineText tmp = line;
-			size_t charsRemoved = tmp.parts[i].collapse(charsToRemove);
-			tmp.update();
-			if (tmp.score < best.score) {
-				best = tmp;
-			}
-		}
-		if (line.score == best.score) {
-			// Line cannot be made any shorter
-			return line;
-		}
-		line = best;
-	}
-	return line;
+	return m_histLineTop +
+		m_histLineCount - (itemIndex - m_histScroll) - 1;
 }
 
-LineText makeLineFromHistory(const HistoryItem& item)
+const LineText& Screen::layoutFor(const HistoryItem& item, size_t width)
 {
-	LineText lineText;
-	size_t lastPos = 0;
-	size_t lineLen = strlen(item.line);
-
-	// TODO: split line into common substrings
-
-	LinePart::Type previousType = LinePart::START;
-	for (auto& match : item.matches) {
-		// Add bits between lastPos and each match
-		lineText.parts.push_back(LinePart(item.line, lastPos, match.start - lastPos, 0, previousType));
-
-		// Add the matches
-		lineText.parts.push_back(LinePart(item.line, match.start, match.size, 1, LinePart::MATCH));
-		lastPos = match.start + match.size;
-
-		previousType = LinePart::UNIQUE;
+	if (width != m_layoutWidth || m_results != m_layoutResults || m_layouts.size() >= SCREEN_LAYOUT_CACHE_LINES) {
+		m_layouts.clear();
+		m_layoutWidth = width;
+		m_layoutResults = m_results;
 	}
 
-	// Add any remainder
-	if (lastPos	< lineLen) {
-		lineText.parts.push_back(LinePart(item.line, lastPos, lineLen - lastPos, 0, LinePart::END));
+	auto found = m_layouts.find(item.index);
+	if (found != m_layouts.end()) {
+		return found->second;
 	}
-
-	// Compute the total size etc.
-	lineText.update();
-
+	TRACE_SCOPE("fitLine");
+	History::itemMatches(item, m_results->pattern, m_results->mode, m_matches);
+	LineText& lineText = m_layouts[item.index];
+	lineText = makeLineFromHistory(item, m_matches);
+	fitLine(lineText, width);
 	return lineText;
 }
 
-int Screen::historyItemToLine(int itemIndex)
-{
-	return m_histLineTop +
-		m_histLineCount - (itemIndex - m_histScroll) - 1;
-}
-
 void Screen::drawHistoryItem(const HistoryItem *item, int line)
 {
-	move(line, 0);
+	m_frame.beginRow();
 	if (item) {
-		size_t width = static_cast<size_t>(getmaxx(stdscr));
+		size_t width = static_cast<size_t>(COLS);
 		bool selLine = line == historyItemToLine(m_selection);
-		std::string prefix(selLine ? "> " : "  ");
-		auto lineText = makeLineFromHistory(*item);
-		lineText = fitLine(lineText, width - prefix.size());
+		std::string_view prefix(selLine ? "> " : "  ");
+		const LineText& lineText = layoutFor(*item, width - prefix.size());
+
+		// Lines with many matches may not collapse to fit. The frame clips
+		// them rather than wrap onto the next row.
+		m_frame.add(prefix, 0);
+		for (const LinePart& part : lineText.parts) {
+			m_frame.add(part.head, part.colour);
+			if (part.collapsed) {
+				m_frame.add(LAYOUT_ELLIPSIS, part.colour);
+				m_frame.add(part.tail, part.colour);
+			}
+		}
+	}
+	m_frame.endRow(line);
+}
 
-		mvaddnstr(line, 0, prefix.c_str(), prefix.size());
+int Screen::resultCount() const
+{
+	return m_results ? (int)m_results->items.size() : 0;
+}
 
-		for (auto& part : lineText.parts) {
-			attrset(COLOR_PAIR(part.colour));
-			addnstr(part.text.c_str(), part.text.size());
-		}
+int Screen::oldestCount() const
+{
+	return m_results ? (int)m_results->oldest.size() : 0;
+}
 
-		attrset(COLOR_PAIR(0));
+bool Screen::resultAt(int i, HistoryItem* item) const
+{
+	if (i >= 0 && i < resultCount()) {
+		*item = m_results->items[i];
+		return true;
 	}
-
-	// Clear the rest of the line only if we didn't just wrap by writing to the last column
-	if (getcury(stdscr) == line) {
-		clrtoeol();
+	if (i < 0 && -i <= oldestCount()) {
+		*item = m_results->oldest[-i - 1];
+		return true;
 	}
+	return false;
 }
 
 void Screen::drawHistory()
 {
-	int count;
-	const HistoryItem* items;
-
-	// Request enough history to fill the screen
+	TRACE_SCOPE("Screen::drawHistory");
+	// Read ahead a page so scrolling finds results already waiting
 	int topOfScreen = m_histScroll + m_histLineCount;
-	m_history->getItems(topOfScreen, &count, &items);
+	if (m_histScroll < 0) {
+		m_source->requestOldest(m_histLineCount - m_histScroll);
+	} else {
+		m_source->request(topOfScreen + m_histLineCount);
+	}
 
-	int maxItem = std::min(count, topOfScreen);
 	for (int i = m_histScroll; i < topOfScreen; ++i) {
-		int line = historyItemToLine(i);
-		drawHistoryItem(i < count ? &items[i] : NULL, line);
+		HistoryItem item;
+		drawHistoryItem(resultAt(i, &item) ? &item : NULL, historyItemToLine(i));
 	}
 }
 
 void Screen::drawPrompt()
 {
-	mvprintw(m_promptLine, 0, "%s%s", m_prompt.c_str(), m_pattern.c_str());
-	clrtoeol();
+	m_frame.beginRow();
+	m_frame.add(m_prompt, 0);
+	m_frame.add(m_pattern, 0);
+	m_frame.endRow(m_promptLine);
 }
 
-const char *Screen::selection()
+std::string_view Screen::selection()
 {
-	int count;
-	const HistoryItem* items;
-	m_history->getItems(0, &count, &items);
-	if (count == 0) {
-		return NULL;
-	}
-	assert(m_selection >= 0 && m_selection < count);
-	return items[m_selection].line;
+	// The user may finish before the search does. Wait for results that
+	// match the final pattern.
+	std::shared_ptr<const FilterResults> results;
+	while (!(results = m_selection < 0 ? m_source->wait(0, -m_selection) : m_source->wait(m_selection + 1))) {
+		fallBack();
+	}
+	m_results = results;
+	if (m_selection < 0 && m_results->complete) {
+		m_selection += resultCount();
+	}
+	if (m_selection >= 0) {
+		m_selection = std::min(m_selection, resultCount() - 1);
+	}
+	HistoryItem item;
+	if (!resultAt(m_selection, &item)) {
+		return std::string_view();
+	}
+	return item.line;
 }
 
 void Screen::setFilter(const char *pattern, int cursor)
 {
-	// TODO: ideally don't call this if it hasn't changed
+	TRACE_SCOPE("Screen::setFilter");
 	if (m_pattern == pattern && m_cursor == cursor) {
 		return;
 	}
 
+	// Only the cursor moved
+	if (m_pattern == pattern) {
+		m_cursor = cursor;
+		drawPrompt();
+		onPostDraw();
+		return;
+	}
+
 	m_histScroll = 0;
 	m_selection = 0;
+	m_selectLastPending = false;
 	m_pattern = pattern;
 	m_cursor = cursor;
 
-	m_history->filter(pattern);
-	drawHistory();
+	// The history list is redrawn by update() when results arrive, so the
+	// prompt never waits for the search
+	m_source->setFilter(m_pattern, m_mode, 2 * m_histLineCount);
+	drawPrompt();
+	onPostDraw();
+}
+
+void Screen::toggleMode()
+{
+	m_mode = m_mode == MATCH_EXACT ? MATCH_FUZZY : m_mode == MATCH_FUZZY ? MATCH_REGEX : MATCH_EXACT;
+	m_prompt = promptFor(m_mode);
+	m_histScroll = 0;
+	m_selection = 0;
+	m_selectLastPending = false;
+	m_source->setFilter(m_pattern, m_mode, 2 * m_histLineCount);
 	drawPrompt();
 	onPostDraw();
 }
 
+int Screen::resultsFd() const
+{
+	return m_source->notifyFd();
+}
+
+void Screen::fallBack()
+{
+	TRACE_SCOPE("Screen::fallBack");
+	// The daemon's results stay drawn until the first ones found here
+	// replace them. Ask again for as many as were being shown.
+	m_history = std::make_unique<History>(History::defaultFilename());
+	m_source = std::make_unique<FilterWorker>(*m_history);
+	m_source->setFilter(m_pattern, m_mode, std::max(m_histScroll, 0) + 2 * m_histLineCount);
+	if (m_histScroll < 0 || m_selectLastPending) {
+		m_source->requestOldest(std::max(m_histLineCount - m_histScroll, 2 * m_histLineCount));
+	}
+}
+
+void Screen::resize()
+{
+	struct winsize size;
+	if (ioctl(fileno(m_out), TIOCGWINSZ, &size) == 0) {
+		resizeterm(size.ws_row, size.ws_col);
+	}
+	onResize();
+}
+
+bool Screen::settled() const
+{
+	if (!m_results || m_results != m_source->results() || m_results->generation != m_source->generation()) {
+		return false;
+	}
+	if (m_results->complete) {
+		return true;
+	}
+	if (m_selectLastPending) {
+		return false;
+	}
+	if (m_histScroll < 0) {
+		return oldestCount() >= -m_histScroll;
+	}
+	return resultCount() >= m_histScroll + m_histLineCount;
+}
+
+void Screen::update()
+{
+	TRACE_SCOPE("Screen::update");
+	uint64_t published;
+	if (read(resultsFd(), &published, sizeof(published)) < 0) {
+		// Nothing new since the last call, though results may still differ
+	}
+	if (m_source->disconnected()) {
+		fallBack();
+		return;
+	}
+
+	std::shared_ptr<const FilterResults> results = m_source->results();
+	if (!results || results == m_results || results->generation != m_source->generation()) {
+		return;
+	}
+
+	// Lines appended by other shells move the results around. The selected
+	// line stays selected, even if a new copy of it replaced it.
+	HistoryItem selected;
+	std::shared_ptr<const FilterResults> previous = m_results;
+	bool follow = previous && previous->generation == results->generation &&
+		previous->revision != results->revision && m_selection >= 0 && resultAt(m_selection, &selected);
+	m_results = results;
+	if (follow) {
+		int found = -1;
+		for (size_t i = 0; i < m_results->items.size() && found < 0; ++i) {
+			if (m_results->items.index(i) == selected.index) {
+				found = static_cast<int>(i);
+			}
+		}
+		for (size_t i = 0; i < m_results->items.size() && found < 0; ++i) {
+			if (m_results->items[i].line == selected.line) {
+				found = static_cast<int>(i);
+			}
+		}
+		if (found >= 0) {
+			m_selection = found;
+		}
+		scrollToSelection(false);
+	}
+
+	// Once the searches meet, results counted from the oldest get indices
+	int count = resultCount();
+	if (m_selection < 0 && m_results->complete) {
+		m_selection += count;
+		m_histScroll += count;
+		scrollToSelection(false);
+	}
+	if (m_selectLastPending && (m_results->complete || oldestCount())) {
+		m_selectLastPending = false;
+		m_selection = m_results->complete ? count - 1 : -1;
+		scrollToSelection(false);
+	}
+	if (m_selection >= 0) {
+		m_selection = std::max(0, std::min(m_selection, count - 1));
+	} else {
+		m_selection = std::max(m_selection, -oldestCount());
+	}
+
+	drawHistory();
+	onPostDraw();
+}
+
+void Screen::scrollToSelection(bool pages)
+{
+	int count = resultCount();
+	int margin = pages ? std::min(m_histLineCount / 2, 5) : 0;
+
+	// Counting from the oldest, -1 is the top row and the unsearched middle
+	// of the history is off the bottom
+	if (m_selection < 0) {
+		int scrollMax = std::min(-m_histLineCount, m_selection - margin);
+		int scrollMin = m_selection + 1 - m_histLineCount + margin;
+		m_histScroll = std::min(std::max(m_histScroll, scrollMin), scrollMax);
+		return;
+	}
+
+	// Scroll must keep the selection visible
+	int scrollMax = std::max(0, std::min(count - m_histLineCount, m_selection - margin));
+	int scrollMin = std::min(count - 1, std::max(0, m_selection + 1 - m_histLineCount + margin));
+	m_histScroll = std::min(std::max(m_histScroll, scrollMin), scrollMax);
+}
+
 void Screen::moveSelection(int i, bool pages, bool wrap)
 {
+	TRACE_SCOPE("Screen::moveSelection");
 	int lastSelection = m_selection;
 
 	// Move the selection
@@ -321,59 +440,76 @@ void Screen::moveSelection(int i, bool pages, bool wrap)
 		m_selection = m_histScroll + ((m_selection - m_histScroll + m_histLineCount) % m_histLineCount);
 	}
 
-	// Request history up to the new selection. Will mostly just get cached results.
-	int count;
-	const HistoryItem* items;
-	m_history->getItems(m_selection + 1, &count, &items);
-	if (!count) {
+	int count = resultCount();
+	int oldest = oldestCount();
+	if (!count && !oldest) {
 		m_selection = 0;
 		return;
 	}
 
-	// Wrap between top/bottom of history
-	if (m_selection >= count) {
+	// Wrap between top/bottom of history. Until the search is complete,
+	// stop at the last result so far while more are fetched. Wrapping to
+	// the oldest result searches forwards from the oldest line, and results
+	// found that way are counted back from -1 until the searches meet.
+	if (lastSelection >= 0) {
+		if (m_selection >= count) {
+			assert(!wrap);
+			if (m_results->complete) {
+				m_selection = 0;
+			} else {
+				m_selection = std::max(0, count - 1);
+				m_source->request(count + m_histLineCount);
+			}
+		}
+		if (m_selection < 0) {
+			if (m_results->complete) {
+				m_selection = count - 1;
+			} else if (oldest) {
+				m_selection = -1;
+			} else {
+				m_selection = lastSelection;
+				m_selectLastPending = true;
+				m_source->requestOldest(2 * m_histLineCount);
+				return;
+			}
+		}
+	} else if (m_selection >= 0) {
 		assert(!wrap);
 		m_selection = 0;
-	}
-	if (m_selection < 0) {
-		// Need to request all of the history :(
-		// TODO: Ideally we start searching backwards instead
-		m_history->getItems(9999999, &count, &items);
-		m_selection = count - 1;
+	} else if (m_selection < -oldest) {
+		m_selection = -oldest;
+		m_source->requestOldest(oldest + m_histLineCount);
 	}
 
 	if (m_selection < m_histScroll ||
 		m_selection >= m_histScroll +
 		m_histLineCount) {
 		assert(!wrap);
-		//scroll_to(m_selection);
-		int margin = pages ? std::min(m_histLineCount / 2, 5) : 0;
-
-		// Scroll must keep the selection visible
-		int scrollMax = std::max(0, std::min(count - m_histLineCount, m_selection - margin));
-		int scrollMin = std::min(count - 1, std::max(0, m_selection + 1 - m_histLineCount + margin));
-		m_histScroll = std::min(std::max(m_histScroll, scrollMin), scrollMax);
-
+		scrollToSelection(pages);
 		drawHistory();
 		onPostDraw();
 	} else if (lastSelection != m_selection) {
 		// Optimization - only need to re-render the previous and currently selected lines
-		drawHistoryItem(&items[lastSelection],
-			historyItemToLine(lastSelection));
-		drawHistoryItem(&items[m_selection],
-			historyItemToLine(m_selection));
+		HistoryItem last;
+		HistoryItem selected;
+		drawHistoryItem(resultAt(lastSelection, &last) ? &last : NULL, historyItemToLine(lastSelection));
+		drawHistoryItem(resultAt(m_selection, &selected) ? &selected : NULL, historyItemToLine(m_selection));
 		onPostDraw();
 	}
 }
-
-int Screen::getChar()
+bool Screen::getChar(int* c)
 {
-	int c;
 	// Consume screen related actions first
 	while (true) {
-		c = wgetch(stdscr);
+		*c = wgetch(stdscr);
+		if (*c == ERR) {
+			return false;
+		}
+		if (*c != KEY_RESIZE) {
+			++m_keystrokes;
+		}
 
-		switch (c) {
+		switch (*c) {
 		case KEY_RESIZE:
 			onResize();
 			break;
@@ -390,7 +526,7 @@ int Screen::getChar()
 			moveSelection(-1, false, true);
 			break;
 		default:
-			return c;
+			return true;
 		}
 	}
 
@@ -1,38 +1,106 @@
 #pragma once
 
+#include "frame.h"
+#include "history.h"
+#include "layout.h"
 #include <string>
+#include <string_view>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
-class History;
-struct HistoryItem;
+// Most fitted lines kept before the layout cache is emptied
+#define SCREEN_LAYOUT_CACHE_LINES 4096
+
+class ResultSource;
+struct FilterResults;
 
 class Screen {
 public:
-	Screen();
+	// Results come from a daemon if useDaemon and one is running, and are
+	// searched for in process otherwise
+	Screen(MatchMode mode, bool useDaemon);
 	~Screen();
-	int getChar();
-	const char* selection();
+	// Next input character. Returns false if there is none waiting.
+	bool getChar(int* c);
+	std::string_view selection();
 	void moveSelection(int i, bool pages, bool wrap);
 	void setFilter(const char* pattern, int cursor);
 
+	// Cycle through exact, fuzzy and regex matching
+	void toggleMode();
+
+	// Redraw if the ResultSource has published new results
+	void update();
+
+	// Readable when update() has new results to show. Changes if the
+	// daemon exits and update() falls back to searching in process.
+	int resultsFd() const;
+
+	// Adopt the terminal's new size, e.g. after SIGWINCH
+	void resize();
+
+	// True once the latest results for the current pattern are drawn and
+	// fill the visible rows, or are all there are. Lets a keystroke be
+	// timed until the screen stops changing.
+	bool settled() const;
+
 private:
 
 	void onPostDraw();
 	void onResize();
 	int historyItemToLine(int itemIndex);
+	const LineText& layoutFor(const HistoryItem& item, size_t width);
 	void drawHistoryItem(const HistoryItem *item, int line);
 	void drawHistory();
 	void drawPrompt();
+	void scrollToSelection(bool pages);
+	int resultCount() const;
+	int oldestCount() const;
+
+	// Load the history and search it in process when the daemon has gone.
+	// Throws NoHistoryException if it can't be read.
+	void fallBack();
 
+	// Result i, counting from the newest. While the search is incomplete,
+	// negative indices count back from the oldest, which is -1.
+	bool resultAt(int i, HistoryItem* item) const;
+
+	// Only loaded here when there's no daemon to ask, or it exited
 	std::unique_ptr<History> m_history;
+	std::unique_ptr<ResultSource> m_source;
+	std::shared_ptr<const FilterResults> m_results;
+
+	// Scratch space for the matches of the line being drawn
+	std::vector<LineRange> m_matches;
+
+	// Fitted lines by history line index, so moving the selection or
+	// redrawing never refits a row. Only valid for one width and the
+	// results whose lines they point into, which may be copies received
+	// from a daemon.
+	std::unordered_map<uint32_t, LineText> m_layouts;
+	size_t m_layoutWidth = 0;
+	std::shared_ptr<const FilterResults> m_layoutResults;
 	int m_promptLine;
 	int m_histLineTop;
 	int m_histLineCount;
 	int m_histScroll;
 	std::string m_prompt;
 	std::string m_pattern;
+	MatchMode m_mode;
 	int m_cursor = 0;
 	int m_selection = 0;
+
+	// Select the oldest result once it has been found
+	bool m_selectLastPending = false;
 	void* m_newtermScreen = nullptr;
+	FILE* m_out = nullptr;
+
+	// Rows on the terminal, so redraws only send what changed
+	Frame m_frame;
+
+	// Input characters read, for SHIST_STATS. Each character of an escape
+	// sequence counts.
+	uint64_t m_keystrokes = 0;
 };
 
@@ -0,0 +1,160 @@
+#include "substring.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SUBSTRING_X86 1
+#endif
+
+// Vector versions compare the needle's first and last bytes against a
+// block of candidate positions at once, and only run memcmp() on the
+// positions where both match. See "SIMD-friendly algorithms for substring
+// searching", Wojciech Muła.
+
+const char* findSubstringScalar(const char* haystack, size_t size, const char* needle, size_t needleSize)
+{
+	if (needleSize == 0) {
+		return haystack;
+	}
+	if (needleSize > size) {
+		return nullptr;
+	}
+	const char* last = haystack + size - needleSize;
+	for (const char* p = haystack; p <= last; ++p) {
+		p = static_cast<const char*>(memchr(p, needle[0], last - p + 1));
+		if (!p) {
+			return nullptr;
+		}
+		if (memcmp(p + 1, needle + 1, needleSize - 1) == 0) {
+			return p;
+		}
+	}
+	return nullptr;
+}
+
+#if SUBSTRING_X86
+
+// Reading a whole block past the end of the haystack is safe as long as it
+// doesn't cross into the next page, which may not be mapped. Bits for
+// positions past the end are masked off.
+static inline bool blockInPage(const char* p, size_t blockSize)
+{
+	return (reinterpret_cast<uintptr_t>(p) & 4095) <= 4096 - blockSize;
+}
+
+// The first and last bytes are already known to match. Short needles are
+// compared inline, as a call to memcmp() costs more than the compare.
+static inline bool middleMatches(const char* candidate, const char* needle, size_t needleSize)
+{
+	if (needleSize <= 10) {
+		for (size_t i = 1; i + 1 < needleSize; ++i) {
+			if (candidate[i] != needle[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+	return memcmp(candidate + 1, needle + 1, needleSize - 2) == 0;
+}
+
+static inline unsigned validPositionMask(size_t remaining, size_t blockSize)
+{
+	return remaining >= blockSize ? ~0u : (1u << remaining) - 1;
+}
+
+static const char* findSubstringSSE2(const char* haystack, size_t size, const char* needle, size_t needleSize)
+{
+	if (needleSize < 2 || needleSize > size) {
+		return findSubstringScalar(haystack, size, needle, needleSize);
+	}
+
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needleSize - 1]);
+	const size_t positions = size - needleSize + 1;
+	for (size_t i = 0; i < positions; i += 16) {
+		const char* blockFirst = haystack + i;
+		const char* blockLast = blockFirst + needleSize - 1;
+		if (positions - i < 16 && (!blockInPage(blockFirst, 16) || !blockInPage(blockLast, 16))) {
+			return findSubstringScalar(blockFirst, size - i, needle, needleSize);
+		}
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(first, _mm_loadu_si128(reinterpret_cast<const __m128i*>(blockFirst))),
+			_mm_cmpeq_epi8(last, _mm_loadu_si128(reinterpret_cast<const __m128i*>(blockLast))))));
+		mask &= validPositionMask(positions - i, 16);
+		while (mask) {
+			size_t pos = __builtin_ctz(mask);
+			if (middleMatches(blockFirst + pos, needle, needleSize)) {
+				return blockFirst + pos;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return nullptr;
+}
+
+__attribute__((target("avx2")))
+static const char* findSubstringAVX2(const char* haystack, size_t size, const char* needle, size_t needleSize)
+{
+	if (needleSize < 2 || needleSize > size) {
+		return findSubstringScalar(haystack, size, needle, needleSize);
+	}
+
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needleSize - 1]);
+	const size_t positions = size - needleSize + 1;
+	for (size_t i = 0; i < positions; i += 32) {
+		const char* blockFirst = haystack + i;
+		const char* blockLast = blockFirst + needleSize - 1;
+		if (positions - i < 32 && (!blockInPage(blockFirst, 32) || !blockInPage(blockLast, 32))) {
+			return findSubstringSSE2(blockFirst, size - i, needle, needleSize);
+		}
+		unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(first, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blockFirst))),
+			_mm256_cmpeq_epi8(last, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(blockLast))))));
+		mask &= validPositionMask(positions - i, 32);
+		while (mask) {
+			size_t pos = __builtin_ctz(mask);
+			if (middleMatches(blockFirst + pos, needle, needleSize)) {
+				return blockFirst + pos;
+			}
+			mask &= mask - 1;
+		}
+	}
+	return nullptr;
+}
+
+#endif
+
+typedef const char* (*FindSubstringFunction)(const char*, size_t, const char*, size_t);
+
+struct FindSubstringDispatch {
+	FindSubstringFunction function;
+	const char* name;
+};
+
+static FindSubstringDispatch selectFindSubstring()
+{
+#if SUBSTRING_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return {findSubstringAVX2, "avx2"};
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return {findSubstringSSE2, "sse2"};
+	}
+#endif
+	return {findSubstringScalar, "scalar"};
+}
+
+static const FindSubstringDispatch g_findSubstring = selectFindSubstring();
+
+const char* findSubstring(const char* haystack, size_t size, const char* needle, size_t needleSize)
+{
+	return g_findSubstring.function(haystack, size, needle, needleSize);
+}
+
+const char* findSubstringImplementation()
+{
+	return g_findSubstring.name;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <stddef.h>
+
+// Returns the first occurrence of needle in haystack, or nullptr. Neither
+// needs to be null terminated. Uses AVX2 or SSE2 when available, chosen at
+// runtime, with a portable fallback.
+const char* findSubstring(const char* haystack, size_t size, const char* needle, size_t needleSize);
+
+// The portable fallback, exposed for benchmarking
+const char* findSubstringScalar(const char* haystack, size_t size, const char* needle, size_t needleSize);
+
+// Name of the implementation findSubstring() uses on this CPU
+const char* findSubstringImplementation();
@@ -0,0 +1,61 @@
+#include "threadpool.h"
+#include "trace.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads)
+{
+	if (!threads) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < threads; ++i) {
+		m_threads.emplace_back(&ThreadPool::run, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for (std::thread& thread : m_threads) {
+		thread.join();
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push_back(std::move(task));
+	}
+	m_wake.notify_one();
+}
+
+void ThreadPool::wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_idle.wait(lock, [this] { return m_tasks.empty() && !m_running; });
+}
+
+void ThreadPool::run()
+{
+	traceThreadName("pool");
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_wake.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+		if (m_stop) {
+			break;
+		}
+		std::function<void()> task = std::move(m_tasks.front());
+		m_tasks.pop_front();
+		++m_running;
+		lock.unlock();
+		task();
+		lock.lock();
+		if (!--m_running && m_tasks.empty()) {
+			m_idle.notify_all();
+		}
+	}
+}
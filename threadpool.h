@@ -0,0 +1,35 @@
+#pragma once
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads running tasks in submission order
+class ThreadPool {
+public:
+	// Defaults to one thread per core
+	ThreadPool(size_t threads = 0);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	size_t size() const { return m_threads.size(); }
+	void submit(std::function<void()> task);
+
+	// Blocks until every submitted task has finished
+	void wait();
+
+private:
+	void run();
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_idle;
+	std::deque<std::function<void()>> m_tasks;
+	size_t m_running = 0;
+	bool m_stop = false;
+	std::vector<std::thread> m_threads;
+};
@@ -0,0 +1,120 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+std::atomic<bool> g_traceEnabled{false};
+
+namespace {
+
+struct TraceEvent {
+	const char* name;
+	uint64_t begin;
+	uint64_t end;
+	uint32_t tid;
+};
+
+struct TraceThread {
+	uint32_t tid;
+	const char* name;
+};
+
+// Spans from every thread go into one list. The lock is only taken while
+// tracing, and is uncontended next to the work being timed.
+std::mutex g_traceMutex;
+std::vector<TraceEvent> g_traceEvents;
+std::vector<TraceThread> g_traceThreads;
+size_t g_traceDropped = 0;
+std::string g_tracePath;
+uint64_t g_traceStart = 0;
+
+uint32_t currentThread()
+{
+	static thread_local uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+	return tid;
+}
+
+// Threads may still be running at exit. Spans they finish afterwards are
+// ignored.
+void traceWrite()
+{
+	std::lock_guard<std::mutex> lock(g_traceMutex);
+	g_traceEnabled = false;
+	FILE* file = fopen(g_tracePath.c_str(), "w");
+	if (!file) {
+		perror(g_tracePath.c_str());
+		return;
+	}
+
+	// Complete ("X") events, with times in microseconds from traceInit()
+	int pid = getpid();
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	const char* separator = "";
+	for (const TraceThread& thread : g_traceThreads) {
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+			separator, pid, thread.tid, thread.name);
+		separator = ",\n";
+	}
+	for (const TraceEvent& event : g_traceEvents) {
+		fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+			separator, event.name, pid, event.tid,
+			(event.begin - g_traceStart) / 1000.0, (event.end - event.begin) / 1000.0);
+		separator = ",\n";
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	if (g_traceDropped) {
+		fprintf(stderr, "shist: dropped %zu trace events past %u\n", g_traceDropped, TRACE_MAX_EVENTS);
+	}
+}
+
+}
+
+void traceInit()
+{
+	const char* path = getenv("SHIST_TRACE");
+	if (!path || !*path) {
+		return;
+	}
+	g_tracePath = path;
+	g_traceStart = traceNow();
+	g_traceEvents.reserve(1 << 16);
+	g_traceEnabled = true;
+	traceThreadName("main");
+	atexit(traceWrite);
+}
+
+void traceThreadName(const char* name)
+{
+	if (!g_traceEnabled) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(g_traceMutex);
+	g_traceThreads.push_back({currentThread(), name});
+}
+
+uint64_t traceNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000u + now.tv_nsec + 1;
+}
+
+void traceRecord(const char* name, uint64_t begin, uint64_t end)
+{
+	uint32_t tid = currentThread();
+	std::lock_guard<std::mutex> lock(g_traceMutex);
+	if (!g_traceEnabled) {
+		return;
+	}
+	if (g_traceEvents.size() >= TRACE_MAX_EVENTS) {
+		++g_traceDropped;
+		return;
+	}
+	g_traceEvents.push_back({name, begin, end, tid});
+}
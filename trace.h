@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+
+// Timing spans written as Chrome trace event JSON, for chrome://tracing or
+// ui.perfetto.dev. Running with SHIST_TRACE=<file> records them until exit.
+// Otherwise a span costs a load and a branch.
+//
+//   void History::filter(...)
+//   {
+//       TRACE_SCOPE("History::filter");
+//       ...
+
+// Spans are dropped past this many, so a long running daemon stays bounded
+#define TRACE_MAX_EVENTS (1u << 20)
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Times the rest of the enclosing scope. The name must outlive the process,
+// e.g. a string literal.
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+// Set by traceInit(), and cleared once the trace is written
+extern std::atomic<bool> g_traceEnabled;
+
+// Starts recording if SHIST_TRACE is set. The file is written at exit.
+void traceInit();
+
+// Names the calling thread in the trace
+void traceThreadName(const char* name);
+
+// Nanoseconds on a monotonic clock. Never zero.
+uint64_t traceNow();
+
+void traceRecord(const char* name, uint64_t begin, uint64_t end);
+
+class TraceScope {
+public:
+	TraceScope(const char* name)
+		: m_name(name)
+		, m_begin(g_traceEnabled.load(std::memory_order_relaxed) ? traceNow() : 0)
+	{
+	}
+
+	~TraceScope()
+	{
+		if (m_begin) {
+			traceRecord(m_name, m_begin, traceNow());
+		}
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+	const char* m_name;
+	uint64_t m_begin;
+};
@@ -0,0 +1,331 @@
+#include "trigramindex.h"
+#include "historyfile.h"
+#include "trace.h"
+#include <algorithm>
+#include <functional>
+
+namespace {
+
+struct TrigramEntry {
+	uint32_t key;
+	uint32_t line;
+};
+
+inline uint32_t trigramKey(const char* p)
+{
+	return (static_cast<uint32_t>(static_cast<unsigned char>(p[0])) << 16) |
+		(static_cast<uint32_t>(static_cast<unsigned char>(p[1])) << 8) |
+		static_cast<uint32_t>(static_cast<unsigned char>(p[2]));
+}
+
+// Stable LSD radix sort on the 24 bit key. Entries are generated in line
+// order, so each key's lines come out ascending.
+void sortEntries(std::vector<TrigramEntry>& entries, std::vector<TrigramEntry>& tmp)
+{
+	tmp.resize(entries.size());
+	for (int shift = 0; shift < 24; shift += 8) {
+		size_t counts[257] = {};
+		for (const TrigramEntry& e : entries) {
+			++counts[((e.key >> shift) & 0xff) + 1];
+		}
+		for (int i = 0; i < 256; ++i) {
+			counts[i + 1] += counts[i];
+		}
+		for (const TrigramEntry& e : entries) {
+			tmp[counts[(e.key >> shift) & 0xff]++] = e;
+		}
+		entries.swap(tmp);
+	}
+}
+
+// Postings from sorted entries
+void collectPostings(const std::vector<TrigramEntry>& entries, TrigramPostings& postings)
+{
+	postings.clear();
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (i == 0 || entries[i].key != entries[i - 1].key) {
+			postings.keys.push_back(entries[i].key);
+			postings.starts.push_back(postings.lines.size());
+		} else if (entries[i].line == entries[i - 1].line) {
+			// Trigram repeated within a line
+			continue;
+		}
+		postings.lines.push_back(entries[i].line);
+	}
+	postings.starts.push_back(postings.lines.size());
+}
+
+// Merge postings of consecutive runs of lines, concatenating each key's
+// lines in chunk order so they stay ascending
+void mergeChunks(const std::vector<TrigramPostings>& chunks, TrigramPostings& postings)
+{
+	size_t lines = 0, keys = 0;
+	for (const TrigramPostings& chunk : chunks) {
+		lines += chunk.lines.size();
+		keys = std::max(keys, chunk.keys.size());
+	}
+	postings.clear();
+	postings.keys.reserve(keys);
+	postings.starts.reserve(keys + 1);
+	postings.lines.reserve(lines);
+
+	// Each chunk's next key, smallest key and then earliest chunk on top
+	std::vector<std::pair<uint32_t, uint32_t>> heap;
+	std::vector<size_t> next(chunks.size(), 0);
+	for (size_t c = 0; c < chunks.size(); ++c) {
+		if (chunks[c].keys.size()) {
+			heap.push_back({chunks[c].keys[0], static_cast<uint32_t>(c)});
+		}
+	}
+	auto later = std::greater<std::pair<uint32_t, uint32_t>>();
+	std::make_heap(heap.begin(), heap.end(), later);
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), later);
+		uint32_t key = heap.back().first;
+		const TrigramPostings& chunk = chunks[heap.back().second];
+		size_t& i = next[heap.back().second];
+		if (postings.keys.empty() || postings.keys.back() != key) {
+			postings.keys.push_back(key);
+			postings.starts.push_back(postings.lines.size());
+		}
+		for (uint64_t j = chunk.starts[i]; j < chunk.starts[i + 1]; ++j) {
+			postings.lines.push_back(chunk.lines[j]);
+		}
+		if (++i < chunk.keys.size()) {
+			heap.back().first = chunk.keys[i];
+			std::push_heap(heap.begin(), heap.end(), later);
+		} else {
+			heap.pop_back();
+		}
+	}
+	postings.starts.push_back(postings.lines.size());
+}
+
+// Entries take 8 bytes per byte of the lines, twice over while sorting, so
+// they are sorted a chunk of lines at a time and the chunks' much smaller
+// postings merged
+void buildPostings(const HistoryFile& file, const uint32_t* lines, size_t count, TrigramPostings& postings)
+{
+	std::vector<TrigramEntry> entries;
+	std::vector<TrigramEntry> tmp;
+	std::vector<TrigramPostings> chunks;
+	for (size_t l = 0; l < count;) {
+		entries.clear();
+		for (; l < count; ++l) {
+			uint32_t index = lines[l];
+			std::string_view line = file.line(index);
+			if (entries.size() && entries.size() + line.size() > TRIGRAM_BUILD_CHUNK_ENTRIES) {
+				break;
+			}
+			for (size_t i = 0; i + TrigramIndex::MIN_PATTERN_SIZE <= line.size(); ++i) {
+				entries.push_back({trigramKey(line.data() + i), index});
+			}
+		}
+		sortEntries(entries, tmp);
+		chunks.emplace_back();
+		collectPostings(entries, chunks.back());
+	}
+
+	if (chunks.size() == 1) {
+		postings = std::move(chunks[0]);
+	} else {
+		mergeChunks(chunks, postings);
+	}
+}
+
+// Concatenate b's lines after a's for every key, leaving out removed lines.
+// All of b's lines must be greater than a's.
+void mergePostings(const TrigramPostings& a, const TrigramPostings& b, const std::vector<uint32_t>& removed, TrigramPostings& result)
+{
+	result.clear();
+	result.keys.reserve(std::max(a.keys.size(), b.keys.size()));
+	result.starts.reserve(std::max(a.keys.size(), b.keys.size()) + 1);
+	result.lines.reserve(a.lines.size() + b.lines.size());
+
+	auto append = [&result, &removed](const TrigramPostings& postings, size_t i) {
+		for (uint64_t j = postings.starts[i]; j < postings.starts[i + 1]; ++j) {
+			if (removed.empty() || !std::binary_search(removed.begin(), removed.end(), postings.lines[j])) {
+				result.lines.push_back(postings.lines[j]);
+			}
+		}
+	};
+
+	size_t i = 0, j = 0;
+	while (i < a.keys.size() || j < b.keys.size()) {
+		bool takeA = j == b.keys.size() || (i < a.keys.size() && a.keys[i] <= b.keys[j]);
+		bool takeB = i == a.keys.size() || (j < b.keys.size() && b.keys[j] <= a.keys[i]);
+		uint32_t key = takeA ? a.keys[i] : b.keys[j];
+		size_t start = result.lines.size();
+		if (takeA) {
+			append(a, i++);
+		}
+		if (takeB) {
+			append(b, j++);
+		}
+
+		// Drop keys whose lines were all removed
+		if (result.lines.size() != start) {
+			result.keys.push_back(key);
+			result.starts.push_back(start);
+		}
+	}
+	result.starts.push_back(result.lines.size());
+}
+
+// Keep the elements of result that are also in list. Gallops through list
+// when it is much larger than result, doubling a step from the last match
+// until it passes the next line, then binary searching within that step.
+void intersect(std::vector<uint32_t>& result, const uint32_t* list, size_t size)
+{
+	const uint32_t* end = list + size;
+	size_t kept = 0;
+	if (size > result.size() * 16) {
+		for (uint32_t line : result) {
+			size_t step = 1;
+			const uint32_t* bound = list;
+			while (bound != end && *bound < line) {
+				list = bound + 1;
+				bound = static_cast<size_t>(end - list) > step ? list + step : end;
+				step *= 2;
+			}
+			list = std::lower_bound(list, bound, line);
+			if (list == end) {
+				break;
+			}
+			if (*list == line) {
+				result[kept++] = line;
+			}
+		}
+	} else {
+		for (uint32_t line : result) {
+			while (list != end && *list < line) {
+				++list;
+			}
+			if (list == end) {
+				break;
+			}
+			if (*list == line) {
+				result[kept++] = line;
+			}
+		}
+	}
+	result.resize(kept);
+}
+}
+
+size_t TrigramPostings::find(uint32_t key) const
+{
+	const uint32_t* it = std::lower_bound(keys.data(), keys.data() + keys.size(), key);
+	if (it == keys.data() + keys.size() || *it != key) {
+		return keys.size();
+	}
+	return it - keys.data();
+}
+
+void TrigramPostings::clear()
+{
+	keys.clear();
+	starts.clear();
+	lines.clear();
+}
+
+void TrigramIndex::add(const HistoryFile& file, const uint32_t* lines, size_t count)
+{
+	if (count == 0) {
+		return;
+	}
+
+	TrigramPostings added;
+	buildPostings(file, lines, count, added);
+	if (m_delta.keys.empty()) {
+		m_delta = std::move(added);
+	} else {
+		TrigramPostings merged;
+		mergePostings(m_delta, added, std::vector<uint32_t>(), merged);
+		m_delta = std::move(merged);
+	}
+}
+
+void TrigramIndex::remove(const std::vector<uint32_t>& lines)
+{
+	m_removed.insert(m_removed.end(), lines.begin(), lines.end());
+	std::sort(m_removed.begin(), m_removed.end());
+}
+
+void TrigramIndex::merge()
+{
+	TRACE_SCOPE("TrigramIndex::merge");
+	if (m_delta.keys.empty() && m_removed.empty()) {
+		return;
+	}
+	if (m_base.keys.empty() && m_removed.empty()) {
+		m_base = std::move(m_delta);
+	} else {
+		TrigramPostings merged;
+		mergePostings(m_base, m_delta, m_removed, merged);
+		m_base = std::move(merged);
+	}
+	m_delta.clear();
+	m_removed.clear();
+}
+
+void TrigramIndex::clear()
+{
+	m_base.clear();
+	m_delta.clear();
+	m_removed.clear();
+}
+
+bool TrigramIndex::candidates(std::string_view pattern, std::vector<uint32_t>& result) const
+{
+	TRACE_SCOPE("TrigramIndex::candidates");
+	result.clear();
+	if (pattern.size() < MIN_PATTERN_SIZE) {
+		return false;
+	}
+
+	std::vector<uint32_t> keys;
+	for (size_t i = 0; i + MIN_PATTERN_SIZE <= pattern.size(); ++i) {
+		keys.push_back(trigramKey(pattern.data() + i));
+	}
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+	// Base lines all come before delta lines, so appending keeps the order
+	candidates(m_base, keys, result);
+	std::vector<uint32_t> deltaResult;
+	candidates(m_delta, keys, deltaResult);
+	result.insert(result.end(), deltaResult.begin(), deltaResult.end());
+
+	if (m_removed.size()) {
+		result.erase(std::remove_if(result.begin(), result.end(), [this](uint32_t line) {
+			return std::binary_search(m_removed.begin(), m_removed.end(), line);
+		}), result.end());
+	}
+	return true;
+}
+
+void TrigramIndex::candidates(const TrigramPostings& postings, const std::vector<uint32_t>& keys, std::vector<uint32_t>& result) const
+{
+	struct List {
+		const uint32_t* lines;
+		size_t size;
+	};
+
+	std::vector<List> lists;
+	for (uint32_t key : keys) {
+		size_t i = postings.find(key);
+		if (i == postings.keys.size()) {
+			// No line contains this trigram
+			return;
+		}
+		lists.push_back({postings.lines.data() + postings.starts[i], static_cast<size_t>(postings.starts[i + 1] - postings.starts[i])});
+	}
+
+	// Intersect smallest first so the working set shrinks as fast as possible
+	std::sort(lists.begin(), lists.end(), [](const List& a, const List& b) { return a.size < b.size; });
+	result.assign(lists[0].lines, lists[0].lines + lists[0].size);
+	for (size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+		intersect(result, lists[i].lines, lists[i].size);
+	}
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "mappedarray.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string_view>
+#include <vector>
+
+class HistoryFile;
+
+// Lines are indexed in chunks of about this many trigrams, each sorted on
+// its own, bounding the memory for sorting to 16 bytes per entry
+#define TRIGRAM_BUILD_CHUNK_ENTRIES (1 << 20)
+
+// Sorted trigram keys, each with an ascending list of the lines containing it.
+// Stored as three flat arrays so it can be used in place from the cache.
+struct TrigramPostings {
+	MappedArray<uint32_t> keys;
+	MappedArray<uint64_t> starts; // keys.size() + 1 offsets into lines
+	MappedArray<uint32_t> lines;
+
+	size_t find(uint32_t key) const;
+	void clear();
+};
+
+// Inverted index from every 3 byte substring to the lines containing it,
+// built over deduplicated lines. Lines appended after the index was built
+// go into a small delta, and lines they replace are filtered out, until
+// both are merged into the base when the full cache is rewritten.
+class TrigramIndex {
+public:
+	static const size_t MIN_PATTERN_SIZE = 3;
+
+	// Index lines, which must be ascending and after any already indexed
+	void add(const HistoryFile& file, const uint32_t* lines, size_t count);
+
+	// Stop returning lines, e.g. older copies of a line just added
+	void remove(const std::vector<uint32_t>& lines);
+
+	// Fold the delta and removals into the base
+	void merge();
+
+	void clear();
+
+	// Candidate lines that contain every trigram of pattern, in ascending
+	// order. They still need verifying. Returns false if the pattern is too
+	// short to use the index.
+	bool candidates(std::string_view pattern, std::vector<uint32_t>& result) const;
+
+	// Base postings, e.g. for writing to or borrowing from the cache
+	TrigramPostings& base() { return m_base; }
+	const TrigramPostings& base() const { return m_base; }
+
+	// Delta postings and removed lines, e.g. for a cache's delta segment
+	TrigramPostings& delta() { return m_delta; }
+	const TrigramPostings& delta() const { return m_delta; }
+	std::vector<uint32_t>& removed() { return m_removed; }
+	const std::vector<uint32_t>& removed() const { return m_removed; }
+
+private:
+	void candidates(const TrigramPostings& postings, const std::vector<uint32_t>& keys, std::vector<uint32_t>& result) const;
+
+	TrigramPostings m_base;
+	TrigramPostings m_delta;
+
+	// Sorted lines to leave out of candidates
+	std::vector<uint32_t> m_removed;
+};